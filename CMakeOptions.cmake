@@ -2,6 +2,7 @@ set(CONFIG_ACPI_IMPL "uacpi" CACHE STRING "acpi implementation to use")
 set_property(CACHE CONFIG_ACPI_IMPL PROPERTY STRINGS uacpi qacpi)
 
 option(CONFIG_LAZY_IRQL "Use lazy irql mechanism" ON)
+option(CONFIG_SELF_TESTS "Run memory manager and scheduler stress tests during boot" OFF)
 
 if(CONFIG_ACPI_IMPL STREQUAL "uacpi")
 	target_compile_definitions(crescent PRIVATE CONFIG_ACPI_UACPI)
@@ -42,6 +42,18 @@ NTKERNELAPI PVOID MmMapIoSpace(
 	MEMORY_CACHING_TYPE CacheType);
 NTKERNELAPI void MmUnmapIoSpace(PVOID BaseAddress, SIZE_T NumberOfBytes);
 
+typedef struct _DMA_POOL* PDMA_POOL;
+
+NTKERNELAPI PDMA_POOL MmCreateDmaPool(
+	SIZE_T BlockSize,
+	SIZE_T Alignment,
+	SIZE_T Boundary,
+	PHYSICAL_ADDRESS HighestAcceptableAddress,
+	MEMORY_CACHING_TYPE CacheType);
+NTKERNELAPI void MmDeleteDmaPool(PDMA_POOL Pool);
+NTKERNELAPI PVOID MmAllocateFromDmaPool(PDMA_POOL Pool, PPHYSICAL_ADDRESS PhysicalAddress);
+NTKERNELAPI void MmFreeToDmaPool(PDMA_POOL Pool, PVOID Block);
+
 typedef enum _BUS_DATA_TYPE {
 	PCIConfiguration = 4
 } BUS_DATA_TYPE;
@@ -1407,6 +1419,37 @@ NTKERNELAPI NTSTATUS KeDelayExecutionThread(
 	BOOLEAN Alertable,
 	PLARGE_INTEGER Interval);
 
+NTKERNELAPI void KeInitializeDpc(PKDPC Dpc, PKDEFERRED_ROUTINE DeferredRoutine, PVOID DeferredContext);
+
+typedef enum _TIMER_TYPE {
+	NotificationTimer,
+	SynchronizationTimer
+} TIMER_TYPE;
+
+typedef struct _KTIMER {
+	DISPATCHER_HEADER Header;
+	LIST_ENTRY TimerListEntry;
+	ULONGLONG DueTime;
+	ULONG_PTR WheelPosition;
+	PKDPC Dpc;
+	ULONG Processor;
+	ULONG Period;
+	ULONG TolerableDelay;
+} KTIMER, *PKTIMER;
+
+NTKERNELAPI void KeInitializeTimer(PKTIMER Timer);
+NTKERNELAPI void KeInitializeTimerEx(PKTIMER Timer, TIMER_TYPE Type);
+NTKERNELAPI BOOLEAN KeSetTimer(PKTIMER Timer, LARGE_INTEGER DueTime, PKDPC Dpc);
+NTKERNELAPI BOOLEAN KeSetTimerEx(PKTIMER Timer, LARGE_INTEGER DueTime, LONG Period, PKDPC Dpc);
+NTKERNELAPI BOOLEAN KeSetCoalescableTimer(
+	PKTIMER Timer,
+	LARGE_INTEGER DueTime,
+	ULONG Period,
+	ULONG TolerableDelay,
+	PKDPC Dpc);
+NTKERNELAPI BOOLEAN KeCancelTimer(PKTIMER Timer);
+NTKERNELAPI BOOLEAN KeReadStateTimer(PKTIMER Timer);
+
 #define CONTAINING_RECORD(ptr, type, field) ((type*) ((PCHAR) (ptr) - offsetof(type, field)))
 
 #ifdef __cplusplus
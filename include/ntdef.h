@@ -134,6 +134,8 @@ typedef LONG NTSTATUS;
 #define STATUS_UNWIND_CONSOLIDATE (NTSTATUS) 0x80000029
 #define STATUS_UNSUCCESSFUL (NTSTATUS) 0xC0000001
 #define STATUS_NOT_IMPLEMENTED (NTSTATUS) 0xC0000002
+#define STATUS_INVALID_INFO_CLASS (NTSTATUS) 0xC0000003
+#define STATUS_INFO_LENGTH_MISMATCH (NTSTATUS) 0xC0000004
 #define STATUS_ACCESS_VIOLATION (NTSTATUS) 0xC0000005
 #define STATUS_INVALID_HANDLE (NTSTATUS) 0xC0000008
 #define STATUS_INVALID_CID (NTSTATUS) 0xC000000B
@@ -141,21 +143,37 @@ typedef LONG NTSTATUS;
 #define STATUS_INVALID_DEVICE_REQUEST (NTSTATUS) 0xC0000010
 #define STATUS_MORE_PROCESSING_REQUIRED (NTSTATUS) 0xC0000016
 #define STATUS_NO_MEMORY (NTSTATUS) 0xC0000017
+#define STATUS_CONFLICTING_ADDRESSES (NTSTATUS) 0xC0000018
+#define STATUS_NOT_MAPPED_VIEW (NTSTATUS) 0xC0000019
+#define STATUS_UNABLE_TO_FREE_VM (NTSTATUS) 0xC000001A
+#define STATUS_INVALID_VIEW_SIZE (NTSTATUS) 0xC000001F
 #define STATUS_ACCESS_DENIED (NTSTATUS) 0xC0000022
 #define STATUS_BUFFER_TOO_SMALL (NTSTATUS) 0xC0000023
 #define STATUS_OBJECT_TYPE_MISMATCH (NTSTATUS) 0xC0000024
 #define STATUS_NONCONTINUABLE_EXCEPTION (NTSTATUS) 0xC0000025
 #define STATUS_INVALID_DISPOSITION (NTSTATUS) 0xC0000026
 #define STATUS_UNWIND (NTSTATUS) 0xC0000027
+#define STATUS_NOT_COMMITTED (NTSTATUS) 0xC000002D
 #define STATUS_OBJECT_NAME_INVALID (NTSTATUS) 0xC0000033
 #define STATUS_OBJECT_NAME_NOT_FOUND (NTSTATUS) 0xC0000034
 #define STATUS_OBJECT_NAME_COLLISION (NTSTATUS) 0xC0000035
 #define STATUS_OBJECT_PATH_INVALID (NTSTATUS) 0xC0000039
 #define STATUS_OBJECT_PATH_NOT_FOUND (NTSTATUS) 0xC000003A
 #define STATUS_OBJECT_PATH_SYNTAX_BAD (NTSTATUS) 0xC000003B
+#define STATUS_INVALID_PAGE_PROTECTION (NTSTATUS) 0xC0000045
+#define STATUS_SECTION_PROTECTION (NTSTATUS) 0xC000004E
 #define STATUS_INSUFFICIENT_RESOURCES (NTSTATUS) 0xC000009A
+#define STATUS_FREE_VM_NOT_AT_BASE (NTSTATUS) 0xC000009F
+#define STATUS_MEMORY_NOT_ALLOCATED (NTSTATUS) 0xC00000A0
 #define STATUS_INVALID_PARAMETER_1 (NTSTATUS) 0xC00000EF
+#define STATUS_INVALID_PARAMETER_2 (NTSTATUS) 0xC00000F0
+#define STATUS_INVALID_PARAMETER_3 (NTSTATUS) 0xC00000F1
+#define STATUS_INVALID_PARAMETER_4 (NTSTATUS) 0xC00000F2
+#define STATUS_INVALID_PARAMETER_5 (NTSTATUS) 0xC00000F3
+#define STATUS_INVALID_PARAMETER_6 (NTSTATUS) 0xC00000F4
 #define STATUS_NOT_FOUND (NTSTATUS) 0xC0000225
+#define STATUS_BAD_COMPRESSION_BUFFER (NTSTATUS) 0xC0000242
+#define STATUS_UNSUPPORTED_COMPRESSION (NTSTATUS) 0xC000025F
 #define STATUS_REPARSE_POINT_ENCOUNTERED (NTSTATUS) 0xC000050B
 #define STATUS_ALREADY_REGISTERED (NTSTATUS) 0xC0000718
 
@@ -7,4 +7,13 @@
 #define SYS_READ_FILE 4
 #define SYS_CLOSE 5
 #define SYS_CONTINUE 6
-#define SYS_MAX 7
+#define SYS_CREATE_SECTION 7
+#define SYS_MAP_VIEW_OF_SECTION 8
+#define SYS_UNMAP_VIEW_OF_SECTION 9
+#define SYS_QUERY_VIRTUAL_MEMORY 10
+#define SYS_QUERY_INFORMATION_PROCESS 11
+#define SYS_CREATE_TIMER 12
+#define SYS_SET_TIMER 13
+#define SYS_CANCEL_TIMER 14
+#define SYS_WAIT_FOR_SINGLE_OBJECT 15
+#define SYS_MAX 16
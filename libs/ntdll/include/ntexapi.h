@@ -0,0 +1,41 @@
+#ifndef _NTEXAPI_H
+#define _NTEXAPI_H
+
+#include "ntapi.h"
+#include "ntdef.h"
+#include "winternl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TIMER_QUERY_STATE 1
+#define TIMER_MODIFY_STATE 2
+
+typedef enum _TIMER_TYPE {
+	NotificationTimer,
+	SynchronizationTimer
+} TIMER_TYPE;
+
+typedef void (*PTIMER_APC_ROUTINE)(PVOID TimerContext, ULONG TimerLowValue, LONG TimerHighValue);
+
+NTAPI NTSTATUS NtCreateTimer(
+	PHANDLE TimerHandle,
+	ACCESS_MASK DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	TIMER_TYPE TimerType);
+NTAPI NTSTATUS NtSetTimer(
+	HANDLE TimerHandle,
+	PLARGE_INTEGER DueTime,
+	PTIMER_APC_ROUTINE TimerApcRoutine,
+	PVOID TimerContext,
+	BOOLEAN ResumeTimer,
+	LONG Period,
+	BOOLEAN* PreviousState);
+NTAPI NTSTATUS NtCancelTimer(HANDLE TimerHandle, BOOLEAN* CurrentState);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "ntapi.h"
 #include "ntdef.h"
+#include "winternl.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,6 +23,32 @@ extern "C" {
 
 #define MEM_DECOMMIT 0x4000
 #define MEM_RELEASE 0x8000
+#define MEM_FREE 0x10000
+#define MEM_PRIVATE 0x20000
+#define MEM_MAPPED 0x40000
+
+#define SEC_RESERVE 0x4000000
+#define SEC_COMMIT 0x8000000
+
+typedef enum _SECTION_INHERIT {
+	ViewShare = 1,
+	ViewUnmap = 2
+} SECTION_INHERIT;
+
+typedef enum _MEMORY_INFORMATION_CLASS {
+	MemoryBasicInformation
+} MEMORY_INFORMATION_CLASS;
+
+typedef struct _MEMORY_BASIC_INFORMATION {
+	PVOID BaseAddress;
+	PVOID AllocationBase;
+	ULONG AllocationProtect;
+	USHORT PartitionId;
+	SIZE_T RegionSize;
+	ULONG State;
+	ULONG Protect;
+	ULONG Type;
+} MEMORY_BASIC_INFORMATION, *PMEMORY_BASIC_INFORMATION;
 
 NTAPI NTSTATUS NtAllocateVirtualMemory(
 	HANDLE ProcessHandle,
@@ -41,6 +68,34 @@ NTAPI NTSTATUS NtProtectVirtualMemory(
 	PSIZE_T RegionSize,
 	ULONG NewProtection,
 	PULONG OldProtection);
+NTAPI NTSTATUS NtQueryVirtualMemory(
+	HANDLE ProcessHandle,
+	PVOID BaseAddress,
+	MEMORY_INFORMATION_CLASS MemoryInformationClass,
+	PVOID MemoryInformation,
+	SIZE_T MemoryInformationLength,
+	PSIZE_T ReturnLength);
+
+NTAPI NTSTATUS NtCreateSection(
+	PHANDLE SectionHandle,
+	ACCESS_MASK DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	PLARGE_INTEGER MaximumSize,
+	ULONG SectionPageProtection,
+	ULONG AllocationAttributes,
+	HANDLE FileHandle);
+NTAPI NTSTATUS NtMapViewOfSection(
+	HANDLE SectionHandle,
+	HANDLE ProcessHandle,
+	PVOID* BaseAddress,
+	ULONG_PTR ZeroBits,
+	SIZE_T CommitSize,
+	PLARGE_INTEGER SectionOffset,
+	PSIZE_T ViewSize,
+	SECTION_INHERIT InheritDisposition,
+	ULONG AllocationType,
+	ULONG Win32Protect);
+NTAPI NTSTATUS NtUnmapViewOfSection(HANDLE ProcessHandle, PVOID BaseAddress);
 
 #ifdef __cplusplus
 }
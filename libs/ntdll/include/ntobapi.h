@@ -0,0 +1,21 @@
+#ifndef _NTOBAPI_H
+#define _NTOBAPI_H
+
+#include "ntapi.h"
+#include "ntdef.h"
+#include "winternl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+NTAPI NTSTATUS NtWaitForSingleObject(
+	HANDLE Handle,
+	BOOLEAN Alertable,
+	PLARGE_INTEGER Timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,26 @@
+#include "ntexapi.h"
+#include "syscall.hpp"
+#include "syscalls.hpp"
+
+NTAPI NTSTATUS NtCreateTimer(
+	PHANDLE timer_handle,
+	ACCESS_MASK desired_access,
+	POBJECT_ATTRIBUTES object_attributes,
+	TIMER_TYPE timer_type) {
+	DO_SYSCALL(SYS_CREATE_TIMER);
+}
+
+NTAPI NTSTATUS NtSetTimer(
+	HANDLE timer_handle,
+	PLARGE_INTEGER due_time,
+	PTIMER_APC_ROUTINE timer_apc_routine,
+	PVOID timer_context,
+	BOOLEAN resume_timer,
+	LONG period,
+	BOOLEAN* previous_state) {
+	DO_SYSCALL(SYS_SET_TIMER);
+}
+
+NTAPI NTSTATUS NtCancelTimer(HANDLE timer_handle, BOOLEAN* current_state) {
+	DO_SYSCALL(SYS_CANCEL_TIMER);
+}
@@ -28,3 +28,42 @@ NTAPI NTSTATUS NtProtectVirtualMemory(
 	PULONG old_protection) {
 	DO_SYSCALL(SYS_PROTECT_VIRTUAL_MEMORY);
 }
+
+NTAPI NTSTATUS NtQueryVirtualMemory(
+	HANDLE process_handle,
+	PVOID base_address,
+	MEMORY_INFORMATION_CLASS memory_info_class,
+	PVOID memory_info,
+	SIZE_T memory_info_length,
+	PSIZE_T return_length) {
+	DO_SYSCALL(SYS_QUERY_VIRTUAL_MEMORY);
+}
+
+NTAPI NTSTATUS NtCreateSection(
+	PHANDLE section_handle,
+	ACCESS_MASK desired_access,
+	POBJECT_ATTRIBUTES object_attributes,
+	PLARGE_INTEGER maximum_size,
+	ULONG section_page_protection,
+	ULONG allocation_attributes,
+	HANDLE file_handle) {
+	DO_SYSCALL(SYS_CREATE_SECTION);
+}
+
+NTAPI NTSTATUS NtMapViewOfSection(
+	HANDLE section_handle,
+	HANDLE process_handle,
+	PVOID* base_address,
+	ULONG_PTR zero_bits,
+	SIZE_T commit_size,
+	PLARGE_INTEGER section_offset,
+	PSIZE_T view_size,
+	SECTION_INHERIT inherit_disposition,
+	ULONG allocation_type,
+	ULONG win32_protect) {
+	DO_SYSCALL(SYS_MAP_VIEW_OF_SECTION);
+}
+
+NTAPI NTSTATUS NtUnmapViewOfSection(HANDLE process_handle, PVOID base_address) {
+	DO_SYSCALL(SYS_UNMAP_VIEW_OF_SECTION);
+}
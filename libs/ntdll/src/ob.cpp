@@ -0,0 +1,10 @@
+#include "ntobapi.h"
+#include "syscall.hpp"
+#include "syscalls.hpp"
+
+NTAPI NTSTATUS NtWaitForSingleObject(
+	HANDLE handle,
+	BOOLEAN alertable,
+	PLARGE_INTEGER timeout) {
+	DO_SYSCALL(SYS_WAIT_FOR_SINGLE_OBJECT);
+}
@@ -6,3 +6,12 @@
 NTAPI NTSTATUS NtContinue(PCONTEXT ThreadContext, BOOLEAN TestAlert) {
 	DO_SYSCALL(SYS_CONTINUE);
 }
+
+NTAPI NTSTATUS NtQueryInformationProcess(
+	HANDLE process_handle,
+	PROCESSINFOCLASS process_info_class,
+	PVOID process_info,
+	ULONG process_info_length,
+	PULONG return_length) {
+	DO_SYSCALL(SYS_QUERY_INFORMATION_PROCESS);
+}
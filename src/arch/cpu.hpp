@@ -1,8 +1,10 @@
 #pragma once
 #include "arch/arch_cpu.hpp"
 #include "sched/sched.hpp"
+#include "sched/timer.hpp"
 #include "ntdef.h"
 #include "utils/spinlock.hpp"
+#include "mem/kernel_stack.hpp"
 
 [[noreturn]] void sched_idle_fn(void*);
 
@@ -10,12 +12,14 @@ struct Cpu : public ArchCpu {
 	constexpr explicit Cpu(u32 number) : ArchCpu {number} {}
 
 	Scheduler scheduler {this};
+	TimerQueue timer_queue {this};
 	Thread idle_thread {u"idle", this, &*KERNEL_PROCESS, false, sched_idle_fn, nullptr};
 	u64 cycles_per_clock_interval {};
 	SINGLE_LIST_ENTRY dpc_list_head {};
 	SINGLE_LIST_ENTRY* dpc_list_tail {};
 	KSPIN_LOCK dpc_list_lock {};
 	bool quantum_end {};
+	KernelStackCache kernel_stack_cache {};
 };
 
 extern kstd::vector<Cpu*> CPUS;
@@ -11,3 +11,8 @@ void register_irq_handler(KINTERRUPT* irq);
 void deregister_irq_handler(KINTERRUPT* irq);
 
 void arch_request_software_irq(KIRQL level);
+
+struct Cpu;
+
+// interrupts the cpu to run its scheduler
+void arch_send_reschedule_ipi(Cpu* cpu);
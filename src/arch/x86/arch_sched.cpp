@@ -3,9 +3,11 @@
 #include "arch/cpu.hpp"
 #include "cpu.hpp"
 #include "mem/vspace.hpp"
+#include "mem/kernel_stack.hpp"
 #include "simd_state.hpp"
 #include "arch/arch_irq.hpp"
 #include "sched/apc.hpp"
+#include "cstring.hpp"
 
 asm(".intel_syntax noprefix");
 
@@ -38,7 +40,7 @@ sched_switch_thread:
 	mov [rcx + 8], rsp
 
 	// current->lock = false
-	mov qword ptr [rcx + 176], 0
+	mov qword ptr [rcx + 184], 0
 
 	mov rsp, [rdx + 8]
 
@@ -117,11 +119,6 @@ struct UserInitFrame {
 	KTRAP_FRAME trap_frame;
 };
 
-namespace {
-	constexpr usize KERNEL_STACK_SIZE = 1024 * 64;
-	constexpr usize USER_STACK_SIZE = 1024 * 1024;
-}
-
 asm(R"(
 .pushsection .text
 .globl arch_on_first_switch
@@ -196,25 +193,21 @@ arch_on_first_switch_user_asm:
 extern "C" void arch_on_first_switch_user_asm(void* arg);
 
 ArchThread::ArchThread(void (*fn)(void*), void* arg, Process* process, bool user) {
-	kernel_stack_base = new u8[KERNEL_STACK_SIZE + PAGE_SIZE] {};
-	syscall_sp = kernel_stack_base + KERNEL_STACK_SIZE + PAGE_SIZE;
-	sp = kernel_stack_base + KERNEL_STACK_SIZE + PAGE_SIZE -
-		(user ? sizeof(UserInitFrame) : sizeof(InitFrame));
+	kernel_stack_base = static_cast<u8*>(kernel_stack_alloc());
+	assert(kernel_stack_base);
+	syscall_sp = kernel_stack_base + KERNEL_STACK_SIZE;
+
+	// the stack isn't zeroed, only the initial frame is
+	usize frame_size = user ? sizeof(UserInitFrame) : sizeof(InitFrame);
+	sp = kernel_stack_base + KERNEL_STACK_SIZE - frame_size;
+	memset(sp, 0, frame_size);
 	auto* frame = reinterpret_cast<InitFrame*>(sp);
 
-	KERNEL_MAP->protect(reinterpret_cast<u64>(kernel_stack_base), PageFlags::Read, CacheMode::WriteBack);
-
 	if (user) {
-		user_stack_base = process->allocate(
-			nullptr,
-			USER_STACK_SIZE + PAGE_SIZE,
-			PageFlags::Read | PageFlags::Write,
-			MappingFlags::Backed,
-			nullptr);
+		user_stack_size = ALIGNUP(process->stack_reserve, ALLOCATION_GRANULARITY);
+		user_stack_base = process->allocate_stack(user_stack_size, process->stack_commit);
 		assert(user_stack_base);
 
-		process->page_map.protect(user_stack_base, PageFlags::User | PageFlags::Read, CacheMode::WriteBack);
-
 		auto simd_size = CPU_FEATURES.xsave ? CPU_FEATURES.xsave_area_size : sizeof(FxState);
 		simd = static_cast<u8*>(KERNEL_VSPACE.alloc_backed(0, simd_size, PageFlags::Read | PageFlags::Write));
 		assert(simd);
@@ -231,7 +224,7 @@ ArchThread::ArchThread(void (*fn)(void*), void* arg, Process* process, bool user
 		user_frame->trap_frame.rip = reinterpret_cast<u64>(fn);
 		user_frame->trap_frame.seg_cs = 40 | 3;
 		user_frame->trap_frame.eflags = 0x202;
-		user_frame->trap_frame.rsp = user_stack_base + USER_STACK_SIZE + PAGE_SIZE;
+		user_frame->trap_frame.rsp = user_stack_base + user_stack_size;
 		user_frame->trap_frame.seg_ss = 32 | 3;
 		user_frame->trap_frame.rcx = reinterpret_cast<u64>(arg);
 
@@ -245,9 +238,9 @@ ArchThread::ArchThread(void (*fn)(void*), void* arg, Process* process, bool user
 }
 
 ArchThread::~ArchThread() {
-	kfree(kernel_stack_base, KERNEL_STACK_SIZE + PAGE_SIZE);
+	kernel_stack_free(kernel_stack_base);
 	if (user_stack_base) {
-		static_cast<Thread*>(this)->process->free(user_stack_base, USER_STACK_SIZE + PAGE_SIZE);
+		static_cast<Thread*>(this)->process->free(user_stack_base, user_stack_size);
 	}
 	if (simd) {
 		auto simd_size = CPU_FEATURES.xsave ? CPU_FEATURES.xsave_area_size : sizeof(FxState);
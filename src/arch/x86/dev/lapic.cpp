@@ -5,6 +5,7 @@
 #include "arch/x86/cpu.hpp"
 #include "x86/irq.hpp"
 #include "dev/irq.hpp"
+#include "utils/irq_guard.hpp"
 
 namespace regs {
 	static constexpr BasicRegister<u32> TPR {0x80};
@@ -134,6 +135,16 @@ void lapic_ipi_self(u8 vec) {
 		icr::DEST_SHORTHAND(icr::DEST_SELF));
 }
 
+void lapic_ipi(u32 lapic_id, u8 vec) {
+	// the destination and the command have to be written without another ipi in between
+	IrqGuard irq_guard {};
+	SPACE.store(regs::ICR1, icr::DEST(lapic_id));
+	SPACE.store(
+		regs::ICR0,
+		icr::VECTOR(vec) |
+		icr::LEVEL(true));
+}
+
 void lapic_eoi() {
 	SPACE.store(regs::EOI, 0);
 }
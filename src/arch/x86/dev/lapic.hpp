@@ -19,4 +19,5 @@ struct Cpu;
 void lapic_first_init();
 void lapic_init(Cpu* cpu, bool initial);
 void lapic_ipi_self(u8 vec);
+void lapic_ipi(u32 lapic_id, u8 vec);
 void lapic_eoi();
@@ -4,6 +4,7 @@
 #include <hz/manually_init.hpp>
 
 struct Thread;
+class PageMap;
 
 struct ArchCpu {
 	constexpr explicit ArchCpu(u32 number) : legacy_number {static_cast<u8>(number)}, number {number} {}
@@ -29,6 +30,11 @@ struct ArchCpu {
 	Thread* next_thread {};
 	u8 pad4[12] {};
 	u32 number {};
+
+	// the page map currently loaded on the cpu
+	PageMap* page_map {};
+	// set once the cpu can handle ipis
+	bool ipi_ready {};
 };
 
 static_assert(offsetof(ArchCpu, irql) == 8);
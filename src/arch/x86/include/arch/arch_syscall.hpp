@@ -128,4 +128,19 @@ struct SyscallFrame : KTRAP_FRAME {
 			return false;
 		}
 	}
+
+	[[nodiscard]] inline bool arg9(u64& value) const {
+		auto* ptr = reinterpret_cast<usize*>(rsp + 80);
+		enable_user_access();
+		__try {
+			ProbeForRead(ptr, 8, 8);
+			value = *ptr;
+			disable_user_access();
+			return true;
+		}
+		__except (1) {
+			disable_user_access();
+			return false;
+		}
+	}
 };
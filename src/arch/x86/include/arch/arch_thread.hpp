@@ -16,6 +16,7 @@ struct ArchThread {
 	usize handler_sp {};
 	u8* kernel_stack_base {};
 	usize user_stack_base {};
+	usize user_stack_size {};
 	u8* simd {};
 
 	u64 fs_base {};
@@ -6,6 +6,7 @@
 #include "caching.hpp"
 #include <hz/manually_init.hpp>
 #include <hz/list.hpp>
+#include <hz/atomic.hpp>
 
 enum class PageFlags {
 	Read = 1 << 0,
@@ -15,23 +16,68 @@ enum class PageFlags {
 };
 FLAGS_ENUM(PageFlags);
 
+constexpr usize LARGE_PAGE_SIZE = 0x200000;
+constexpr usize HUGE_PAGE_SIZE = 0x40000000;
+
 class PageMap {
 public:
 	struct OnlyKernel {};
 
 	explicit PageMap(PageMap* kernel_map);
-	PageMap(const PageMap& other, OnlyKernel) : level0 {other.level0}, used_pages {other.used_pages} {}
+	PageMap(const PageMap& other, OnlyKernel) : level0 {other.level0} {}
 	~PageMap();
 
+	[[nodiscard]] bool map_1gb(u64 virt, u64 phys, PageFlags flags, CacheMode cache_mode);
+	// fails if a table of 4k pages is present at virt
 	[[nodiscard]] bool map_2mb(u64 virt, u64 phys, PageFlags flags, CacheMode cache_mode);
 	[[nodiscard]] bool map(u64 virt, u64 phys, PageFlags flags, CacheMode cache_mode);
-	void protect(u64 virt, PageFlags flags, CacheMode cache_mode);
+	// returns false if virt is in a large page that couldn't be split, the page then keeps its protection
+	bool protect(u64 virt, PageFlags flags, CacheMode cache_mode);
+	// splits the large page containing virt so that unmapping or protecting the pages in it can't fail,
+	// returns false if there wasn't memory for the table
+	[[nodiscard]] bool split(u64 virt);
 
+	// translation doesn't take the lock, page tables are only freed once no walk is in progress.
+	// only present pages are translated
 	[[nodiscard]] u64 get_phys(u64 virt);
+	void get_phys_range(u64 virt, usize count, u64* phys);
+	// like get_phys but also returns the frame of a page that was made non-present, e.g. with
+	// a protection without read access
+	[[nodiscard]] u64 get_frame(u64 virt);
+	void get_frame_range(u64 virt, usize count, u64* phys);
+	[[nodiscard]] bool is_present(u64 virt);
+
+	// returns the frame of a present 4k page that wasn't accessed since the last call and makes it
+	// non-present with the frame kept in the entry, the accessed bit of other pages is cleared.
+	// the caller has to flush the page before reading or freeing the frame
+	[[nodiscard]] u64 take_cold_page(u64 virt, PageFlags& flags);
+	// replaces a non-present entry with a marker holding a 40-bit value, markers are never
+	// translated and are removed with unmap or replaced with map
+	void set_marker(u64 virt, u64 value);
+	// returns the value of the marker at virt or 0
+	[[nodiscard]] u64 get_marker(u64 virt);
 
-	void unmap(u64 virt);
+	// without flush the stale translation stays in the tlb until the caller invalidates it,
+	// it is still flushed if a page table was freed. returns false if virt is in a large page
+	// that couldn't be split, the page then stays mapped
+	bool unmap(u64 virt, bool flush = true);
+	// unmaps the whole lower half in one pass and frees its page tables, the frames of every
+	// leaf table are reported to fn first. the map must not be in use on any cpu
+	void unmap_user_half(void (*fn)(void* arg, u64 virt, const u64* phys, usize count), void* arg);
+	// returns the physical address of the removed 2mb page or 0 if there is none at virt
+	u64 unmap_2mb(u64 virt);
 	void use();
 
+	// allocates the last level tables of a 2mb aligned range up front, they are never freed
+	// so mapping in the range doesn't allocate and unmapping never frees a table
+	[[nodiscard]] bool preallocate_tables(u64 virt, usize size);
+	// invalidates the translations of count pages starting at virt on the current cpu
+	static void invalidate(u64 virt, usize count);
+	static void invalidate_all();
+	// invalidates the translations of count pages starting at virt on every cpu that might have
+	// them cached and waits for it to be done, kernel addresses are invalidated on every cpu
+	void flush(u64 virt, usize count);
+
 	constexpr bool operator==(const PageMap& other) const {
 		return level0 == other.level0;
 	}
@@ -40,8 +86,32 @@ public:
 
 	[[nodiscard]] u64 get_top_level_phys() const;
 
+	[[nodiscard]] usize get_page_table_size() const {
+		return page_table_pages * PAGE_SIZE;
+	}
+
+	[[nodiscard]] usize get_large_page_count() const {
+		return large_pages;
+	}
+
 private:
+	u64* lookup(u64 virt, u64& page_size);
+	u64* lookup_4k(u64 virt);
+	u64* get_or_alloc_table(u64* parent, u64 index, u64 flags);
+	void add_entry(u64* table);
+	bool remove_entry(u64* table);
+	void free_table(u64* table, hz::list<Page, &Page::hook>& tables);
+	u64* split_1gb(u64* level1, u64 index, u64 virt);
+	u64* split_2mb(u64* level2, u64 index, u64 virt);
+	void walk_range(u64 virt, usize count, u64* phys, bool only_present);
+	static void free_tables(hz::list<Page, &Page::hook>& tables);
+	static void shootdown(u64 cpus, u64 virt, usize count);
+
 	u64* level0;
 	hz::list<Page, &Page::hook> used_pages {};
+	// the cpus that have the map loaded
+	hz::atomic<u64> active_cpus {};
+	usize page_table_pages {};
+	usize large_pages {};
 	KSPIN_LOCK lock {};
 };
@@ -1,5 +1,12 @@
 #include "arch/irq.hpp"
 #include "utils/except_internals.hpp"
+#include "sched/process.hpp"
+#include "arch/arch_sched.hpp"
+#include "mem/kernel_stack.hpp"
+
+extern "C" usize MmUserProbeAddress;
+
+constexpr u32 EFLAGS_IF = 1 << 9;
 
 struct Frame {
 	Frame* rbp;
@@ -41,7 +48,6 @@ GENERATE_HANDLER(overflow, "overflow")
 GENERATE_HANDLER(bound_range_exceeded, "bound range exceeded")
 GENERATE_HANDLER(invalid_op, "invalid opcode")
 GENERATE_HANDLER(device_not_available, "device not available")
-GENERATE_HANDLER(double_fault, "double fault")
 GENERATE_HANDLER(invalid_tss, "invalid tss")
 GENERATE_HANDLER(seg_not_present, "segment not present")
 GENERATE_HANDLER(stack_seg_fault, "stack segment fault")
@@ -55,6 +61,18 @@ GENERATE_HANDLER(hypervisor_injection_exception, "hypervisor injection exception
 GENERATE_HANDLER(vmm_comm_exception, "vmm communication exception")
 GENERATE_HANDLER(security_exception, "security exception")
 
+extern "C" [[gnu::used]] bool x86_double_fault_handler(KEXCEPTION_FRAME* ex_frame) {
+	auto* frame = reinterpret_cast<KTRAP_FRAME*>(ex_frame->trap_frame);
+
+	u64 cr2;
+	asm volatile("mov %0, cr2" : "=r"(cr2));
+
+	if (kernel_stack_is_guard(cr2)) {
+		panic("[kernel][x86]: EXCEPTION: kernel stack overflow at ", Fmt::Hex, frame->rip, " (", cr2, ")", Fmt::Reset);
+	}
+	panic("[kernel][x86]: EXCEPTION: double fault at ", Fmt::Hex, frame->rip, Fmt::Reset);
+}
+
 extern "C" [[gnu::used]] bool x86_gp_fault_handler(KEXCEPTION_FRAME* ex_frame) {
 	auto* frame = reinterpret_cast<KTRAP_FRAME*>(ex_frame->trap_frame);
 	println("[kernel][x86]: EXCEPTION: general protection fault at ", Fmt::Hex, frame->rip, Fmt::Reset);
@@ -78,6 +96,38 @@ extern "C" [[gnu::used]] bool x86_pagefault_handler(KEXCEPTION_FRAME* ex_frame)
 
 	auto error = frame->error_code;
 
+	// user faults are resolved with interrupts enabled like a syscall, the mapping lock might be held
+	// by a cpu that waits for this one to take a tlb shootdown ipi. if the faulting code had them
+	// disabled it can't be waited for and the fault is treated as an access violation.
+	if (cr2 < MmUserProbeAddress && (frame->eflags & EFLAGS_IF)) {
+		if (frame->previous_mode == UserMode) {
+			asm volatile("swapgs");
+		}
+		asm volatile("sti");
+
+		bool handled = false;
+		auto* process = get_current_thread()->process;
+		if (process->user) {
+			// non present user page, try to commit it if it belongs to a demand-zero mapping
+			if (!(error & 1)) {
+				handled = process->commit_page(cr2);
+			}
+			// write to a present user page, it might still be shared by a copy-on-write view
+			else if (error & 1 << 1) {
+				handled = process->copy_on_write(cr2);
+			}
+		}
+
+		asm volatile("cli");
+		if (frame->previous_mode == UserMode) {
+			asm volatile("swapgs");
+		}
+
+		if (handled) {
+			return true;
+		}
+	}
+
 	const char* who;
 	if (error & 1 << 2) {
 		who = "userspace";
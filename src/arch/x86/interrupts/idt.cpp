@@ -34,6 +34,8 @@ void x86_init_idt() {
 	for (u32 i = 0; i < 32; ++i) {
 		set_idt_entry(i, X86_EXC_STUBS[i], 0x8, 0, 0);
 	}
+	// a double fault caused by a kernel stack overflow can't use the overflowed stack
+	set_idt_entry(8, X86_EXC_STUBS[8], 0x8, 1, 0);
 
 	for (u32 i = 32; i < 256; ++i) {
 		set_idt_entry(i, X86_IRQ_STUBS[i - 32], 0x8, 0, 0);
@@ -6,6 +6,7 @@
 #include "arch/irql.hpp"
 #include "assert.hpp"
 #include "dev/irq.hpp"
+#include "arch/cpu.hpp"
 
 namespace {
 	u32 USED_IRQS[256 / 32] {};
@@ -159,6 +160,8 @@ extern "C" [[gnu::used]] void arch_irq_handler(KTRAP_FRAME* frame) {
 
 extern KINTERRUPT DISPATCH_IRQ_HANDLER;
 extern KINTERRUPT APC_IRQ_HANDLER;
+extern KINTERRUPT RESCHEDULE_IRQ_HANDLER;
+extern KINTERRUPT TLB_SHOOTDOWN_IRQ_HANDLER;
 
 void x86_irq_init() {
 	// manually set apc vector as it is the reserved entry
@@ -169,8 +172,22 @@ void x86_irq_init() {
 	assert(vec == DISPATCH_LEVEL << 4);
 	DISPATCH_IRQ_HANDLER.vector = vec;
 	register_irq_handler(&DISPATCH_IRQ_HANDLER);
+
+	vec = x86_alloc_irq(1, IPI_LEVEL, false);
+	assert(vec);
+	RESCHEDULE_IRQ_HANDLER.vector = vec;
+	register_irq_handler(&RESCHEDULE_IRQ_HANDLER);
+
+	vec = x86_alloc_irq(1, IPI_LEVEL, false);
+	assert(vec);
+	TLB_SHOOTDOWN_IRQ_HANDLER.vector = vec;
+	register_irq_handler(&TLB_SHOOTDOWN_IRQ_HANDLER);
 }
 
 void arch_request_software_irq(KIRQL level) {
 	lapic_ipi_self(level << 4);
 }
+
+void arch_send_reschedule_ipi(Cpu* cpu) {
+	lapic_ipi(cpu->lapic_id, RESCHEDULE_IRQ_HANDLER.vector);
+}
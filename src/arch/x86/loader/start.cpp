@@ -5,6 +5,7 @@
 #include "cxx.hpp"
 #include "limine.h"
 #include "arch/x86/cpu.hpp"
+#include "arch/x86/cpuid.hpp"
 #include "dev/fb.hpp"
 #include "mem/early_pmalloc.hpp"
 #include "sched/process.hpp"
@@ -80,6 +81,7 @@ hz::optional<hz::pair<void*, usize>> x86_get_module(kstd::string_view name) {
 }
 
 static constexpr usize SIZE_2MB = 1024 * 1024 * 2;
+static constexpr usize SIZE_1GB = 1024 * 1024 * 1024;
 
 static void setup_pat() {
 	u64 value = 0;
@@ -109,6 +111,11 @@ static void setup_memory(usize max_addr) {
 	assert(kernel_hdr->signature == IMAGE_NT_SIGNATURE);
 	auto* sections = offset(&kernel_hdr->opt, const PeSectionHeader*, kernel_hdr->coff.size_of_opt_hdr);
 
+	bool large_image_pages =
+		kernel_hdr->opt.section_align % SIZE_2MB == 0 &&
+		kernel_hdr->opt.size_of_image % SIZE_2MB == 0 &&
+		kernel_phys % SIZE_2MB == 0;
+
 	for (usize i = 0; i < ALIGNUP(kernel_hdr->opt.size_of_headers, PAGE_SIZE); i += PAGE_SIZE) {
 		(void) KERNEL_MAP->map(kernel_virt + i, kernel_phys + i, PageFlags::Read, CacheMode::WriteBack);
 	}
@@ -130,6 +137,19 @@ static void setup_memory(usize max_addr) {
 			flags |= PageFlags::Execute;
 		}
 
+		// with 2mb section alignment each section owns all the 2mb pages it touches
+		if (large_image_pages) {
+			size = ALIGNUP(size, SIZE_2MB);
+			for (usize j = 0; j < size; j += SIZE_2MB) {
+				(void) KERNEL_MAP->map_2mb(
+					kernel_virt + aligned_offset + j,
+					kernel_phys + aligned_offset + j,
+					flags,
+					CacheMode::WriteBack);
+			}
+			continue;
+		}
+
 		for (usize j = 0; j < size; j += PAGE_SIZE) {
 			(void) KERNEL_MAP->map(
 				kernel_virt + aligned_offset + j,
@@ -139,7 +159,18 @@ static void setup_memory(usize max_addr) {
 		}
 	}
 
-	for (usize i = 0; i < max_addr; i += SIZE_2MB) {
+	bool has_1gb_pages = cpuid(0x80000001, 0).edx & 1 << 26;
+	if (HHDM_START % SIZE_1GB) {
+		has_1gb_pages = false;
+	}
+
+	usize i = 0;
+	if (has_1gb_pages) {
+		for (; i + SIZE_1GB <= max_addr; i += SIZE_1GB) {
+			(void) KERNEL_MAP->map_1gb(HHDM_START + i, i, PageFlags::Read | PageFlags::Write, CacheMode::WriteBack);
+		}
+	}
+	for (; i < max_addr; i += SIZE_2MB) {
 		(void) KERNEL_MAP->map_2mb(HHDM_START + i, i, PageFlags::Read | PageFlags::Write, CacheMode::WriteBack);
 	}
 
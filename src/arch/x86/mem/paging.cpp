@@ -3,14 +3,23 @@
 #include "mem/mem.hpp"
 #include "mem/pmalloc.hpp"
 #include "assert.hpp"
+#include "atomic.hpp"
+#include "arch/cpu.hpp"
+#include "arch/irql.hpp"
+#include "arch/x86/dev/lapic.hpp"
+#include "dev/irq.hpp"
+#include "utils/irq_guard.hpp"
 
 constexpr u64 FLAG_PRESENT = 0b1;
 constexpr u64 FLAG_RW = 1U << 1;
 constexpr u64 FLAG_USER = 1U << 2;
 constexpr u64 FLAG_WT = 1U << 3;
 constexpr u64 FLAG_CD = 1U << 4;
+constexpr u64 FLAG_ACCESSED = 1U << 5;
 constexpr u64 FLAG_HUGE = 1U << 7;
 constexpr u64 FLAG_GLOBAL = 1U << 8;
+// never present, the address bits hold a value of the owner of the map instead of a frame
+constexpr u64 FLAG_MARKER = 1U << 9;
 constexpr u64 FLAG_PAT = 1U << 7;
 constexpr u64 FLAG_HUGE_PAT = 1U << 12;
 constexpr u64 FLAG_NX = 1ULL << 63;
@@ -19,9 +28,284 @@ constexpr u64 PAGE_ADDR_MASK = 0x000FFFFFFFFFF000;
 
 extern bool EARLY_PMALLOC;
 
+constexpr u64 ALL_CPUS = ~0ULL;
+// beyond this many pages the whole tlb is flushed instead
+constexpr usize SHOOTDOWN_MAX_PAGES = 32;
+
+namespace {
+	// a single shootdown is in flight at a time, the initiator waits for every target to finish
+	KSPIN_LOCK SHOOTDOWN_LOCK {};
+	u64 SHOOTDOWN_VIRT {};
+	usize SHOOTDOWN_COUNT {};
+	hz::atomic<u32> SHOOTDOWN_PENDING {};
+}
+
+static void invalidate_range(u64 virt, usize count) {
+	if (count > SHOOTDOWN_MAX_PAGES) {
+		PageMap::invalidate_all();
+	}
+	else {
+		PageMap::invalidate(virt, count);
+	}
+}
+
+static bool tlb_shootdown_irq(KINTERRUPT*, void*) {
+	invalidate_range(SHOOTDOWN_VIRT, SHOOTDOWN_COUNT);
+	SHOOTDOWN_PENDING.fetch_sub(1, hz::memory_order::release);
+	return true;
+}
+
+KINTERRUPT TLB_SHOOTDOWN_IRQ_HANDLER {
+	.fn = tlb_shootdown_irq
+};
+
+// the targets take the ipi even while spinning on a lock at DISPATCH_LEVEL, so the initiator
+// must not hold a lock that is acquired above it
+void PageMap::shootdown(u64 cpus, u64 virt, usize count) {
+	assert(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+	auto old = KfRaiseIrql(DISPATCH_LEVEL);
+
+	auto* self = get_current_cpu();
+	if (cpus & 1ULL << self->number) {
+		invalidate_range(virt, count);
+	}
+	cpus &= ~(1ULL << self->number);
+
+	if (!cpus || !TLB_SHOOTDOWN_IRQ_HANDLER.vector) {
+		KeLowerIrql(old);
+		return;
+	}
+
+	KeAcquireSpinLockAtDpcLevel(&SHOOTDOWN_LOCK);
+
+	SHOOTDOWN_VIRT = virt;
+	SHOOTDOWN_COUNT = count;
+
+	u32 targets = 0;
+	for (auto* cpu : CPUS) {
+		if (cpu && (cpus & 1ULL << cpu->number) && __atomic_load_n(&cpu->ipi_ready, __ATOMIC_ACQUIRE)) {
+			++targets;
+		}
+	}
+	SHOOTDOWN_PENDING.store(targets, hz::memory_order::seq_cst);
+
+	for (auto* cpu : CPUS) {
+		if (cpu && (cpus & 1ULL << cpu->number) && __atomic_load_n(&cpu->ipi_ready, __ATOMIC_ACQUIRE)) {
+			lapic_ipi(cpu->lapic_id, TLB_SHOOTDOWN_IRQ_HANDLER.vector);
+		}
+	}
+
+	while (SHOOTDOWN_PENDING.load(hz::memory_order::acquire)) {
+		__builtin_ia32_pause();
+	}
+
+	KeReleaseSpinLockFromDpcLevel(&SHOOTDOWN_LOCK);
+	KeLowerIrql(old);
+}
+
+void PageMap::flush(u64 virt, usize count) {
+	// the higher half is shared by every page map
+	if (virt >= 0xFFFF800000000000) {
+		shootdown(ALL_CPUS, virt, count);
+	}
+	else {
+		shootdown(active_cpus.load(hz::memory_order::seq_cst), virt, count);
+	}
+}
+
+u64* PageMap::get_or_alloc_table(u64* parent, u64 index, u64 flags) {
+	if (parent[index] & FLAG_PRESENT) {
+		// a large page that is still there, e.g. because splitting it failed, isn't a table
+		if (parent[index] & FLAG_HUGE) {
+			return nullptr;
+		}
+		return to_virt<u64>(parent[index] & PAGE_ADDR_MASK);
+	}
+
+	u64 page_phys = pmalloc();
+	if (!page_phys) {
+		return nullptr;
+	}
+	if (!EARLY_PMALLOC) {
+		auto* page = Page::from_phys(page_phys);
+		page->page_table.entries = 0;
+		page->page_table.owned = true;
+		used_pages.push(page);
+		++page_table_pages;
+	}
+
+	auto* table = to_virt<u64>(page_phys);
+	memset(table, 0, PAGE_SIZE);
+	// lockless walkers may observe the new table as soon as it is linked
+	atomic_store(&parent[index], page_phys | flags, memory_order::release);
+	add_entry(parent);
+	return table;
+}
+
+// tables allocated before the page structs existed (and the top level) aren't owned,
+// so they are never reclaimed and their entry count is not maintained
+void PageMap::add_entry(u64* table) {
+	if (EARLY_PMALLOC) {
+		return;
+	}
+
+	auto* page = Page::from_phys(to_phys(table));
+	if (page->page_table.owned) {
+		++page->page_table.entries;
+	}
+}
+
+bool PageMap::remove_entry(u64* table) {
+	if (EARLY_PMALLOC) {
+		return false;
+	}
+
+	auto* page = Page::from_phys(to_phys(table));
+	if (!page->page_table.owned) {
+		return false;
+	}
+
+	assert(page->page_table.entries);
+	return --page->page_table.entries == 0;
+}
+
+// replaces a 2mb page with a table of 4k pages with the same translation and flags
+u64* PageMap::split_2mb(u64* level2, u64 index, u64 virt) {
+	auto entry = level2[index];
+
+	u64 page_phys = pmalloc();
+	if (!page_phys) {
+		return nullptr;
+	}
+	if (!EARLY_PMALLOC) {
+		auto* page = Page::from_phys(page_phys);
+		page->page_table.entries = 512;
+		page->page_table.owned = true;
+		used_pages.push(page);
+		++page_table_pages;
+	}
+
+	u64 flags = entry & ~PAGE_ADDR_MASK & ~FLAG_HUGE;
+	if (entry & FLAG_HUGE_PAT) {
+		flags |= FLAG_PAT;
+	}
+	u64 phys = entry & PAGE_ADDR_MASK & ~(LARGE_PAGE_SIZE - 1);
+
+	auto* table = to_virt<u64>(page_phys);
+	for (usize i = 0; i < 512; ++i) {
+		table[i] = (phys + i * PAGE_SIZE) | flags;
+	}
+
+	atomic_store(&level2[index], page_phys | FLAG_PRESENT | FLAG_RW | (entry & FLAG_USER), memory_order::release);
+	--large_pages;
+
+	virt = ALIGNDOWN(virt, LARGE_PAGE_SIZE);
+	asm volatile("invlpg [%0]" : : "r"(virt) : "memory");
+
+	return table;
+}
+
+// replaces a 1gb page with a table of 2mb pages with the same translation and flags
+u64* PageMap::split_1gb(u64* level1, u64 index, u64 virt) {
+	auto entry = level1[index];
+
+	u64 page_phys = pmalloc();
+	if (!page_phys) {
+		return nullptr;
+	}
+	if (!EARLY_PMALLOC) {
+		auto* page = Page::from_phys(page_phys);
+		page->page_table.entries = 512;
+		page->page_table.owned = true;
+		used_pages.push(page);
+		++page_table_pages;
+	}
+
+	// the pat bit is at the same place in both kinds of large pages
+	u64 flags = entry & ~PAGE_ADDR_MASK;
+	flags |= entry & FLAG_HUGE_PAT;
+	u64 phys = entry & PAGE_ADDR_MASK & ~(HUGE_PAGE_SIZE - 1);
+
+	auto* table = to_virt<u64>(page_phys);
+	for (usize i = 0; i < 512; ++i) {
+		table[i] = (phys + i * LARGE_PAGE_SIZE) | flags;
+	}
+
+	atomic_store(&level1[index], page_phys | FLAG_PRESENT | FLAG_RW | (entry & FLAG_USER), memory_order::release);
+	large_pages += 512;
+
+	virt = ALIGNDOWN(virt, HUGE_PAGE_SIZE);
+	asm volatile("invlpg [%0]" : : "r"(virt) : "memory");
+
+	return table;
+}
+
+void PageMap::free_table(u64* table, hz::list<Page, &Page::hook>& tables) {
+	auto* page = Page::from_phys(to_phys(table));
+	used_pages.remove(page);
+	tables.push(page);
+	--page_table_pages;
+}
+
+bool PageMap::map_1gb(u64 virt, u64 phys, PageFlags flags, CacheMode cache_mode) {
+	u64 all_flags = FLAG_PRESENT | FLAG_RW | (flags & PageFlags::User ? FLAG_USER : 0);
+
+	virt >>= 30;
+	u64 level1_index = virt & 0x1FF;
+	virt >>= 9;
+	u64 level0_index = virt & 0x1FF;
+
+	u64 real_flags = FLAG_HUGE;
+	if (flags & PageFlags::Read) {
+		real_flags |= FLAG_PRESENT;
+	}
+	if (flags & PageFlags::Write) {
+		real_flags |= FLAG_RW;
+	}
+	if (!(flags & PageFlags::Execute)) {
+		real_flags |= FLAG_NX;
+	}
+	if (flags & PageFlags::User) {
+		real_flags |= FLAG_USER;
+	}
+
+	switch (cache_mode) {
+		case CacheMode::WriteBack:
+			break;
+		case CacheMode::WriteCombine:
+			real_flags |= FLAG_WT;
+			break;
+		case CacheMode::WriteThrough:
+			real_flags |= FLAG_CD;
+			break;
+		case CacheMode::Uncached:
+			real_flags |= FLAG_WT | FLAG_CD;
+			break;
+		case CacheMode::None:
+			panic("[kernel][x86]: invalid cache mode");
+	}
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&lock);
+
+	u64* level1 = get_or_alloc_table(level0, level0_index, all_flags);
+	if (!level1) {
+		KeReleaseSpinLock(&lock, old);
+		return false;
+	}
+
+	if (!level1[level1_index]) {
+		add_entry(level1);
+	}
+	level1[level1_index] = phys | real_flags;
+
+	KeReleaseSpinLock(&lock, old);
+	return true;
+}
+
 bool PageMap::map_2mb(u64 virt, u64 phys, PageFlags flags, CacheMode cache_mode) {
 	u64 all_flags = FLAG_PRESENT | FLAG_RW | (flags & PageFlags::User ? FLAG_USER : 0);
 
+	auto orig_virt = virt;
 	virt >>= 21;
 	u64 level2_index = virt & 0x1FF;
 	virt >>= 9;
@@ -61,47 +345,38 @@ bool PageMap::map_2mb(u64 virt, u64 phys, PageFlags flags, CacheMode cache_mode)
 
 	auto old = KeAcquireSpinLockRaiseToDpc(&lock);
 
-	u64* level1;
-	if (level0[level0_index] & FLAG_PRESENT) {
-		level1 = to_virt<u64>(level0[level0_index] & PAGE_ADDR_MASK);
+	u64* level1 = get_or_alloc_table(level0, level0_index, all_flags);
+	if (!level1) {
+		KeReleaseSpinLock(&lock, old);
+		return false;
 	}
-	else {
-		u64 page_phys = pmalloc();
-		if (!page_phys) {
-			KeReleaseSpinLock(&lock, old);
-			return false;
-		}
-		if (!EARLY_PMALLOC) {
-			used_pages.push(Page::from_phys(page_phys));
-		}
 
-		level1 = to_virt<u64>(page_phys);
-		memset(level1, 0, PAGE_SIZE);
-		level0[level0_index] = page_phys | all_flags;
+	u64* level2 = get_or_alloc_table(level1, level1_index, all_flags);
+	if (!level2) {
+		KeReleaseSpinLock(&lock, old);
+		return false;
 	}
 
-	u64* level2;
-	if (level1[level1_index] & FLAG_PRESENT) {
-		level2 = to_virt<u64>(level1[level1_index] & PAGE_ADDR_MASK);
+	// a table of 4k pages is never replaced, it either still has mappings or was preallocated
+	auto entry = level2[level2_index];
+	if ((entry & FLAG_PRESENT) && !(entry & FLAG_HUGE)) {
+		KeReleaseSpinLock(&lock, old);
+		return false;
 	}
-	else {
-		u64 page_phys = pmalloc();
-		if (!page_phys) {
-			KeReleaseSpinLock(&lock, old);
-			return false;
-		}
-		if (!EARLY_PMALLOC) {
-			used_pages.push(Page::from_phys(page_phys));
-		}
 
-		level2 = to_virt<u64>(page_phys);
-		memset(level2, 0, PAGE_SIZE);
-		level1[level1_index] = page_phys | all_flags;
+	if (!entry) {
+		add_entry(level2);
 	}
-
-	level2[level2_index] = phys | real_flags;
+	if (!(entry & FLAG_HUGE)) {
+		++large_pages;
+	}
+	atomic_store(&level2[level2_index], phys | real_flags, memory_order::release);
 
 	KeReleaseSpinLock(&lock, old);
+
+	if (entry & FLAG_PRESENT) {
+		flush(ALIGNDOWN(orig_virt, LARGE_PAGE_SIZE), 1);
+	}
 	return true;
 }
 
@@ -117,7 +392,9 @@ bool PageMap::map(u64 virt, u64 phys, PageFlags flags, CacheMode cache_mode) {
 	virt >>= 9;
 	u64 level0_index = virt & 0x1FF;
 
-	u64 real_flags = 0;
+	// new pages start out as accessed, this also keeps a page that was just
+	// faulted in from looking cold before the faulting access is retried
+	u64 real_flags = FLAG_ACCESSED;
 	if (flags & PageFlags::Read) {
 		real_flags |= FLAG_PRESENT;
 	}
@@ -149,70 +426,34 @@ bool PageMap::map(u64 virt, u64 phys, PageFlags flags, CacheMode cache_mode) {
 
 	auto old = KeAcquireSpinLockRaiseToDpc(&lock);
 
-	u64* level1;
-	if (level0[level0_index] & FLAG_PRESENT) {
-		level1 = to_virt<u64>(level0[level0_index] & PAGE_ADDR_MASK);
-	}
-	else {
-		u64 page_phys = pmalloc();
-		if (!page_phys) {
-			KeReleaseSpinLock(&lock, old);
-			return false;
-		}
-		if (!EARLY_PMALLOC) {
-			used_pages.push(Page::from_phys(page_phys));
-		}
-
-		level1 = to_virt<u64>(page_phys);
-		memset(level1, 0, PAGE_SIZE);
-		level0[level0_index] = page_phys | all_flags;
+	u64* level1 = get_or_alloc_table(level0, level0_index, all_flags);
+	if (!level1) {
+		KeReleaseSpinLock(&lock, old);
+		return false;
 	}
 
-	u64* level2;
-	if (level1[level1_index] & FLAG_PRESENT) {
-		level2 = to_virt<u64>(level1[level1_index] & PAGE_ADDR_MASK);
+	u64* level2 = get_or_alloc_table(level1, level1_index, all_flags);
+	if (!level2) {
+		KeReleaseSpinLock(&lock, old);
+		return false;
 	}
-	else {
-		u64 page_phys = pmalloc();
-		if (!page_phys) {
-			KeReleaseSpinLock(&lock, old);
-			return false;
-		}
-		if (!EARLY_PMALLOC) {
-			used_pages.push(Page::from_phys(page_phys));
-		}
 
-		level2 = to_virt<u64>(page_phys);
-		memset(level2, 0, PAGE_SIZE);
-		level1[level1_index] = page_phys | all_flags;
+	u64* level3 = get_or_alloc_table(level2, level2_index, all_flags);
+	if (!level3) {
+		KeReleaseSpinLock(&lock, old);
+		return false;
 	}
 
-	u64* level3;
-	if (level2[level2_index] & FLAG_PRESENT) {
-		level3 = to_virt<u64>(level2[level2_index] & PAGE_ADDR_MASK);
+	if (!level3[level3_index]) {
+		add_entry(level3);
 	}
-	else {
-		u64 page_phys = pmalloc();
-		if (!page_phys) {
-			KeReleaseSpinLock(&lock, old);
-			return false;
-		}
-		if (!EARLY_PMALLOC) {
-			used_pages.push(Page::from_phys(page_phys));
-		}
-
-		level3 = to_virt<u64>(page_phys);
-		memset(level3, 0, PAGE_SIZE);
-		level2[level2_index] = page_phys | all_flags;
-	}
-
 	level3[level3_index] = phys | real_flags;
 
 	KeReleaseSpinLock(&lock, old);
 	return true;
 }
 
-void PageMap::unmap(u64 virt) {
+bool PageMap::unmap(u64 virt, bool flush) {
 	auto orig_virt = virt;
 	virt >>= 12;
 	u64 level3_index = virt & 0x1FF;
@@ -231,44 +472,136 @@ void PageMap::unmap(u64 virt) {
 	}
 	else {
 		KeReleaseSpinLock(&lock, old);
-		return;
+		return true;
 	}
 
 	u64* level2;
 	if (level1[level1_index] & FLAG_PRESENT) {
-		level2 = to_virt<u64>(level1[level1_index] & PAGE_ADDR_MASK);
+		if (level1[level1_index] & FLAG_HUGE) {
+			level2 = split_1gb(level1, level1_index, orig_virt);
+			if (!level2) {
+				KeReleaseSpinLock(&lock, old);
+				return false;
+			}
+		}
+		else {
+			level2 = to_virt<u64>(level1[level1_index] & PAGE_ADDR_MASK);
+		}
 	}
 	else {
 		KeReleaseSpinLock(&lock, old);
-		return;
+		return true;
 	}
 
 	u64* level3;
 	if (level2[level2_index] & FLAG_PRESENT) {
 		if (level2[level2_index] & FLAG_HUGE) {
-			// todo 2mb huge page
-			KeReleaseSpinLock(&lock, old);
-			return;
+			level3 = split_2mb(level2, level2_index, orig_virt);
+			if (!level3) {
+				KeReleaseSpinLock(&lock, old);
+				return false;
+			}
+		}
+		else {
+			level3 = to_virt<u64>(level2[level2_index] & PAGE_ADDR_MASK);
 		}
-
-		level3 = to_virt<u64>(level2[level2_index] & PAGE_ADDR_MASK);
 	}
 	else {
 		KeReleaseSpinLock(&lock, old);
-		return;
+		return true;
+	}
+
+	if (!level3[level3_index]) {
+		KeReleaseSpinLock(&lock, old);
+		return true;
+	}
+
+	atomic_store(&level3[level3_index], 0, memory_order::seq_cst);
+
+	// empty tables are unlinked bottom-up, the level1 tables in the higher half
+	// are shared with every other page map so they are never freed.
+	hz::list<Page, &Page::hook> tables {};
+	if (remove_entry(level3)) {
+		atomic_store(&level2[level2_index], 0, memory_order::seq_cst);
+		free_table(level3, tables);
+
+		if (remove_entry(level2)) {
+			atomic_store(&level1[level1_index], 0, memory_order::seq_cst);
+			free_table(level2, tables);
+
+			if (remove_entry(level1) && level0_index < 256) {
+				atomic_store(&level0[level0_index], 0, memory_order::seq_cst);
+				free_table(level1, tables);
+			}
+		}
 	}
 
-	level3[level3_index] = 0;
+	KeReleaseSpinLock(&lock, old);
+
 	orig_virt &= ~0xFFF;
-	asm volatile("invlpg [%0]" : : "r"(orig_virt) : "memory");
+	if (!tables.is_empty()) {
+		// invlpg also drops the paging-structure cache entries, but only on the cpu executing it.
+		// any cpu could have walked the unlinked tables so all of them are invalidated first,
+		// which also waits out the lockless walks
+		shootdown(ALL_CPUS, orig_virt, 1);
+		free_tables(tables);
+	}
+	else if (flush) {
+		this->flush(orig_virt, 1);
+	}
+	return true;
+}
+
+bool PageMap::preallocate_tables(u64 virt, usize size) {
+	assert(virt % LARGE_PAGE_SIZE == 0);
+	assert(size % LARGE_PAGE_SIZE == 0);
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&lock);
+
+	for (usize i = 0; i < size; i += LARGE_PAGE_SIZE) {
+		u64 addr = (virt + i) >> 21;
+		u64 level2_index = addr & 0x1FF;
+		addr >>= 9;
+		u64 level1_index = addr & 0x1FF;
+		addr >>= 9;
+		u64 level0_index = addr & 0x1FF;
+
+		u64* level1 = get_or_alloc_table(level0, level0_index, FLAG_PRESENT | FLAG_RW);
+		u64* level2 = level1 ? get_or_alloc_table(level1, level1_index, FLAG_PRESENT | FLAG_RW) : nullptr;
+		if (!level2 || (level2[level2_index] & (FLAG_PRESENT | FLAG_HUGE)) != 0) {
+			KeReleaseSpinLock(&lock, old);
+			return false;
+		}
+
+		u64* level3 = get_or_alloc_table(level2, level2_index, FLAG_PRESENT | FLAG_RW);
+		if (!level3) {
+			KeReleaseSpinLock(&lock, old);
+			return false;
+		}
+		Page::from_phys(to_phys(level3))->page_table.owned = false;
+	}
+
 	KeReleaseSpinLock(&lock, old);
+	return true;
 }
 
-u64 PageMap::get_phys(u64 virt) {
+void PageMap::invalidate(u64 virt, usize count) {
+	virt &= ~0xFFF;
+	for (usize i = 0; i < count; ++i, virt += PAGE_SIZE) {
+		asm volatile("invlpg [%0]" : : "r"(virt) : "memory");
+	}
+}
+
+void PageMap::invalidate_all() {
+	// global pages aren't used so reloading cr3 flushes everything
+	u64 cr3;
+	asm volatile("mov %0, cr3" : "=r"(cr3));
+	asm volatile("mov cr3, %0" : : "r"(cr3) : "memory");
+}
+
+u64 PageMap::unmap_2mb(u64 virt) {
 	auto orig_virt = virt;
-	virt >>= 12;
-	u64 level3_index = virt & 0x1FF;
-	virt >>= 9;
+	virt >>= 21;
 	u64 level2_index = virt & 0x1FF;
 	virt >>= 9;
 	u64 level1_index = virt & 0x1FF;
@@ -277,45 +610,316 @@ u64 PageMap::get_phys(u64 virt) {
 
 	auto old = KeAcquireSpinLockRaiseToDpc(&lock);
 
-	u64* level1;
-	if (level0[level0_index] & FLAG_PRESENT) {
-		level1 = to_virt<u64>(level0[level0_index] & PAGE_ADDR_MASK);
-	}
-	else {
+	if (!(level0[level0_index] & FLAG_PRESENT)) {
 		KeReleaseSpinLock(&lock, old);
 		return 0;
 	}
+	auto* level1 = to_virt<u64>(level0[level0_index] & PAGE_ADDR_MASK);
 
-	u64* level2;
-	if (level1[level1_index] & FLAG_PRESENT) {
-		level2 = to_virt<u64>(level1[level1_index] & PAGE_ADDR_MASK);
+	if (!(level1[level1_index] & FLAG_PRESENT) || (level1[level1_index] & FLAG_HUGE)) {
+		KeReleaseSpinLock(&lock, old);
+		return 0;
 	}
-	else {
+	auto* level2 = to_virt<u64>(level1[level1_index] & PAGE_ADDR_MASK);
+
+	auto entry = level2[level2_index];
+	if (!(entry & FLAG_PRESENT) || !(entry & FLAG_HUGE)) {
 		KeReleaseSpinLock(&lock, old);
 		return 0;
 	}
 
-	u64* level3;
-	if (level2[level2_index] & FLAG_PRESENT) {
-		if (level2[level2_index] & FLAG_HUGE) {
-			auto addr = (level2[level2_index] & PAGE_ADDR_MASK) | (orig_virt & 0x1FFFFF);
-			KeReleaseSpinLock(&lock, old);
-			return addr;
+	atomic_store(&level2[level2_index], 0, memory_order::seq_cst);
+	--large_pages;
+
+	hz::list<Page, &Page::hook> tables {};
+	if (remove_entry(level2)) {
+		atomic_store(&level1[level1_index], 0, memory_order::seq_cst);
+		free_table(level2, tables);
+
+		if (remove_entry(level1) && level0_index < 256) {
+			atomic_store(&level0[level0_index], 0, memory_order::seq_cst);
+			free_table(level1, tables);
 		}
+	}
+
+	KeReleaseSpinLock(&lock, old);
 
-		level3 = to_virt<u64>(level2[level2_index] & PAGE_ADDR_MASK);
+	orig_virt = ALIGNDOWN(orig_virt, LARGE_PAGE_SIZE);
+	if (!tables.is_empty()) {
+		shootdown(ALL_CPUS, orig_virt, 1);
+		free_tables(tables);
 	}
 	else {
+		flush(orig_virt, 1);
+	}
+
+	return entry & PAGE_ADDR_MASK & ~(LARGE_PAGE_SIZE - 1);
+}
+
+void PageMap::unmap_user_half(void (*fn)(void* arg, u64 virt, const u64* phys, usize count), void* arg) {
+	u64 phys[512];
+	hz::list<Page, &Page::hook> tables {};
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&lock);
+
+	for (u64 i0 = 0; i0 < 256; ++i0) {
+		auto entry0 = level0[i0];
+		if (!(entry0 & FLAG_PRESENT)) {
+			continue;
+		}
+		auto* level1 = to_virt<u64>(entry0 & PAGE_ADDR_MASK);
+
+		for (u64 i1 = 0; i1 < 512; ++i1) {
+			auto entry1 = level1[i1];
+			// user mappings never use 1gb pages
+			if (!(entry1 & FLAG_PRESENT) || (entry1 & FLAG_HUGE)) {
+				continue;
+			}
+			auto* level2 = to_virt<u64>(entry1 & PAGE_ADDR_MASK);
+
+			for (u64 i2 = 0; i2 < 512; ++i2) {
+				auto entry2 = level2[i2];
+				if (!(entry2 & FLAG_PRESENT)) {
+					continue;
+				}
+
+				u64 virt = i0 << 39 | i1 << 30 | i2 << 21;
+				if (entry2 & FLAG_HUGE) {
+					u64 base = entry2 & PAGE_ADDR_MASK & ~(LARGE_PAGE_SIZE - 1);
+					for (usize i = 0; i < 512; ++i) {
+						phys[i] = base + i * PAGE_SIZE;
+					}
+					--large_pages;
+				}
+				else {
+					auto* level3 = to_virt<u64>(entry2 & PAGE_ADDR_MASK);
+					for (usize i = 0; i < 512; ++i) {
+						phys[i] = (level3[i] & FLAG_MARKER) ? 0 : level3[i] & PAGE_ADDR_MASK;
+					}
+
+					auto* page = Page::from_phys(entry2 & PAGE_ADDR_MASK);
+					used_pages.remove(page);
+					tables.push(page);
+					--page_table_pages;
+				}
+				fn(arg, virt, phys, 512);
+			}
+
+			auto* page = Page::from_phys(entry1 & PAGE_ADDR_MASK);
+			used_pages.remove(page);
+			tables.push(page);
+			--page_table_pages;
+		}
+
+		atomic_store(&level0[i0], 0, memory_order::seq_cst);
+		auto* page = Page::from_phys(entry0 & PAGE_ADDR_MASK);
+		used_pages.remove(page);
+		tables.push(page);
+		--page_table_pages;
+	}
+
+	KeReleaseSpinLock(&lock, old);
+
+	// the map isn't active anywhere but a lockless walk might still be looking at the tables,
+	// an empty shootdown waits for every cpu to take the ipi
+	shootdown(ALL_CPUS, 0, 0);
+	free_tables(tables);
+}
+
+void PageMap::free_tables(hz::list<Page, &Page::hook>& tables) {
+	pfree_list(tables);
+}
+
+u64* PageMap::lookup(u64 virt, u64& page_size) {
+	virt >>= 12;
+	u64 level3_index = virt & 0x1FF;
+	virt >>= 9;
+	u64 level2_index = virt & 0x1FF;
+	virt >>= 9;
+	u64 level1_index = virt & 0x1FF;
+	virt >>= 9;
+	u64 level0_index = virt & 0x1FF;
+
+	auto entry = atomic_load(&level0[level0_index], memory_order::acquire);
+	if (!(entry & FLAG_PRESENT)) {
+		return nullptr;
+	}
+
+	auto* level1 = to_virt<u64>(entry & PAGE_ADDR_MASK);
+	entry = atomic_load(&level1[level1_index], memory_order::acquire);
+	if (!(entry & FLAG_PRESENT)) {
+		return nullptr;
+	}
+	else if (entry & FLAG_HUGE) {
+		page_size = 0x40000000;
+		return &level1[level1_index];
+	}
+
+	auto* level2 = to_virt<u64>(entry & PAGE_ADDR_MASK);
+	entry = atomic_load(&level2[level2_index], memory_order::acquire);
+	if (!(entry & FLAG_PRESENT)) {
+		return nullptr;
+	}
+	else if (entry & FLAG_HUGE) {
+		page_size = 0x200000;
+		return &level2[level2_index];
+	}
+
+	auto* level3 = to_virt<u64>(entry & PAGE_ADDR_MASK);
+	page_size = PAGE_SIZE;
+	return &level3[level3_index];
+}
+
+// markers are never translated, other non-present entries still hold their frame
+static u64 entry_to_phys(u64 entry, u64 virt, u64 page_size, bool only_present) {
+	if (!entry || (entry & FLAG_MARKER) || (only_present && !(entry & FLAG_PRESENT))) {
+		return 0;
+	}
+	return (entry & PAGE_ADDR_MASK & ~(page_size - 1)) | (virt & (page_size - 1));
+}
+
+// the walks run with interrupts disabled, tables are only freed after every cpu took an ipi
+// so no walk can still be using them. nothing is written to memory shared between the walkers
+u64 PageMap::get_phys(u64 virt) {
+	IrqGuard irq_guard {};
+
+	u64 page_size;
+	auto* entry = lookup(virt, page_size);
+	return entry ? entry_to_phys(atomic_load(entry, memory_order::relaxed), virt, page_size, true) : 0;
+}
+
+void PageMap::get_phys_range(u64 virt, usize count, u64* phys) {
+	walk_range(virt, count, phys, true);
+}
+
+u64 PageMap::get_frame(u64 virt) {
+	IrqGuard irq_guard {};
+
+	u64 page_size;
+	auto* entry = lookup(virt, page_size);
+	return entry ? entry_to_phys(atomic_load(entry, memory_order::relaxed), virt, page_size, false) : 0;
+}
+
+void PageMap::get_frame_range(u64 virt, usize count, u64* phys) {
+	walk_range(virt, count, phys, false);
+}
+
+void PageMap::walk_range(u64 virt, usize count, u64* phys, bool only_present) {
+	// interrupts are enabled again after every leaf table
+	for (usize i = 0; i < count;) {
+		IrqGuard irq_guard {};
+
+		u64* entry = nullptr;
+		u64 page_size = PAGE_SIZE;
+		usize end = count - i > 512 ? i + 512 : count;
+		for (; i < end; ++i, virt += PAGE_SIZE) {
+			if (entry && page_size == PAGE_SIZE && (virt >> 12 & 0x1FF)) {
+				++entry;
+			}
+			else if (!entry || virt % page_size == 0) {
+				entry = lookup(virt, page_size);
+			}
+
+			phys[i] = entry ? entry_to_phys(atomic_load(entry, memory_order::relaxed), virt, page_size, only_present) : 0;
+		}
+	}
+}
+
+bool PageMap::is_present(u64 virt) {
+	IrqGuard irq_guard {};
+
+	u64 page_size;
+	auto* entry = lookup(virt, page_size);
+	return entry && (atomic_load(entry, memory_order::relaxed) & FLAG_PRESENT);
+}
+
+u64* PageMap::lookup_4k(u64 virt) {
+	virt >>= 12;
+	u64 level3_index = virt & 0x1FF;
+	virt >>= 9;
+	u64 level2_index = virt & 0x1FF;
+	virt >>= 9;
+	u64 level1_index = virt & 0x1FF;
+	virt >>= 9;
+	u64 level0_index = virt & 0x1FF;
+
+	if (!(level0[level0_index] & FLAG_PRESENT)) {
+		return nullptr;
+	}
+	auto* level1 = to_virt<u64>(level0[level0_index] & PAGE_ADDR_MASK);
+
+	if (!(level1[level1_index] & FLAG_PRESENT) || (level1[level1_index] & FLAG_HUGE)) {
+		return nullptr;
+	}
+	auto* level2 = to_virt<u64>(level1[level1_index] & PAGE_ADDR_MASK);
+
+	if (!(level2[level2_index] & FLAG_PRESENT) || (level2[level2_index] & FLAG_HUGE)) {
+		return nullptr;
+	}
+	auto* level3 = to_virt<u64>(level2[level2_index] & PAGE_ADDR_MASK);
+	return &level3[level3_index];
+}
+
+u64 PageMap::take_cold_page(u64 virt, PageFlags& flags) {
+	auto old = KeAcquireSpinLockRaiseToDpc(&lock);
+
+	auto* entry = lookup_4k(virt);
+	if (!entry || !(*entry & FLAG_PRESENT)) {
 		KeReleaseSpinLock(&lock, old);
 		return 0;
 	}
 
-	auto addr = (level3[level3_index] & PAGE_ADDR_MASK) | (orig_virt & 0xFFF);
+	// the cpu sets the accessed bit concurrently so it has to be cleared atomically,
+	// the stale tlb entry only delays the page being seen as accessed again
+	if (*entry & FLAG_ACCESSED) {
+		__atomic_fetch_and(entry, ~FLAG_ACCESSED, __ATOMIC_RELAXED);
+		KeReleaseSpinLock(&lock, old);
+		return 0;
+	}
+
+	auto value = __atomic_fetch_and(entry, ~FLAG_PRESENT, __ATOMIC_SEQ_CST);
+
+	flags = PageFlags::Read;
+	if (value & FLAG_RW) {
+		flags |= PageFlags::Write;
+	}
+	if (!(value & FLAG_NX)) {
+		flags |= PageFlags::Execute;
+	}
+	if (value & FLAG_USER) {
+		flags |= PageFlags::User;
+	}
+
+	KeReleaseSpinLock(&lock, old);
+	return value & PAGE_ADDR_MASK;
+}
+
+void PageMap::set_marker(u64 virt, u64 value) {
+	assert(value && value < 1ULL << 40);
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&lock);
+
+	auto* entry = lookup_4k(virt);
+	assert(entry && *entry && !(*entry & FLAG_PRESENT));
+	atomic_store(entry, value << 12 | FLAG_MARKER, memory_order::relaxed);
+
 	KeReleaseSpinLock(&lock, old);
-	return addr;
 }
 
-void PageMap::protect(u64 virt, PageFlags flags, CacheMode cache_mode) {
+u64 PageMap::get_marker(u64 virt) {
+	u64 value;
+	{
+		IrqGuard irq_guard {};
+
+		u64 page_size;
+		auto* entry = lookup(virt, page_size);
+		value = entry ? atomic_load(entry, memory_order::relaxed) : 0;
+	}
+
+	return (value & FLAG_MARKER) ? (value & PAGE_ADDR_MASK) >> 12 : 0;
+}
+
+bool PageMap::protect(u64 virt, PageFlags flags, CacheMode cache_mode) {
 	u64 real_flags = 0;
 	if (flags & PageFlags::Read) {
 		real_flags |= FLAG_PRESENT;
@@ -364,45 +968,121 @@ void PageMap::protect(u64 virt, PageFlags flags, CacheMode cache_mode) {
 	}
 	else {
 		KeReleaseSpinLock(&lock, old);
-		return;
+		return true;
 	}
 
 	u64* level2;
 	if (level1[level1_index] & FLAG_PRESENT) {
-		level2 = to_virt<u64>(level1[level1_index] & PAGE_ADDR_MASK);
+		if (level1[level1_index] & FLAG_HUGE) {
+			level2 = split_1gb(level1, level1_index, orig_virt);
+			if (!level2) {
+				KeReleaseSpinLock(&lock, old);
+				return false;
+			}
+		}
+		else {
+			level2 = to_virt<u64>(level1[level1_index] & PAGE_ADDR_MASK);
+		}
 	}
 	else {
 		KeReleaseSpinLock(&lock, old);
-		return;
+		return true;
 	}
 
 	u64* level3;
 	if (level2[level2_index] & FLAG_PRESENT) {
 		if (level2[level2_index] & FLAG_HUGE) {
-			// todo 2mb huge page
-			KeReleaseSpinLock(&lock, old);
-			return;
+			level3 = split_2mb(level2, level2_index, orig_virt);
+			if (!level3) {
+				KeReleaseSpinLock(&lock, old);
+				return false;
+			}
+		}
+		else {
+			level3 = to_virt<u64>(level2[level2_index] & PAGE_ADDR_MASK);
 		}
-
-		level3 = to_virt<u64>(level2[level2_index] & PAGE_ADDR_MASK);
 	}
 	else {
 		KeReleaseSpinLock(&lock, old);
-		return;
+		return true;
+	}
+
+	if (!level3[level3_index] || (level3[level3_index] & FLAG_MARKER)) {
+		KeReleaseSpinLock(&lock, old);
+		return true;
 	}
 
 	level3[level3_index] &= PAGE_ADDR_MASK;
 	level3[level3_index] |= real_flags;
 
-	orig_virt &= ~0xFFF;
-	asm volatile("invlpg [%0]" : : "r"(orig_virt) : "memory");
+	KeReleaseSpinLock(&lock, old);
+
+	flush(orig_virt & ~0xFFF, 1);
+	return true;
+}
+
+bool PageMap::split(u64 virt) {
+	auto orig_virt = virt;
+	virt >>= 21;
+	u64 level2_index = virt & 0x1FF;
+	virt >>= 9;
+	u64 level1_index = virt & 0x1FF;
+	virt >>= 9;
+	u64 level0_index = virt & 0x1FF;
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&lock);
+
+	if (!(level0[level0_index] & FLAG_PRESENT)) {
+		KeReleaseSpinLock(&lock, old);
+		return true;
+	}
+	auto* level1 = to_virt<u64>(level0[level0_index] & PAGE_ADDR_MASK);
+
+	if (!(level1[level1_index] & FLAG_PRESENT)) {
+		KeReleaseSpinLock(&lock, old);
+		return true;
+	}
+	u64* level2;
+	if (level1[level1_index] & FLAG_HUGE) {
+		level2 = split_1gb(level1, level1_index, orig_virt);
+		if (!level2) {
+			KeReleaseSpinLock(&lock, old);
+			return false;
+		}
+	}
+	else {
+		level2 = to_virt<u64>(level1[level1_index] & PAGE_ADDR_MASK);
+	}
+
+	bool success = true;
+	if ((level2[level2_index] & FLAG_PRESENT) && (level2[level2_index] & FLAG_HUGE)) {
+		success = split_2mb(level2, level2_index, orig_virt);
+	}
 
 	KeReleaseSpinLock(&lock, old);
+	return success;
 }
 
+// the cpu is added to the new map before its tables can be cached and removed from
+// the previous one once the cr3 write has flushed its translations
 void PageMap::use() {
+	auto* cpu = get_current_cpu();
+	auto* prev = cpu->page_map;
+	u64 bit = 1ULL << cpu->number;
+
+	if (prev != this) {
+		active_cpus.fetch_or(bit, hz::memory_order::seq_cst);
+	}
+
 	auto phys = to_phys(level0);
 	asm volatile("mov cr3, %0" : : "r"(phys) : "memory");
+
+	if (prev != this) {
+		if (prev) {
+			prev->active_cpus.fetch_and(~bit, hz::memory_order::release);
+		}
+		cpu->page_map = this;
+	}
 }
 
 PageMap::PageMap(PageMap* kernel_map) {
@@ -411,7 +1091,10 @@ PageMap::PageMap(PageMap* kernel_map) {
 	level0 = to_virt<u64>(phys);
 	memset(level0, 0, PAGE_SIZE);
 	if (!EARLY_PMALLOC) {
-		used_pages.push(Page::from_phys(phys));
+		auto* page = Page::from_phys(phys);
+		page->page_table.owned = false;
+		used_pages.push(page);
+		++page_table_pages;
 	}
 
 	if (kernel_map) {
@@ -420,10 +1103,8 @@ PageMap::PageMap(PageMap* kernel_map) {
 }
 
 PageMap::~PageMap() {
-	for (auto& page : used_pages) {
-		pfree(page.phys());
-	}
-	used_pages.clear();
+	pfree_list(used_pages);
+	page_table_pages = 0;
 }
 
 void PageMap::fill_high_half() {
@@ -31,6 +31,7 @@ extern "C" void x86_syscall_stub();
 
 static constexpr u64 USER_GDT_BASE = 0x18;
 static constexpr u64 KERNEL_CS = 0x8;
+static constexpr usize DOUBLE_FAULT_STACK_SIZE = 1024 * 16;
 
 static void init_usermode() {
 	// enable syscall
@@ -194,6 +195,12 @@ static void x86_init_cpu_common(Cpu* self, u32 lapic_id) NO_THREAD_SAFETY_ANALYS
 	self->number = NUM_CPUS.fetch_add(1, hz::memory_order::relaxed);
 	self->lapic_id = lapic_id;
 
+	auto* double_fault_stack = new u8[DOUBLE_FAULT_STACK_SIZE];
+	assert(double_fault_stack);
+	auto double_fault_sp = reinterpret_cast<usize>(double_fault_stack + DOUBLE_FAULT_STACK_SIZE);
+	self->tss.ist1_low = double_fault_sp;
+	self->tss.ist1_high = double_fault_sp >> 32;
+
 	x86_load_gdt(&self->tss);
 	x86_load_idt();
 
@@ -205,6 +212,8 @@ static void x86_init_cpu_common(Cpu* self, u32 lapic_id) NO_THREAD_SAFETY_ANALYS
 	self->tss.iopb = sizeof(Tss);
 	x86_cpu_resume(self, thread, true);
 	sched_init();
+
+	__atomic_store_n(&self->ipi_ready, true, __ATOMIC_RELEASE);
 }
 
 extern "C" void smp_ap_entry_asm(limine_smp_info* info);
@@ -233,8 +242,10 @@ smp_ap_entry_asm:
 )");
 
 extern "C" [[noreturn, gnu::used]] void smp_ap_entry(limine_smp_info* info) {
-	KERNEL_MAP->use();
 	auto* cpu = reinterpret_cast<Cpu*>(info->extra_argument);
+	// the page map records the cpus it is loaded on
+	msrs::IA32_GSBASE.write(reinterpret_cast<u64>(cpu));
+	KERNEL_MAP->use();
 
 	{
 		auto guard = SMP_LOCK.lock();
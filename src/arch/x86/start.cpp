@@ -3,6 +3,7 @@
 #include "dev/tsc.hpp"
 #include "acpi/acpi.hpp"
 #include "mem/vspace.hpp"
+#include "mem/kernel_stack.hpp"
 #include "utils/shared_data.hpp"
 #include "cstring.hpp"
 #include "string_view.hpp"
@@ -31,6 +32,8 @@ void init_drivers() {
 void x86_madt_parse();
 
 void arch_start(void* rsdp) {
+	kernel_stack_init();
+
 	auto info_page = KERNEL_VSPACE.alloc_backed(
 		reinterpret_cast<usize>(SharedUserData),
 		PAGE_SIZE,
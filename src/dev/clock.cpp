@@ -9,6 +9,9 @@
 ClockSource* CLOCK_SOURCE;
 DateTimeProvider* DATE_TIME_PROVIDER;
 
+// the system time at clock source time 0 in 100ns units
+static u64 SYSTEM_TIME_BASE;
+
 void register_clock_source(ClockSource* source) {
 	println("[kernel]: registering clock source ", source->name);
 
@@ -63,5 +66,42 @@ void system_time_init() {
 	auto rtl_status = RtlTimeFieldsToTime(&fields, &time);
 	assert(rtl_status);
 
-	atomic_store(&SharedUserData->system_time.u64, static_cast<u64>(time.QuadPart), memory_order::relaxed);
+	SYSTEM_TIME_BASE = static_cast<u64>(time.QuadPart) - CLOCK_SOURCE->get_ns() / 100;
+	system_time_update();
+}
+
+void system_time_update() {
+	if (!SYSTEM_TIME_BASE) {
+		return;
+	}
+
+	atomic_store(&SharedUserData->system_time.u64, system_time_get(), memory_order::relaxed);
+}
+
+u64 system_time_get() {
+	return SYSTEM_TIME_BASE + CLOCK_SOURCE->get_ns() / 100;
+}
+
+// times too far in the future to be represented saturate to UINT64_MAX
+u64 due_time_to_ns(i64 due_time) {
+	u64 ns;
+	if (due_time <= 0) {
+		// negating through u64 keeps INT64_MIN well defined
+		auto relative = u64 {0} - static_cast<u64>(due_time);
+		if (__builtin_mul_overflow(relative, u64 {100}, &ns) ||
+			__builtin_add_overflow(CLOCK_SOURCE->get_ns(), ns, &ns)) {
+			return UINT64_MAX;
+		}
+		return ns;
+	}
+
+	// absolute times before the clock source started have already passed
+	auto time = static_cast<u64>(due_time);
+	if (time <= SYSTEM_TIME_BASE) {
+		return 0;
+	}
+	if (__builtin_mul_overflow(time - SYSTEM_TIME_BASE, u64 {100}, &ns)) {
+		return UINT64_MAX;
+	}
+	return ns;
 }
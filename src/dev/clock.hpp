@@ -69,3 +69,10 @@ NTAPI extern "C" ULONG KeQueryTimeIncrement();
 NTAPI extern "C" void ExSystemTimeToLocalTime(PLARGE_INTEGER system_time, PLARGE_INTEGER local_time);
 
 void system_time_init();
+// derives the shared system time from the clock source, ticks can be far apart on idle cpus
+void system_time_update();
+// the system time in 100ns units
+u64 system_time_get();
+// converts an nt due time (negative relative or positive absolute system time in 100ns units)
+// to clock source time
+u64 due_time_to_ns(i64 due_time);
@@ -697,7 +697,7 @@ NTAPI void IofCompleteRequest(IRP* irp, CCHAR priority_boost) {
 	}
 
 	if (irp->user_event) {
-		KeSetEvent(irp->user_event, 0, false);
+		KeSetEvent(irp->user_event, priority_boost, false);
 		ObfDereferenceObject(irp->user_event);
 	}
 
@@ -5,6 +5,9 @@
 #include "cstring.hpp"
 #include "mem/vspace.hpp"
 #include "arch/arch_syscall.hpp"
+#include "mem/section.hpp"
+#include "mem/malloc.hpp"
+#include <hz/algorithm.hpp>
 
 struct BaseRelocEntry {
 	u32 page_rva;
@@ -90,6 +93,359 @@ static void* resolve_name(DosHeader* dos_hdr, hz::string_view name) {
 
 extern "C" DosHeader __ImageBase;
 
+namespace {
+	struct ImageRegion {
+		usize rva;
+		usize size;
+		PageFlags flags;
+	};
+
+	// an image laid out at a load base, the pages are read from the file and relocated on first use.
+	// images at their preferred base are cached and shared by every process that can map them there,
+	// the cache entry only lives as long as the section which is kept alive by the views of it
+	struct ImageSection {
+		hz::list_hook hook {};
+		// the reference keeps the key from being reused by another file while the entry exists
+		std::shared_ptr<VNode> file;
+		Section* section;
+		ImageRegion* regions;
+		usize region_count;
+	};
+
+	KSPIN_LOCK IMAGE_CACHE_LOCK {};
+	hz::list<ImageSection, &ImageSection::hook> IMAGE_CACHE {};
+
+	// returns the cached image with a reference to its section or nullptr
+	ImageSection* find_image_section(VNode* file) {
+		auto old = KeAcquireSpinLockRaiseToDpc(&IMAGE_CACHE_LOCK);
+		for (auto& image : IMAGE_CACHE) {
+			// the section of the entry might already be getting deleted
+			if (image.file.get() == file && ObReferenceObjectSafe(image.section)) {
+				KeReleaseSpinLock(&IMAGE_CACHE_LOCK, old);
+				return &image;
+			}
+		}
+		KeReleaseSpinLock(&IMAGE_CACHE_LOCK, old);
+		return nullptr;
+	}
+
+	void free_image_section(ImageSection* image) {
+		if (image->section) {
+			ObfDereferenceObject(image->section);
+		}
+		kfree(image->regions, image->region_count * sizeof(ImageRegion));
+		delete image;
+	}
+
+	void uncache_image_section(Section* section) {
+		ImageSection* image = nullptr;
+
+		auto old = KeAcquireSpinLockRaiseToDpc(&IMAGE_CACHE_LOCK);
+		for (auto& entry : IMAGE_CACHE) {
+			if (entry.section == section) {
+				image = &entry;
+				IMAGE_CACHE.remove(image);
+				break;
+			}
+		}
+		KeReleaseSpinLock(&IMAGE_CACHE_LOCK, old);
+
+		assert(image);
+		image->section = nullptr;
+		free_image_section(image);
+	}
+
+	// takes over the caller's reference to the section of image and returns the cached image
+	// with a reference to its section, which might be another one created at the same time
+	ImageSection* cache_image_section(ImageSection* image) {
+		auto old = KeAcquireSpinLockRaiseToDpc(&IMAGE_CACHE_LOCK);
+		for (auto& existing : IMAGE_CACHE) {
+			if (existing.file.get() == image->file.get() && ObReferenceObjectSafe(existing.section)) {
+				KeReleaseSpinLock(&IMAGE_CACHE_LOCK, old);
+				free_image_section(image);
+				return &existing;
+			}
+		}
+		image->section->on_delete = uncache_image_section;
+		IMAGE_CACHE.push(image);
+		KeReleaseSpinLock(&IMAGE_CACHE_LOCK, old);
+		return image;
+	}
+
+	// groups the relocation blocks by page so that a fault only looks at the blocks that can touch its page
+	bool index_relocs(Section* section) {
+		usize page_count = section->size / PAGE_SIZE;
+		auto* page_start = static_cast<u32*>(kcalloc((page_count + 1) * sizeof(u32)));
+		auto* cursor = static_cast<u32*>(kcalloc(page_count * sizeof(u32)));
+		if (!page_start || !cursor) {
+			kfree(page_start, (page_count + 1) * sizeof(u32));
+			kfree(cursor, page_count * sizeof(u32));
+			return false;
+		}
+
+		usize block_count = 0;
+		for (usize i = 0; i + sizeof(BaseRelocEntry) <= section->relocs_size;) {
+			auto* block = reinterpret_cast<BaseRelocEntry*>(section->relocs + i);
+			if (block->block_size < sizeof(BaseRelocEntry) || block->block_size > section->relocs_size - i) {
+				break;
+			}
+			i += block->block_size;
+
+			if (block->page_rva < section->size) {
+				++page_start[block->page_rva / PAGE_SIZE + 1];
+				++block_count;
+			}
+		}
+
+		for (usize i = 0; i < page_count; ++i) {
+			page_start[i + 1] += page_start[i];
+			cursor[i] = page_start[i];
+		}
+
+		u32* blocks = nullptr;
+		if (block_count) {
+			blocks = static_cast<u32*>(kmalloc(block_count * sizeof(u32)));
+			if (!blocks) {
+				kfree(page_start, (page_count + 1) * sizeof(u32));
+				kfree(cursor, page_count * sizeof(u32));
+				return false;
+			}
+		}
+
+		for (usize i = 0; i + sizeof(BaseRelocEntry) <= section->relocs_size;) {
+			auto* block = reinterpret_cast<BaseRelocEntry*>(section->relocs + i);
+			if (block->block_size < sizeof(BaseRelocEntry) || block->block_size > section->relocs_size - i) {
+				break;
+			}
+
+			if (block->page_rva < section->size) {
+				blocks[cursor[block->page_rva / PAGE_SIZE]++] = i;
+			}
+			i += block->block_size;
+		}
+
+		kfree(cursor, page_count * sizeof(u32));
+		section->reloc_page_start = page_start;
+		section->reloc_blocks = blocks;
+		section->reloc_block_count = block_count;
+		return true;
+	}
+
+	void apply_page_relocs(Section* section, usize offset, u8* page) {
+		usize delta = section->reloc_delta;
+		usize index = offset / PAGE_SIZE;
+
+		// the last relocations of the previous page can reach into this one
+		usize first = section->reloc_page_start[index ? index - 1 : 0];
+		usize last = section->reloc_page_start[index + 1];
+		for (usize i = first; i < last; ++i) {
+			auto* block = reinterpret_cast<BaseRelocEntry*>(section->relocs + section->reloc_blocks[i]);
+			usize block_start = block->page_rva;
+
+			auto* entry = reinterpret_cast<u16*>(&block[1]);
+			u32 count = (block->block_size - sizeof(BaseRelocEntry)) / 2;
+			for (u32 j = 0; j < count; ++j) {
+				u8 type = entry[j] >> 12;
+				usize rva = block_start + (entry[j] & 0xFFF);
+
+				usize width;
+				switch (type) {
+					case 0:
+						continue;
+					case IMAGE_REL_BASED_LOW:
+					case IMAGE_REL_BASED_HIGH:
+						width = 2;
+						break;
+					case IMAGE_REL_BASED_HIGHLOW:
+						width = 4;
+						break;
+					case IMAGE_REL_BASED_DIR64:
+						width = 8;
+						break;
+					default:
+						panic("[kernel][pe]: unsupported relocation type ", type);
+				}
+
+				if (rva + width <= offset || rva >= offset + PAGE_SIZE || rva + width > section->size) {
+					continue;
+				}
+
+				// the page still has the original contents, only values that
+				// cross into a neighbouring page have to be read from the file
+				u64 value = 0;
+				if (rva >= offset && rva + width <= offset + PAGE_SIZE) {
+					memcpy(&value, page + (rva - offset), width);
+				}
+				else {
+					section->read_backing(rva, &value, width);
+				}
+
+				switch (type) {
+					case IMAGE_REL_BASED_LOW:
+						value = static_cast<u16>(value + delta);
+						break;
+					case IMAGE_REL_BASED_HIGH:
+						value = static_cast<u16>(value + (delta >> 16));
+						break;
+					case IMAGE_REL_BASED_HIGHLOW:
+						value = static_cast<u32>(value + delta);
+						break;
+					default:
+						value += delta;
+						break;
+				}
+
+				for (usize k = 0; k < width; ++k) {
+					if (rva + k >= offset && rva + k < offset + PAGE_SIZE) {
+						page[rva + k - offset] = reinterpret_cast<u8*>(&value)[k];
+					}
+				}
+			}
+		}
+	}
+
+	ImageSection* create_image_section(
+		std::shared_ptr<VNode>& file,
+		usize file_size,
+		usize sect_offset,
+		u16 num_of_sections,
+		usize image_size,
+		usize size_of_headers,
+		DataDirectory base_reloc_dir,
+		usize delta) {
+		auto* sects = static_cast<PeSectionHeader*>(kmalloc(num_of_sections * sizeof(PeSectionHeader)));
+		if (!sects) {
+			return nullptr;
+		}
+
+		auto read = file->read(sects, sect_offset, num_of_sections * sizeof(PeSectionHeader));
+		if (!read || read.value() != num_of_sections * sizeof(PeSectionHeader)) {
+			kfree(sects, num_of_sections * sizeof(PeSectionHeader));
+			return nullptr;
+		}
+
+		auto* image = new ImageSection {
+			.file = file,
+			.section = section_create(image_size, PageFlags::Read | PageFlags::Write | PageFlags::Execute),
+			.regions = static_cast<ImageRegion*>(kmalloc((num_of_sections + 1) * sizeof(ImageRegion))),
+			.region_count = 0
+		};
+		auto* runs = static_cast<SectionRun*>(kmalloc((num_of_sections + 1) * sizeof(SectionRun)));
+		if (!image->section || !image->regions || !runs) {
+			kfree(runs, (num_of_sections + 1) * sizeof(SectionRun));
+			kfree(sects, num_of_sections * sizeof(PeSectionHeader));
+			free_image_section(image);
+			return nullptr;
+		}
+
+		auto* section = image->section;
+		section->file = file;
+		section->runs = runs;
+		section->run_count = 0;
+
+		image->regions[image->region_count++] = {
+			.rva = 0,
+			.size = ALIGNUP(size_of_headers, PAGE_SIZE),
+			.flags = PageFlags::Read
+		};
+		runs[section->run_count++] = {
+			.offset = 0,
+			.size = size_of_headers,
+			.file_offset = 0
+		};
+
+		// every section has to start on its own page for the views to have separate protections
+		bool valid = size_of_headers <= image_size;
+		for (u16 i = 0; valid && i < num_of_sections; ++i) {
+			auto& sect = sects[i];
+			auto& prev = image->regions[image->region_count - 1];
+			if (sect.virt_addr % PAGE_SIZE || sect.virt_addr < prev.rva + prev.size ||
+				sect.virt_addr + sect.virt_size > image_size ||
+				sect.ptr_to_raw_data + sect.size_of_raw_data > file_size) {
+				valid = false;
+				break;
+			}
+			if (!sect.virt_size) {
+				continue;
+			}
+
+			PageFlags flags {};
+			if (sect.characteristics & IMAGE_SCN_READ) {
+				flags |= PageFlags::Read;
+			}
+			if (sect.characteristics & IMAGE_SCN_WRITE) {
+				flags |= PageFlags::Write;
+			}
+			if (sect.characteristics & IMAGE_SCN_EXECUTE) {
+				flags |= PageFlags::Execute;
+			}
+
+			image->regions[image->region_count++] = {
+				.rva = sect.virt_addr,
+				.size = ALIGNUP(sect.virt_size, PAGE_SIZE),
+				.flags = flags
+			};
+			runs[section->run_count++] = {
+				.offset = sect.virt_addr,
+				.size = hz::min(sect.size_of_raw_data, sect.virt_size),
+				.file_offset = sect.ptr_to_raw_data
+			};
+		}
+
+		kfree(sects, num_of_sections * sizeof(PeSectionHeader));
+
+		if (valid && delta) {
+			valid = base_reloc_dir.size && base_reloc_dir.virt_addr + base_reloc_dir.size <= image_size;
+			if (valid) {
+				section->relocs = static_cast<u8*>(kmalloc(base_reloc_dir.size));
+				valid = section->relocs;
+			}
+			if (valid) {
+				section->relocs_size = base_reloc_dir.size;
+				section->reloc_delta = delta;
+				section->read_backing(base_reloc_dir.virt_addr, section->relocs, base_reloc_dir.size);
+				valid = index_relocs(section);
+			}
+			if (valid) {
+				section->fixup = apply_page_relocs;
+			}
+		}
+
+		if (!valid) {
+			free_image_section(image);
+			return nullptr;
+		}
+
+		return image;
+	}
+
+	// every view of a shared image is copy on write so that the shared frames can't be written to
+	// even if a view is reprotected later, private images are written directly
+	bool map_image_section(Process* process, ImageSection* image, usize load_base, bool copy_on_write) {
+		for (usize i = 0; i < image->region_count; ++i) {
+			auto& region = image->regions[i];
+
+			ObfReferenceObject(image->section);
+			auto base = process->map_view(
+				image->section,
+				region.rva,
+				reinterpret_cast<void*>(load_base + region.rva),
+				region.size,
+				region.flags,
+				copy_on_write);
+			if (!base) {
+				ObfDereferenceObject(image->section);
+				for (usize j = 0; j < i; ++j) {
+					process->unmap_view(load_base + image->regions[j].rva);
+				}
+				return false;
+			}
+		}
+
+		return true;
+	}
+}
+
 hz::result<LoadedPe, int> pe_load(Process* process, std::shared_ptr<VNode>& file, bool user) {
 	usize size;
 	if (auto s = file->stat()) {
@@ -126,6 +482,8 @@ hz::result<LoadedPe, int> pe_load(Process* process, std::shared_ptr<VNode>& file
 	usize image_base;
 	usize image_size;
 	usize size_of_headers;
+	usize stack_reserve;
+	usize stack_commit;
 	DataDirectory base_reloc_dir {};
 	DataDirectory import_dir {};
 	if (common_hdr.opt.magic == IMAGE_OPTIONAL_PE64_MAGIC) {
@@ -137,6 +495,8 @@ hz::result<LoadedPe, int> pe_load(Process* process, std::shared_ptr<VNode>& file
 		image_base = hdr.opt.image_base;
 		image_size = hdr.opt.size_of_image;
 		size_of_headers = hdr.opt.size_of_headers;
+		stack_reserve = hdr.opt.size_of_stack_reserve;
+		stack_commit = hdr.opt.size_of_stack_commit;
 		base_reloc_dir = hdr.opt.data_dirs[IMAGE_DIRECTORY_ENTRY_BASERELOC];
 		import_dir = hdr.opt.data_dirs[IMAGE_DIRECTORY_ENTRY_IMPORT];
 	}
@@ -149,6 +509,8 @@ hz::result<LoadedPe, int> pe_load(Process* process, std::shared_ptr<VNode>& file
 		image_base = hdr.opt.image_base;
 		image_size = hdr.opt.size_of_image;
 		size_of_headers = hdr.opt.size_of_headers;
+		stack_reserve = hdr.opt.size_of_stack_reserve;
+		stack_commit = hdr.opt.size_of_stack_commit;
 		base_reloc_dir = hdr.opt.data_dirs[IMAGE_DIRECTORY_ENTRY_BASERELOC];
 		import_dir = hdr.opt.data_dirs[IMAGE_DIRECTORY_ENTRY_IMPORT];
 	}
@@ -156,6 +518,80 @@ hz::result<LoadedPe, int> pe_load(Process* process, std::shared_ptr<VNode>& file
 	assert(size_of_headers);
 	assert(size_of_headers < size);
 
+	usize sect_offset = dos_hdr.e_lfanew + offsetof(PeHeader, opt) + common_hdr.coff.size_of_opt_hdr;
+	assert(sect_offset + common_hdr.coff.num_of_sections * sizeof(PeSectionHeader) <= size);
+
+	// user images are mapped as image sections and paged in from the file on first touch, at the
+	// preferred base they are shared between processes, otherwise each process gets a relocated one
+	if (user) {
+		auto* image = find_image_section(file.get());
+		if (!image) {
+			image = create_image_section(
+				file,
+				size,
+				sect_offset,
+				common_hdr.coff.num_of_sections,
+				image_size,
+				size_of_headers,
+				base_reloc_dir,
+				0);
+			if (image) {
+				image = cache_image_section(image);
+			}
+		}
+
+		// the views keep the section alive, the cache entry goes away with the last one of them
+		bool mapped = false;
+		if (image) {
+			mapped = map_image_section(process, image, image_base, true);
+			ObfDereferenceObject(image->section);
+		}
+
+		if (mapped) {
+			return hz::success(LoadedPe {
+				.base = image_base,
+				.entry = image_base + common_hdr.opt.addr_of_entry,
+				.stack_reserve = stack_reserve,
+				.stack_commit = stack_commit
+			});
+		}
+
+		if (!(common_hdr.coff.characteristics & IMAGE_FILE_RELOCS_STRIPPED)) {
+			// find a free range for the image, nothing else maps into the process while it is being loaded
+			usize load_base = process->allocate(nullptr, image_size, PageFlags::Read, MappingFlags::None, nullptr);
+			if (load_base) {
+				process->free(load_base, image_size);
+
+				image = create_image_section(
+					file,
+					size,
+					sect_offset,
+					common_hdr.coff.num_of_sections,
+					image_size,
+					size_of_headers,
+					base_reloc_dir,
+					load_base - image_base);
+			}
+			else {
+				image = nullptr;
+			}
+
+			if (image) {
+				mapped = map_image_section(process, image, load_base, false);
+				free_image_section(image);
+
+				if (mapped) {
+					return hz::success(LoadedPe {
+						.base = load_base,
+						.entry = load_base + common_hdr.opt.addr_of_entry,
+						.stack_reserve = stack_reserve,
+						.stack_commit = stack_commit
+					});
+				}
+			}
+		}
+	}
+
 	UniqueKernelMapping mapping;
 
 	usize load_base;
@@ -200,9 +636,6 @@ hz::result<LoadedPe, int> pe_load(Process* process, std::shared_ptr<VNode>& file
 	assert(read);
 	assert(read.value() == size_of_headers);
 
-	usize sect_offset = dos_hdr.e_lfanew + offsetof(PeHeader, opt) + common_hdr.coff.size_of_opt_hdr;
-	assert(sect_offset + common_hdr.coff.num_of_sections * sizeof(PeSectionHeader) <= size);
-
 	for (int i = 0; i < common_hdr.coff.num_of_sections; ++i) {
 		PeSectionHeader sect {};
 		memcpy(&sect, offset(mapping.data(), void*, sect_offset + i * sizeof(PeSectionHeader)), sizeof(PeSectionHeader));
@@ -332,7 +765,9 @@ hz::result<LoadedPe, int> pe_load(Process* process, std::shared_ptr<VNode>& file
 
 	return hz::success(LoadedPe {
 		.base = load_base,
-		.entry = load_base + common_hdr.opt.addr_of_entry
+		.entry = load_base + common_hdr.opt.addr_of_entry,
+		.stack_reserve = stack_reserve,
+		.stack_commit = stack_commit
 	});
 }
 
@@ -7,6 +7,8 @@ struct Process;
 struct LoadedPe {
 	usize base;
 	usize entry;
+	usize stack_reserve;
+	usize stack_commit;
 };
 
 struct NtdllOffsets {
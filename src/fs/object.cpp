@@ -746,6 +746,21 @@ NTAPI void ObfReferenceObject(PVOID object) {
 	hdr->pointer_count.fetch_add(1, hz::memory_order::relaxed);
 }
 
+NTAPI BOOLEAN ObReferenceObjectSafe(PVOID object) {
+	auto* hdr = get_header(object);
+	auto count = hdr->pointer_count.load(hz::memory_order::relaxed);
+	do {
+		if (!count) {
+			return false;
+		}
+	} while (!hdr->pointer_count.compare_exchange_weak(
+		count,
+		count + 1,
+		hz::memory_order::relaxed,
+		hz::memory_order::relaxed));
+	return true;
+}
+
 NTAPI void ObfDereferenceObject(PVOID object) {
 	if (!object) {
 		return;
@@ -85,6 +85,8 @@ NTAPI extern "C" NTSTATUS ZwCreateDirectoryObject(
 	OBJECT_ATTRIBUTES* object_attribs);
 
 NTAPI extern "C" void ObfReferenceObject(PVOID object);
+// references the object unless its last reference was already dropped and it is being deleted
+NTAPI extern "C" BOOLEAN ObReferenceObjectSafe(PVOID object);
 NTAPI extern "C" void ObfDereferenceObject(PVOID object);
 NTAPI extern "C" void ObDereferenceObjectDeferDelete(PVOID object);
 
@@ -12,18 +12,33 @@
 #include "fs/registry.hpp"
 #include "misc/callback.hpp"
 #include "sched/ps.hpp"
+#include "mem/compressed_store.hpp"
+#include "mem/system_pte.hpp"
+#include "misc/self_test.hpp"
+#include "config.hpp"
 
 void pci_irq_init(LoadedPe* pci_sys_pe);
 void pnp_init();
 void event_init();
+void timer_init();
+void section_init();
 
 [[noreturn]] void kmain(const void* initrd) {
 	println("[kernel]: entered kmain");
+	system_pte_init();
 	init_driver_loader();
 	registry_init();
 	callback_init();
 	pnp_init();
 	event_init();
+	timer_init();
+	section_init();
+	ps_reaper_init();
+	compressed_store_init();
+
+#if CONFIG_SELF_TESTS
+	run_self_tests();
+#endif
 
 	auto vfs = tmpfs_create();
 	init_vfs_from_tar(*vfs, initrd);
@@ -57,7 +72,14 @@ void event_init();
 	assert(exe_res);
 	exe_file = nullptr;
 
-	auto cpu = get_current_cpu();
+	if (exe_res->stack_reserve) {
+		process->stack_reserve = exe_res->stack_reserve;
+	}
+	if (exe_res->stack_commit) {
+		process->stack_commit = exe_res->stack_commit;
+	}
+
+	auto cpu = Scheduler::select_cpu(UINTPTR_MAX);
 	auto* thread = create_thread(
 		u"user thread",
 		cpu,
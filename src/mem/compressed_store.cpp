@@ -0,0 +1,188 @@
+#include "compressed_store.hpp"
+#include "slab.hpp"
+#include "mem/mem.hpp"
+#include "rtl.hpp"
+#include "cstring.hpp"
+#include "stdio.hpp"
+#include "dev/clock.hpp"
+#include "arch/cpu.hpp"
+#include "sched/process.hpp"
+#include "sched/ps.hpp"
+#include <hz/algorithm.hpp>
+
+namespace {
+	// every size is a multiple of 16 so that the marker doesn't need the low bits of the address,
+	// pages that don't compress to at least half of their size aren't worth keeping
+	constexpr hz::array<usize, 6> SIZES {
+		256, 512, 768, 1024, 1360, 2048
+	};
+	constinit SlabAllocator POOL {SIZES};
+
+	constexpr usize WORKSPACE_SIZE = 0x2000;
+
+	KSPIN_LOCK COMPRESS_LOCK {};
+	u8 COMPRESS_BUFFER[SIZES.back() - sizeof(CompressedPage)];
+	alignas(16) u8 WORKSPACE[WORKSPACE_SIZE];
+
+	KSPIN_LOCK STATS_LOCK {};
+	CompressedStoreStats STATS {};
+
+	// reclaim starts when less than 1/32 of memory is free and stops at 1/16
+	constexpr usize LOW_WATERMARK_DIVISOR = 32;
+	constexpr usize HIGH_WATERMARK_DIVISOR = 16;
+	constexpr u64 TRIM_INTERVAL_NS = NS_IN_MS * 100;
+	// the amount of pages taken from one process before moving to the next one
+	constexpr usize TRIM_BATCH = 64;
+
+	[[noreturn]] void page_trimmer(void*) {
+		usize total = pmalloc_total_pages();
+		usize low = total / LOW_WATERMARK_DIVISOR;
+		usize high = total / HIGH_WATERMARK_DIVISOR;
+
+		while (true) {
+			LARGE_INTEGER interval {.QuadPart = -static_cast<i64>(TRIM_INTERVAL_NS / 100)};
+			KeDelayExecutionThread(KernelMode, false, &interval);
+
+			auto free = pmalloc_free_pages();
+			if (free >= low) {
+				continue;
+			}
+
+			usize target = high - free;
+			usize compressed = 0;
+			while (compressed < target) {
+				usize round = 0;
+
+				auto old = KeAcquireSpinLockRaiseToDpc(&PROCESS_LIST_LOCK);
+				for (auto& process : PROCESS_LIST) {
+					usize remaining = target - compressed - round;
+					round += process.compress_cold_pages(hz::min(remaining, TRIM_BATCH));
+					if (compressed + round == target) {
+						break;
+					}
+				}
+				KeReleaseSpinLock(&PROCESS_LIST_LOCK, old);
+
+				// every page left was accessed since the last scan
+				if (!round) {
+					break;
+				}
+				compressed += round;
+			}
+
+			if (compressed) {
+				auto stats = compressed_store_get_stats();
+				println(
+					"[kernel][mm]: compressed ", compressed, " cold pages, ",
+					stats.stored_pages, " pages stored in ", stats.stored_bytes, " bytes, ",
+					stats.faults, " faults averaging ", stats.faults ? stats.total_fault_ns / stats.faults : 0, "ns");
+			}
+		}
+	}
+}
+
+u64 CompressedPage::to_marker() const {
+	return to_phys(this) >> 4;
+}
+
+CompressedPage* CompressedPage::from_marker(u64 marker) {
+	return to_virt<CompressedPage>(marker << 4);
+}
+
+CompressedPage* compressed_store_put(const void* data, PageFlags flags) {
+	auto old = KeAcquireSpinLockRaiseToDpc(&COMPRESS_LOCK);
+
+	ULONG size;
+	auto status = RtlCompressBuffer(
+		COMPRESSION_FORMAT_LZNT1,
+		static_cast<PUCHAR>(const_cast<void*>(data)),
+		PAGE_SIZE,
+		COMPRESS_BUFFER,
+		sizeof(COMPRESS_BUFFER),
+		PAGE_SIZE,
+		&size,
+		WORKSPACE);
+
+	CompressedPage* page = nullptr;
+	if (NT_SUCCESS(status)) {
+		if (auto* ptr = POOL.alloc(sizeof(CompressedPage) + size)) {
+			page = new (ptr) CompressedPage {};
+			page->size = size;
+			page->flags = static_cast<u8>(flags);
+			memcpy(page->data, COMPRESS_BUFFER, size);
+		}
+	}
+
+	KeReleaseSpinLock(&COMPRESS_LOCK, old);
+
+	old = KeAcquireSpinLockRaiseToDpc(&STATS_LOCK);
+	if (page) {
+		++STATS.stored_pages;
+		STATS.stored_bytes += sizeof(CompressedPage) + size;
+		++STATS.compressed_pages;
+	}
+	else {
+		++STATS.rejected_pages;
+	}
+	KeReleaseSpinLock(&STATS_LOCK, old);
+
+	return page;
+}
+
+void compressed_store_load(const CompressedPage* page, void* data) {
+	auto start = CLOCK_SOURCE->get_ns();
+
+	ULONG size;
+	auto status = RtlDecompressBuffer(
+		COMPRESSION_FORMAT_LZNT1,
+		static_cast<PUCHAR>(data),
+		PAGE_SIZE,
+		const_cast<PUCHAR>(page->data),
+		page->size,
+		&size);
+	assert(NT_SUCCESS(status));
+	assert(size == PAGE_SIZE);
+
+	auto elapsed = CLOCK_SOURCE->get_ns() - start;
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&STATS_LOCK);
+	++STATS.faults;
+	STATS.total_fault_ns += elapsed;
+	STATS.max_fault_ns = hz::max(STATS.max_fault_ns, elapsed);
+	KeReleaseSpinLock(&STATS_LOCK, old);
+}
+
+void compressed_store_free(CompressedPage* page) {
+	usize size = sizeof(CompressedPage) + page->size;
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&STATS_LOCK);
+	--STATS.stored_pages;
+	STATS.stored_bytes -= size;
+	KeReleaseSpinLock(&STATS_LOCK, old);
+
+	page->~CompressedPage();
+	POOL.dealloc(page, size);
+}
+
+CompressedStoreStats compressed_store_get_stats() {
+	auto old = KeAcquireSpinLockRaiseToDpc(&STATS_LOCK);
+	auto stats = STATS;
+	KeReleaseSpinLock(&STATS_LOCK, old);
+	return stats;
+}
+
+void compressed_store_init() {
+	ULONG workspace_size;
+	ULONG fragment_workspace_size;
+	auto status = RtlGetCompressionWorkSpaceSize(
+		COMPRESSION_FORMAT_LZNT1,
+		&workspace_size,
+		&fragment_workspace_size);
+	assert(NT_SUCCESS(status));
+	assert(workspace_size <= WORKSPACE_SIZE);
+
+	auto* cpu = get_current_cpu();
+	auto* thread = create_thread(u"page trimmer", cpu, &*KERNEL_PROCESS, false, page_trimmer, nullptr);
+	assert(thread);
+	cpu->scheduler.queue(cpu, thread);
+}
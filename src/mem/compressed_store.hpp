@@ -0,0 +1,38 @@
+#pragma once
+#include "types.hpp"
+#include "arch/paging.hpp"
+#include <hz/list.hpp>
+
+// a cold private page compressed with lznt1, the page table entry of the page
+// holds a marker with the physical address of this instead of the frame
+struct CompressedPage {
+	hz::list_hook hook {};
+	u16 size {};
+	// the protection of the page table entry at the time it was compressed
+	u8 flags {};
+	u8 data[];
+
+	[[nodiscard]] u64 to_marker() const;
+	static CompressedPage* from_marker(u64 marker);
+};
+
+struct CompressedStoreStats {
+	usize stored_pages;
+	usize stored_bytes;
+	usize compressed_pages;
+	usize rejected_pages;
+	usize faults;
+	u64 total_fault_ns;
+	u64 max_fault_ns;
+};
+
+// returns nullptr if the page doesn't compress well enough or there is no memory for it
+CompressedPage* compressed_store_put(const void* data, PageFlags flags);
+// decompresses the page into data, the compressed copy stays in the store
+void compressed_store_load(const CompressedPage* page, void* data);
+void compressed_store_free(CompressedPage* page);
+
+CompressedStoreStats compressed_store_get_stats();
+
+// starts the thread that compresses cold pages when free memory runs low
+void compressed_store_init();
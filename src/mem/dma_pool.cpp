@@ -0,0 +1,233 @@
+#include "mm.hpp"
+#include "pmalloc.hpp"
+#include "malloc.hpp"
+#include "mem/mem.hpp"
+#include "assert.hpp"
+#include "sched/process.hpp"
+#include <hz/list.hpp>
+#include <hz/algorithm.hpp>
+
+namespace {
+	constexpr u16 END_OF_LIST = 0xFFFF;
+
+	// a contiguous allocation split into blocks, the free list is kept out of the blocks
+	// so that it doesn't have to be read from uncached memory
+	struct DmaChunk {
+		hz::list_hook hook {};
+		DMA_POOL* pool {};
+		usize phys {};
+		u8* virt {};
+		u16 used {};
+		u16 free {};
+		u16 next[];
+	};
+}
+
+struct DMA_POOL {
+	KSPIN_LOCK lock {};
+	// chunks with at least one free block
+	hz::list<DmaChunk, &DmaChunk::hook> partial {};
+	hz::list<DmaChunk, &DmaChunk::hook> full {};
+	usize empty_chunks {};
+	usize block_size {};
+	// the distance between two blocks in a segment
+	usize stride {};
+	// blocks never cross a segment, segments are boundary sized if there is one
+	usize segment_size {};
+	usize blocks_per_segment {};
+	usize chunk_size {};
+	u16 blocks_per_chunk {};
+	usize boundary {};
+	PHYSICAL_ADDRESS highest_addr {};
+	MEMORY_CACHING_TYPE cache_type {};
+};
+
+// the most empty chunks kept around for the next allocation
+static constexpr usize MAX_EMPTY_CHUNKS = 1;
+
+static usize block_offset(const DMA_POOL* pool, usize index) {
+	return index / pool->blocks_per_segment * pool->segment_size +
+		index % pool->blocks_per_segment * pool->stride;
+}
+
+static usize block_index(const DMA_POOL* pool, usize offset) {
+	return offset / pool->segment_size * pool->blocks_per_segment +
+		offset % pool->segment_size / pool->stride;
+}
+
+// cached chunks live in the direct map, the rest are mapped in the kernel vspace
+static usize get_phys(const void* virt) {
+	auto addr = reinterpret_cast<usize>(virt);
+	if (addr <= HHDM_END) {
+		return to_phys(virt);
+	}
+	return KERNEL_MAP->get_phys(addr);
+}
+
+static DmaChunk* create_chunk(DMA_POOL* pool) {
+	usize size = sizeof(DmaChunk) + pool->blocks_per_chunk * sizeof(u16);
+	auto* chunk = static_cast<DmaChunk*>(kmalloc(size));
+	if (!chunk) {
+		return nullptr;
+	}
+	new (chunk) DmaChunk {};
+
+	// chunks smaller than the boundary don't cross it, bigger ones only happen
+	// with boundaries below the page size and are aligned to it by being page aligned
+	auto* virt = MmAllocateContiguousMemorySpecifyCache(
+		pool->chunk_size,
+		{},
+		pool->highest_addr,
+		{.QuadPart = static_cast<LONGLONG>(pool->boundary >= pool->chunk_size ? pool->boundary : 0)},
+		pool->cache_type);
+	if (!virt) {
+		kfree(chunk, size);
+		return nullptr;
+	}
+
+	chunk->pool = pool;
+	chunk->virt = static_cast<u8*>(virt);
+	chunk->phys = get_phys(virt);
+	for (u16 i = 0; i < pool->blocks_per_chunk; ++i) {
+		chunk->next[i] = i + 1 == pool->blocks_per_chunk ? END_OF_LIST : i + 1;
+	}
+
+	for (usize i = 0; i < pool->chunk_size; i += PAGE_SIZE) {
+		Page::from_phys(chunk->phys + i)->allocated.dma_chunk = chunk;
+	}
+
+	return chunk;
+}
+
+static void destroy_chunk(DmaChunk* chunk) {
+	auto* pool = chunk->pool;
+	for (usize i = 0; i < pool->chunk_size; i += PAGE_SIZE) {
+		Page::from_phys(chunk->phys + i)->allocated.dma_chunk = nullptr;
+	}
+
+	MmFreeContiguousMemory(chunk->virt);
+	chunk->~DmaChunk();
+	kfree(chunk, sizeof(DmaChunk) + pool->blocks_per_chunk * sizeof(u16));
+}
+
+NTAPI DMA_POOL* MmCreateDmaPool(
+	SIZE_T block_size,
+	SIZE_T alignment,
+	SIZE_T boundary,
+	PHYSICAL_ADDRESS highest_acceptable_addr,
+	MEMORY_CACHING_TYPE cache_type) {
+	if (!alignment) {
+		alignment = 1;
+	}
+
+	if (!block_size || alignment > PAGE_SIZE || (alignment & (alignment - 1))) {
+		return nullptr;
+	}
+	else if (boundary && ((boundary & (boundary - 1)) || boundary < block_size)) {
+		return nullptr;
+	}
+
+	auto* pool = new DMA_POOL {};
+	if (!pool) {
+		return nullptr;
+	}
+
+	pool->block_size = block_size;
+	pool->stride = ALIGNUP(block_size, alignment);
+	pool->chunk_size = ALIGNUP(pool->stride, PAGE_SIZE);
+	pool->segment_size = boundary && boundary < pool->chunk_size ? boundary : pool->chunk_size;
+	pool->blocks_per_segment = pool->segment_size / pool->stride;
+	if (pool->blocks_per_segment * pool->stride + block_size <= pool->segment_size) {
+		// the last block in a segment doesn't need the alignment padding
+		++pool->blocks_per_segment;
+	}
+	pool->blocks_per_chunk = static_cast<u16>(hz::min(
+		pool->chunk_size / pool->segment_size * pool->blocks_per_segment,
+		usize {END_OF_LIST}));
+	pool->boundary = boundary;
+	pool->highest_addr = highest_acceptable_addr;
+	pool->cache_type = cache_type;
+	return pool;
+}
+
+// every block has to be freed before the pool is deleted
+NTAPI void MmDeleteDmaPool(DMA_POOL* pool) {
+	assert(pool->full.is_empty());
+	while (auto* chunk = pool->partial.pop_front()) {
+		assert(!chunk->used);
+		destroy_chunk(chunk);
+	}
+
+	delete pool;
+}
+
+NTAPI PVOID MmAllocateFromDmaPool(DMA_POOL* pool, PHYSICAL_ADDRESS* phys_addr) {
+	auto old = KeAcquireSpinLockRaiseToDpc(&pool->lock);
+
+	auto* chunk = pool->partial.front();
+	if (!chunk) {
+		KeReleaseSpinLock(&pool->lock, old);
+		auto* new_chunk = create_chunk(pool);
+		if (!new_chunk) {
+			return nullptr;
+		}
+		old = KeAcquireSpinLockRaiseToDpc(&pool->lock);
+
+		chunk = new_chunk;
+		pool->partial.push_front(chunk);
+		++pool->empty_chunks;
+	}
+
+	auto index = chunk->free;
+	chunk->free = chunk->next[index];
+	if (!chunk->used++) {
+		--pool->empty_chunks;
+	}
+	if (chunk->free == END_OF_LIST) {
+		pool->partial.remove(chunk);
+		pool->full.push(chunk);
+	}
+
+	KeReleaseSpinLock(&pool->lock, old);
+
+	auto offset = block_offset(pool, index);
+	if (phys_addr) {
+		phys_addr->QuadPart = static_cast<LONGLONG>(chunk->phys + offset);
+	}
+	return chunk->virt + offset;
+}
+
+NTAPI void MmFreeToDmaPool(DMA_POOL* pool, PVOID block) {
+	auto phys = get_phys(block);
+	auto* chunk = static_cast<DmaChunk*>(Page::from_phys(phys)->allocated.dma_chunk);
+	assert(chunk && chunk->pool == pool);
+	auto index = static_cast<u16>(block_index(pool, phys - chunk->phys));
+	assert(block_offset(pool, index) == phys - chunk->phys);
+
+	DmaChunk* to_destroy = nullptr;
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&pool->lock);
+
+	if (chunk->free == END_OF_LIST) {
+		pool->full.remove(chunk);
+		pool->partial.push_front(chunk);
+	}
+	chunk->next[index] = chunk->free;
+	chunk->free = index;
+
+	if (!--chunk->used) {
+		if (pool->empty_chunks == MAX_EMPTY_CHUNKS) {
+			pool->partial.remove(chunk);
+			to_destroy = chunk;
+		}
+		else {
+			++pool->empty_chunks;
+		}
+	}
+
+	KeReleaseSpinLock(&pool->lock, old);
+
+	if (to_destroy) {
+		destroy_chunk(to_destroy);
+	}
+}
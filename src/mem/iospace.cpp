@@ -19,8 +19,9 @@ bool IoSpace::map(CacheMode cache_mode) {
 		if (!KERNEL_MAP->map(virt, aligned_phys + i, PageFlags::Read | PageFlags::Write, cache_mode)) {
 			println("[kernel]: io space map failed");
 			for (usize j = 0; j < i; j += PAGE_SIZE) {
-				KERNEL_MAP->unmap(base + j);
+				KERNEL_MAP->unmap(base + j, false);
 			}
+			KERNEL_MAP->flush(base, i / PAGE_SIZE);
 			return false;
 		}
 	}
@@ -0,0 +1,114 @@
+#include "kernel_stack.hpp"
+#include "vspace.hpp"
+#include "malloc.hpp"
+#include "pmalloc.hpp"
+#include "mem/mem.hpp"
+#include "rtl.hpp"
+#include "assert.hpp"
+#include "arch/cpu.hpp"
+#include "arch/irql.hpp"
+#include "sched/process.hpp"
+
+namespace {
+	// the first page of every slot is the guard
+	constexpr usize SLOT_SIZE = KERNEL_STACK_SIZE + PAGE_SIZE;
+	constexpr usize STACK_PAGES = KERNEL_STACK_SIZE / PAGE_SIZE;
+	constexpr usize MAX_STACKS = 8192;
+
+	KSPIN_LOCK LOCK {};
+	usize REGION_BASE {};
+	RTL_BITMAP BITMAP {};
+	ULONG HINT {};
+
+	void destroy_stack(usize base, usize mapped_pages) {
+		hz::list<Page, &Page::hook> frames {};
+		for (usize i = 0; i < mapped_pages; ++i) {
+			auto virt = base + i * PAGE_SIZE;
+			frames.push(Page::from_phys(KERNEL_MAP->get_phys(virt)));
+			KERNEL_MAP->unmap(virt, false);
+		}
+		KERNEL_MAP->flush(base, mapped_pages);
+		pfree_list(frames);
+
+		auto index = (base - PAGE_SIZE - REGION_BASE) / SLOT_SIZE;
+		auto old = KeAcquireSpinLockRaiseToDpc(&LOCK);
+		RtlClearBits(&BITMAP, index, 1);
+		KeReleaseSpinLock(&LOCK, old);
+	}
+
+	void* create_stack() {
+		auto old = KeAcquireSpinLockRaiseToDpc(&LOCK);
+		auto index = RtlFindClearBitsAndSet(&BITMAP, 1, HINT);
+		if (index != UINT32_MAX) {
+			HINT = (index + 1) % MAX_STACKS;
+		}
+		KeReleaseSpinLock(&LOCK, old);
+		if (index == UINT32_MAX) {
+			return nullptr;
+		}
+
+		auto base = REGION_BASE + index * SLOT_SIZE + PAGE_SIZE;
+		for (usize i = 0; i < STACK_PAGES; ++i) {
+			auto phys = pmalloc();
+			if (!phys) {
+				destroy_stack(base, i);
+				return nullptr;
+			}
+
+			if (!KERNEL_MAP->map(base + i * PAGE_SIZE, phys, PageFlags::Read | PageFlags::Write, CacheMode::WriteBack)) {
+				pfree(phys);
+				destroy_stack(base, i);
+				return nullptr;
+			}
+		}
+
+		return reinterpret_cast<void*>(base);
+	}
+}
+
+void kernel_stack_init() {
+	auto* ptr = KERNEL_VSPACE.alloc(0, MAX_STACKS * SLOT_SIZE);
+	assert(ptr);
+	REGION_BASE = reinterpret_cast<usize>(ptr);
+
+	auto* buffer = static_cast<PULONG>(kcalloc(MAX_STACKS / 8));
+	assert(buffer);
+	RtlInitializeBitMap(&BITMAP, buffer, MAX_STACKS);
+}
+
+void* kernel_stack_alloc() {
+	void* stack = nullptr;
+
+	auto old = KfRaiseIrql(DISPATCH_LEVEL);
+	auto& cache = get_current_cpu()->kernel_stack_cache;
+	if (cache.count) {
+		stack = cache.stacks[--cache.count];
+	}
+	KeLowerIrql(old);
+
+	if (stack) {
+		return stack;
+	}
+	return create_stack();
+}
+
+void kernel_stack_free(void* base) {
+	auto old = KfRaiseIrql(DISPATCH_LEVEL);
+	auto& cache = get_current_cpu()->kernel_stack_cache;
+	if (cache.count < KernelStackCache::MAX_STACKS) {
+		cache.stacks[cache.count++] = base;
+		base = nullptr;
+	}
+	KeLowerIrql(old);
+
+	if (base) {
+		destroy_stack(reinterpret_cast<usize>(base), STACK_PAGES);
+	}
+}
+
+bool kernel_stack_is_guard(usize addr) {
+	if (addr < REGION_BASE || addr >= REGION_BASE + MAX_STACKS * SLOT_SIZE) {
+		return false;
+	}
+	return (addr - REGION_BASE) % SLOT_SIZE < PAGE_SIZE;
+}
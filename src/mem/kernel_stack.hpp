@@ -0,0 +1,24 @@
+#pragma once
+#include "types.hpp"
+
+constexpr usize KERNEL_STACK_SIZE = 1024 * 64;
+
+// recently freed stacks are kept mapped per cpu so that creating a thread usually doesn't
+// have to touch the allocator or the page tables
+struct KernelStackCache {
+	static constexpr usize MAX_STACKS = 4;
+
+	void* stacks[MAX_STACKS] {};
+	usize count {};
+};
+
+// kernel stacks live in their own region with an unmapped guard page below each one,
+// they are not zeroed so whoever uses one has to initialize what it reads
+void kernel_stack_init();
+
+// returns the lowest address of the stack or nullptr if there is no memory or address space left
+void* kernel_stack_alloc();
+void kernel_stack_free(void* base);
+
+// used by the double fault handler to tell a stack overflow apart from other faults
+bool kernel_stack_is_guard(usize addr);
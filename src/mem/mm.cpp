@@ -1,64 +1,49 @@
 #include "mm.hpp"
 #include "mem/mem.hpp"
 #include "vspace.hpp"
+#include "system_pte.hpp"
+#include "mmio_cache.hpp"
 #include "sched/process.hpp"
 #include "arch/arch_sched.hpp"
 #include "sched/thread.hpp"
 #include "utils/except.hpp"
 #include "cstring.hpp"
+#include <hz/algorithm.hpp>
 
 NTAPI PVOID MmMapIoSpace(
 	PHYSICAL_ADDRESS addr,
 	SIZE_T num_of_bytes,
 	MEMORY_CACHING_TYPE cache_type) {
-	if (cache_type == MmCached || cache_type == MmHardwareCoherentCached) {
-		return to_virt<void>(static_cast<usize>(addr.QuadPart));
-	}
-
-	assert(addr.QuadPart % PAGE_SIZE == 0);
-
-	auto* virt = KERNEL_VSPACE.alloc(0, num_of_bytes);
-	if (!virt) {
-		return nullptr;
-	}
+	auto phys = static_cast<usize>(addr.QuadPart);
 
 	CacheMode cache_mode;
-	if (cache_type == MmWriteCombined) {
-		cache_mode = CacheMode::WriteCombine;
-	}
-	else {
-		cache_mode = CacheMode::Uncached;
-	}
-
-	for (usize i = 0; i < num_of_bytes; i += PAGE_SIZE) {
-		auto status = KERNEL_MAP->map(
-			reinterpret_cast<u64>(virt) + i,
-			static_cast<u64>(addr.QuadPart) + i,
-			PageFlags::Read | PageFlags::Write,
-			cache_mode);
-		if (!status) {
-			for (usize j = 0; j < i; j += PAGE_SIZE) {
-				KERNEL_MAP->unmap(reinterpret_cast<u64>(virt) + j);
+	switch (cache_type) {
+		case MmCached:
+		case MmHardwareCoherentCached:
+			// the direct map only covers the ranges in the memory map
+			if (phys + num_of_bytes <= to_phys(reinterpret_cast<void*>(HHDM_END))) {
+				return to_virt<void>(phys);
 			}
-			KERNEL_VSPACE.free(virt, num_of_bytes);
-			return nullptr;
-		}
+			cache_mode = CacheMode::WriteBack;
+			break;
+		case MmWriteCombined:
+			cache_mode = CacheMode::WriteCombine;
+			break;
+		default:
+			cache_mode = CacheMode::Uncached;
+			break;
 	}
 
-	return virt;
+	return mmio_map(phys, num_of_bytes, cache_mode);
 }
 
-NTAPI void MmUnmapIoSpace(PVOID addr, SIZE_T num_of_bytes) {
+NTAPI void MmUnmapIoSpace(PVOID addr, SIZE_T) {
 	auto ptr = reinterpret_cast<u64>(addr);
 	if (ptr <= HHDM_END) {
 		return;
 	}
 
-	assert(ptr % PAGE_SIZE == 0);
-
-	for (usize i = 0; i < num_of_bytes; i += PAGE_SIZE) {
-		KERNEL_MAP->unmap(ptr + i);
-	}
+	mmio_unmap(addr);
 }
 
 NTAPI PVOID MmMapLockedPagesSpecifyCache(
@@ -98,7 +83,8 @@ NTAPI PVOID MmMapLockedPagesSpecifyCache(
 	}
 
 	if (access_mode == KernelMode) {
-		auto* virt = KERNEL_VSPACE.alloc(0, mdl->byte_count);
+		usize pages = ALIGNUP(mdl->byte_count, PAGE_SIZE) / PAGE_SIZE;
+		auto* virt = system_pte_reserve(pages);
 		if (!virt) {
 			return nullptr;
 		}
@@ -121,10 +107,7 @@ NTAPI PVOID MmMapLockedPagesSpecifyCache(
 				flags,
 				cache_mode);
 			if (!status) {
-				for (usize j = 0; j < i; j += PAGE_SIZE) {
-					KERNEL_MAP->unmap(reinterpret_cast<u64>(virt) + j);
-				}
-				KERNEL_VSPACE.free(virt, mdl->byte_count);
+				system_pte_release(virt, pages);
 				return nullptr;
 			}
 		}
@@ -172,8 +155,9 @@ NTAPI PVOID MmMapLockedPagesSpecifyCache(
 				cache_mode);
 			if (!status) {
 				for (usize j = 0; j < i; j += PAGE_SIZE) {
-					process->page_map.unmap(virt + j);
+					process->page_map.unmap(virt + j, false);
 				}
+				process->page_map.flush(virt, i / PAGE_SIZE);
 				process->free(virt, mdl->byte_count);
 				ExRaiseStatus(STATUS_INSUFFICIENT_RESOURCES);
 			}
@@ -191,8 +175,9 @@ NTAPI extern "C" void MmUnmapLockedPages(PVOID base_addr, MDL* mdl) {
 		auto* thread = get_current_thread();
 		auto* process = thread->process;
 		for (usize i = 0; i < mdl->byte_count; i += PAGE_SIZE) {
-			process->page_map.unmap(reinterpret_cast<u64>(base_addr) + i);
+			process->page_map.unmap(reinterpret_cast<u64>(base_addr) + i, false);
 		}
+		process->page_map.flush(reinterpret_cast<u64>(base_addr), ALIGNUP(mdl->byte_count, PAGE_SIZE) / PAGE_SIZE);
 		process->free(reinterpret_cast<u64>(base_addr), mdl->byte_count);
 		mdl->start_va = nullptr;
 	}
@@ -200,11 +185,7 @@ NTAPI extern "C" void MmUnmapLockedPages(PVOID base_addr, MDL* mdl) {
 		assert(mdl->mdl_flags & MDL_MAPPED_TO_SYSTEM_VA);
 		assert(base_addr == mdl->mapped_system_va);
 
-		for (usize i = 0; i < mdl->byte_count; i += PAGE_SIZE) {
-			KERNEL_MAP->unmap(reinterpret_cast<u64>(base_addr) + i);
-		}
-
-		KERNEL_VSPACE.free(base_addr, mdl->byte_count);
+		system_pte_release(base_addr, ALIGNUP(mdl->byte_count, PAGE_SIZE) / PAGE_SIZE);
 
 		mdl->mapped_system_va = nullptr;
 		mdl->mdl_flags &= ~MDL_MAPPED_TO_SYSTEM_VA;
@@ -348,6 +329,25 @@ NTAPI void MmFreePagesFromMdl(MDL* mdl) {
 	}
 }
 
+NTAPI void MmBuildMdlForNonPagedPool(MDL* mdl) {
+	auto* pfn = reinterpret_cast<PFN_NUMBER*>(&mdl[1]);
+	auto start = reinterpret_cast<u64>(mdl->start_va);
+	usize count = ALIGNUP(mdl->byte_offset + mdl->byte_count, PAGE_SIZE) / PAGE_SIZE;
+
+	u64 phys[64];
+	for (usize i = 0; i < count; i += 64) {
+		usize batch = hz::min(count - i, usize {64});
+		KERNEL_MAP->get_phys_range(start + i * PAGE_SIZE, batch, phys);
+		for (usize j = 0; j < batch; ++j) {
+			assert(phys[j]);
+			pfn[i + j] = static_cast<PFN_NUMBER>(phys[j] >> 12);
+		}
+	}
+
+	mdl->mapped_system_va = reinterpret_cast<PVOID>(start + mdl->byte_offset);
+	mdl->mdl_flags |= MDL_SOURCE_IS_NONPAGED_POOL;
+}
+
 NTAPI NTSTATUS MmAllocateMdlForIoSpace(
 	MM_PHYSICAL_ADDRESS_LIST* phys_addr_list,
 	SIZE_T num_of_entries,
@@ -387,44 +387,23 @@ NTAPI NTSTATUS MmAllocateMdlForIoSpace(
 	return STATUS_SUCCESS;
 }
 
-namespace {
-	struct ContiguousAlloc {
-		hz::list_hook hook {};
-		PVOID base {};
-		usize phys {};
-		usize size {};
-	};
-
-	KSPIN_LOCK CONTIGUOUS_ALLOC_LOCK {};
-	hz::list<ContiguousAlloc, &ContiguousAlloc::hook> CONTIGUOUS_ALLOCS {};
-}
-
 NTAPI extern "C" PVOID MmAllocateContiguousMemorySpecifyCache(
 	SIZE_T num_of_bytes,
 	PHYSICAL_ADDRESS lowest_addr,
 	PHYSICAL_ADDRESS highest_addr,
 	PHYSICAL_ADDRESS boundary_addr_multiple,
 	MEMORY_CACHING_TYPE cache_type) {
-	auto* entry = static_cast<ContiguousAlloc*>(kcalloc(sizeof(ContiguousAlloc)));
-	if (!entry) {
+	usize pages = ALIGNUP(num_of_bytes, PAGE_SIZE) / PAGE_SIZE;
+	if (!pages) {
 		return nullptr;
 	}
 
-	usize pages = ALIGNUP(num_of_bytes, PAGE_SIZE) / PAGE_SIZE;
 	usize phys = pmalloc_contiguous(
 		static_cast<usize>(lowest_addr.QuadPart),
 		static_cast<usize>(highest_addr.QuadPart),
 		pages,
 		static_cast<usize>(boundary_addr_multiple.QuadPart));
 	if (!phys) {
-		kfree(entry, sizeof(ContiguousAlloc));
-		return nullptr;
-	}
-
-	auto* virt = KERNEL_VSPACE.alloc(0, num_of_bytes);
-	if (!virt) {
-		pfree_contiguous(phys, pages);
-		kfree(entry, sizeof(ContiguousAlloc));
 		return nullptr;
 	}
 
@@ -442,7 +421,27 @@ NTAPI extern "C" PVOID MmAllocateContiguousMemorySpecifyCache(
 			break;
 	}
 
-	for (usize i = 0; i < num_of_bytes; i += PAGE_SIZE) {
+	for (usize i = 0; i < pages; ++i) {
+		auto* page = Page::from_phys(phys + i * PAGE_SIZE);
+		page->allocated.cache_mode = cache_mode;
+		page->allocated.contiguous_pages = 0;
+		page->allocated.dma_chunk = nullptr;
+	}
+	// the size is kept in the first page so that freeing doesn't have to search for the allocation
+	Page::from_phys(phys)->allocated.contiguous_pages = pages;
+
+	// cached memory is already mapped in the direct map
+	if (cache_mode == CacheMode::WriteBack) {
+		return to_virt<void>(phys);
+	}
+
+	auto* virt = KERNEL_VSPACE.alloc(0, pages * PAGE_SIZE);
+	if (!virt) {
+		pfree_contiguous(phys, pages);
+		return nullptr;
+	}
+
+	for (usize i = 0; i < pages * PAGE_SIZE; i += PAGE_SIZE) {
 		auto status = KERNEL_MAP->map(
 			reinterpret_cast<u64>(virt) + i,
 			phys + i,
@@ -450,44 +449,49 @@ NTAPI extern "C" PVOID MmAllocateContiguousMemorySpecifyCache(
 			cache_mode);
 		if (!status) {
 			for (usize j = 0; j < i; j += PAGE_SIZE) {
-				KERNEL_MAP->unmap(reinterpret_cast<u64>(virt) + j);
+				KERNEL_MAP->unmap(reinterpret_cast<u64>(virt) + j, false);
 			}
+			KERNEL_MAP->flush(reinterpret_cast<u64>(virt), i / PAGE_SIZE);
 
-			KERNEL_VSPACE.free(virt, num_of_bytes);
+			KERNEL_VSPACE.free(virt, pages * PAGE_SIZE);
 			pfree_contiguous(phys, pages);
-			kfree(entry, sizeof(ContiguousAlloc));
 			return nullptr;
 		}
 	}
 
-	entry->base = virt;
-	entry->phys = phys;
-	entry->size = num_of_bytes;
-
-	auto old = KeAcquireSpinLockRaiseToDpc(&CONTIGUOUS_ALLOC_LOCK);
-	CONTIGUOUS_ALLOCS.push(entry);
-	KeReleaseSpinLock(&CONTIGUOUS_ALLOC_LOCK, old);
-
 	return virt;
 }
 
 NTAPI void MmFreeContiguousMemory(PVOID base_addr) {
-	auto old = KeAcquireSpinLockRaiseToDpc(&CONTIGUOUS_ALLOC_LOCK);
-
-	for (auto& alloc : CONTIGUOUS_ALLOCS) {
-		if (alloc.base == base_addr) {
-			CONTIGUOUS_ALLOCS.remove(&alloc);
-			pfree_contiguous(alloc.phys, ALIGNUP(alloc.size, PAGE_SIZE) / PAGE_SIZE);
-			KERNEL_VSPACE.free(base_addr, alloc.size);
-			kfree(&alloc, sizeof(ContiguousAlloc));
-			break;
+	auto virt = reinterpret_cast<u64>(base_addr);
+
+	usize phys;
+	if (virt <= HHDM_END) {
+		phys = to_phys(base_addr);
+	}
+	else {
+		phys = KERNEL_MAP->get_phys(virt);
+	}
+
+	auto* page = Page::from_phys(phys);
+	usize pages = page->allocated.contiguous_pages;
+	assert(pages);
+	page->allocated.contiguous_pages = 0;
+
+	if (virt > HHDM_END) {
+		for (usize i = 0; i < pages * PAGE_SIZE; i += PAGE_SIZE) {
+			KERNEL_MAP->unmap(virt + i, false);
 		}
+		KERNEL_MAP->flush(virt, pages);
+		KERNEL_VSPACE.free(base_addr, pages * PAGE_SIZE);
 	}
 
-	KeReleaseSpinLock(&CONTIGUOUS_ALLOC_LOCK, old);
+	pfree_contiguous(phys, pages);
 }
 
 NTAPI PHYSICAL_ADDRESS MmGetPhysicalAddress(PVOID base_addr) {
-	auto addr = get_current_thread()->process->page_map.get_phys(reinterpret_cast<u64>(base_addr));
+	auto virt = reinterpret_cast<u64>(base_addr);
+	auto& map = virt >= 0xFFFF800000000000 ? *KERNEL_MAP : get_current_thread()->process->page_map;
+	auto addr = map.get_phys(virt);
 	return {.QuadPart = static_cast<LONGLONG>(addr)};
 }
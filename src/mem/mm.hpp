@@ -2,6 +2,7 @@
 
 #include "ntdef.h"
 #include "sched/misc.hpp"
+#include "arch/paging.hpp"
 
 enum MEMORY_CACHING_TYPE {
 	MmNonCached = 0,
@@ -25,6 +26,27 @@ enum MEMORY_CACHING_TYPE {
 
 using PFN_NUMBER = ULONG;
 
+#define PAGE_NOACCESS 1
+#define PAGE_READONLY 2
+#define PAGE_READWRITE 4
+#define PAGE_WRITECOPY 8
+#define PAGE_EXECUTE 0x10
+#define PAGE_EXECUTE_READ 0x20
+#define PAGE_EXECUTE_READWRITE 0x40
+#define PAGE_EXECUTE_WRITECOPY 0x80
+#define PAGE_GUARD 0x100
+
+#define MEM_COMMIT 0x1000
+#define MEM_RESERVE 0x2000
+
+#define MEM_DECOMMIT 0x4000
+#define MEM_RELEASE 0x8000
+#define MEM_FREE 0x10000
+#define MEM_PRIVATE 0x20000
+#define MEM_MAPPED 0x40000
+
+#define NtCurrentProcess() ((HANDLE) (LONG_PTR) -1)
+
 struct Process;
 
 #define MDL_MAPPED_TO_SYSTEM_VA 1
@@ -104,6 +126,7 @@ NTAPI extern "C" MDL* MmAllocatePagesForMdlEx(
 	MEMORY_CACHING_TYPE cache_type,
 	ULONG flags);
 NTAPI extern "C" void MmFreePagesFromMdl(MDL* mdl);
+NTAPI extern "C" void MmBuildMdlForNonPagedPool(MDL* mdl);
 
 NTAPI extern "C" NTSTATUS MmAllocateMdlForIoSpace(
 	MM_PHYSICAL_ADDRESS_LIST* phys_addr_list,
@@ -118,4 +141,64 @@ NTAPI extern "C" PVOID MmAllocateContiguousMemorySpecifyCache(
 	MEMORY_CACHING_TYPE cache_type);
 NTAPI extern "C" void MmFreeContiguousMemory(PVOID base_addr);
 
+// fixed size blocks carved out of contiguous chunks for small dma buffers like descriptor rings,
+// blocks are aligned to alignment and never cross boundary if it's non-zero
+struct DMA_POOL;
+
+NTAPI extern "C" DMA_POOL* MmCreateDmaPool(
+	SIZE_T block_size,
+	SIZE_T alignment,
+	SIZE_T boundary,
+	PHYSICAL_ADDRESS highest_acceptable_addr,
+	MEMORY_CACHING_TYPE cache_type);
+NTAPI extern "C" void MmDeleteDmaPool(DMA_POOL* pool);
+NTAPI extern "C" PVOID MmAllocateFromDmaPool(DMA_POOL* pool, PHYSICAL_ADDRESS* phys_addr);
+NTAPI extern "C" void MmFreeToDmaPool(DMA_POOL* pool, PVOID block);
+
 NTAPI extern "C" PHYSICAL_ADDRESS MmGetPhysicalAddress(PVOID base_addr);
+
+NTAPI extern "C" NTSTATUS NtAllocateVirtualMemory(
+	HANDLE process_handle,
+	PVOID* base_address,
+	ULONG_PTR zero_bits,
+	PSIZE_T region_size,
+	ULONG allocation_type,
+	ULONG page_protection);
+NTAPI extern "C" NTSTATUS NtFreeVirtualMemory(
+	HANDLE process_handle,
+	PVOID* base_address,
+	PSIZE_T region_size,
+	ULONG free_type);
+NTAPI extern "C" NTSTATUS NtProtectVirtualMemory(
+	HANDLE process_handle,
+	PVOID* base_address,
+	PSIZE_T region_size,
+	ULONG new_protection,
+	PULONG old_protection);
+
+enum MEMORY_INFORMATION_CLASS {
+	MemoryBasicInformation
+};
+
+struct MEMORY_BASIC_INFORMATION {
+	PVOID BaseAddress;
+	PVOID AllocationBase;
+	ULONG AllocationProtect;
+	USHORT PartitionId;
+	SIZE_T RegionSize;
+	ULONG State;
+	ULONG Protect;
+	ULONG Type;
+};
+
+NTAPI extern "C" NTSTATUS NtQueryVirtualMemory(
+	HANDLE process_handle,
+	PVOID base_address,
+	MEMORY_INFORMATION_CLASS memory_info_class,
+	PVOID memory_info,
+	SIZE_T memory_info_length,
+	PSIZE_T return_length);
+
+bool mm_protection_to_flags(ULONG protection, PageFlags& flags);
+ULONG mm_flags_to_protection(PageFlags flags);
+NTSTATUS mm_reference_process(HANDLE handle, KPROCESSOR_MODE mode, Process*& process);
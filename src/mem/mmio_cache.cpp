@@ -0,0 +1,185 @@
+#include "mmio_cache.hpp"
+#include "system_pte.hpp"
+#include "vspace.hpp"
+#include "mem/mem.hpp"
+#include "assert.hpp"
+#include "sched/process.hpp"
+#include <hz/list.hpp>
+
+namespace {
+	struct MmioMapping {
+		hz::list_hook hook {};
+		usize phys {};
+		usize size {};
+		usize virt {};
+		// the start of the kernel vspace allocation, zero if the mapping is from the system pte pool
+		usize vspace_base {};
+		usize vspace_size {};
+		usize refs {};
+		CacheMode cache_mode {};
+	};
+
+	constexpr usize MAX_IDLE_MAPPINGS = 32;
+
+	KSPIN_LOCK LOCK {};
+	hz::list<MmioMapping, &MmioMapping::hook> ACTIVE {};
+	// least recently released first
+	hz::list<MmioMapping, &MmioMapping::hook> IDLE {};
+	usize IDLE_COUNT {};
+
+	bool contains(const MmioMapping& mapping, usize phys, usize size, CacheMode cache_mode) {
+		return mapping.cache_mode == cache_mode &&
+			phys >= mapping.phys &&
+			phys + size <= mapping.phys + mapping.size;
+	}
+
+	void destroy(MmioMapping* mapping) {
+		if (mapping->vspace_base) {
+			for (usize i = 0; i < mapping->size;) {
+				auto virt = mapping->virt + i;
+				if (virt % LARGE_PAGE_SIZE == 0 && mapping->size - i >= LARGE_PAGE_SIZE &&
+					KERNEL_MAP->unmap_2mb(virt)) {
+					i += LARGE_PAGE_SIZE;
+					continue;
+				}
+				KERNEL_MAP->unmap(virt, false);
+				i += PAGE_SIZE;
+			}
+			KERNEL_MAP->flush(mapping->virt, ALIGNUP(mapping->size, PAGE_SIZE) / PAGE_SIZE);
+			KERNEL_VSPACE.free(reinterpret_cast<void*>(mapping->vspace_base), mapping->vspace_size);
+		}
+		else {
+			system_pte_release(reinterpret_cast<void*>(mapping->virt), mapping->size / PAGE_SIZE);
+		}
+
+		delete mapping;
+	}
+
+	// ranges that contain a whole 2mb block are mapped with large pages where both sides are
+	// aligned, the virtual address is chosen to have the same offset in a 2mb page as the physical one
+	MmioMapping* create(usize phys, usize size, CacheMode cache_mode) {
+		auto* mapping = new MmioMapping {};
+		if (!mapping) {
+			return nullptr;
+		}
+		mapping->phys = phys;
+		mapping->size = size;
+		mapping->cache_mode = cache_mode;
+
+		bool large = ALIGNUP(phys, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE <= phys + size;
+		if (large) {
+			mapping->vspace_size = size + LARGE_PAGE_SIZE;
+			auto* ptr = KERNEL_VSPACE.alloc(0, mapping->vspace_size);
+			if (!ptr) {
+				delete mapping;
+				return nullptr;
+			}
+			mapping->vspace_base = reinterpret_cast<usize>(ptr);
+			mapping->virt = ALIGNUP(mapping->vspace_base, LARGE_PAGE_SIZE) + phys % LARGE_PAGE_SIZE;
+		}
+		else {
+			auto* ptr = system_pte_reserve(size / PAGE_SIZE);
+			if (!ptr) {
+				delete mapping;
+				return nullptr;
+			}
+			mapping->virt = reinterpret_cast<usize>(ptr);
+		}
+
+		for (usize i = 0; i < size;) {
+			auto virt = mapping->virt + i;
+			if (large && (phys + i) % LARGE_PAGE_SIZE == 0 && size - i >= LARGE_PAGE_SIZE) {
+				if (!KERNEL_MAP->map_2mb(virt, phys + i, PageFlags::Read | PageFlags::Write, cache_mode)) {
+					mapping->size = i;
+					destroy(mapping);
+					return nullptr;
+				}
+				i += LARGE_PAGE_SIZE;
+				continue;
+			}
+
+			if (!KERNEL_MAP->map(virt, phys + i, PageFlags::Read | PageFlags::Write, cache_mode)) {
+				mapping->size = large ? i : size;
+				destroy(mapping);
+				return nullptr;
+			}
+			i += PAGE_SIZE;
+		}
+
+		return mapping;
+	}
+}
+
+void* mmio_map(usize phys, usize size, CacheMode cache_mode) {
+	usize page_offset = phys & (PAGE_SIZE - 1);
+	size = ALIGNUP(size + page_offset, PAGE_SIZE);
+	phys -= page_offset;
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&LOCK);
+
+	MmioMapping* mapping = nullptr;
+	for (auto& active : ACTIVE) {
+		if (contains(active, phys, size, cache_mode)) {
+			mapping = &active;
+			break;
+		}
+	}
+
+	if (!mapping) {
+		for (auto& idle : IDLE) {
+			if (contains(idle, phys, size, cache_mode)) {
+				mapping = &idle;
+				IDLE.remove(mapping);
+				--IDLE_COUNT;
+				ACTIVE.push(mapping);
+				break;
+			}
+		}
+	}
+
+	if (!mapping) {
+		mapping = create(phys, size, cache_mode);
+		if (!mapping) {
+			KeReleaseSpinLock(&LOCK, old);
+			return nullptr;
+		}
+		ACTIVE.push(mapping);
+	}
+
+	++mapping->refs;
+	auto virt = mapping->virt + (phys - mapping->phys) + page_offset;
+
+	KeReleaseSpinLock(&LOCK, old);
+	return reinterpret_cast<void*>(virt);
+}
+
+void mmio_unmap(void* ptr) {
+	auto virt = reinterpret_cast<usize>(ptr);
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&LOCK);
+
+	MmioMapping* mapping = nullptr;
+	for (auto& active : ACTIVE) {
+		if (virt >= active.virt && virt < active.virt + active.size) {
+			mapping = &active;
+			break;
+		}
+	}
+	assert(mapping);
+
+	MmioMapping* evicted = nullptr;
+	if (--mapping->refs == 0) {
+		ACTIVE.remove(mapping);
+		IDLE.push(mapping);
+		if (++IDLE_COUNT > MAX_IDLE_MAPPINGS) {
+			evicted = IDLE.pop_front();
+			--IDLE_COUNT;
+		}
+	}
+
+	if (evicted) {
+		destroy(evicted);
+	}
+
+	KeReleaseSpinLock(&LOCK, old);
+}
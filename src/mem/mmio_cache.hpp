@@ -0,0 +1,11 @@
+#pragma once
+#include "types.hpp"
+#include "arch/caching.hpp"
+
+// mappings of physical ranges outside of ram are shared between everyone mapping a range
+// with the same cache mode, released ones are kept around for a while as drivers like acpi
+// tend to map the same registers over and over again
+
+// returns nullptr if there is no address space left or the mapping failed
+void* mmio_map(usize phys, usize size, CacheMode cache_mode);
+void mmio_unmap(void* virt);
@@ -4,10 +4,37 @@
 #include "early_pmalloc.hpp"
 #include "cstring.hpp"
 #include "sched/process.hpp"
+#include "atomic.hpp"
+#include "arch/paging.hpp"
 
 namespace {
 	hz::list<Page, &Page::hook> LIST {};
+	// freed 2mb frames are kept whole here so that large page allocations don't have to search for them
+	hz::list<Page, &Page::hook> LARGE_LIST {};
+	usize LARGE_COUNT {};
 	KSPIN_LOCK LOCK {};
+	usize FREE_PAGES {};
+	usize TOTAL_PAGES {};
+
+	constexpr usize LARGE_PAGES = LARGE_PAGE_SIZE / PAGE_SIZE;
+	// at most this many 2mb frames are held back from the small page list
+	constexpr usize MAX_LARGE_COUNT = 16;
+	// the number of free runs looked at when splitting a new 2mb frame out of the small page list
+	constexpr usize LARGE_SCAN_LIMIT = 64;
+
+	// gives the cached 2mb frames back to the small page list, the lock has to be held
+	bool drain_large_list() {
+		if (!LARGE_COUNT) {
+			return false;
+		}
+
+		while (auto page = LARGE_LIST.pop()) {
+			page->pm.count = LARGE_PAGES;
+			LIST.push(page);
+		}
+		LARGE_COUNT = 0;
+		return true;
+	}
 }
 
 Page* PAGE_REGION;
@@ -54,6 +81,8 @@ void pmalloc_add_mem(usize base, usize size) {
 	page->pm.count = size / PAGE_SIZE;
 
 	LIST.push(page);
+	FREE_PAGES += size / PAGE_SIZE;
+	TOTAL_PAGES += size / PAGE_SIZE;
 }
 
 usize pmalloc() {
@@ -64,6 +93,9 @@ usize pmalloc() {
 	auto old = KeAcquireSpinLockRaiseToDpc(&LOCK);
 
 	auto page = LIST.pop();
+	if (!page && drain_large_list()) {
+		page = LIST.pop();
+	}
 	if (!page) {
 		KeReleaseSpinLock(&LOCK, old);
 		return 0;
@@ -74,6 +106,7 @@ usize pmalloc() {
 		next->pm.count = page->pm.count - 1;
 		LIST.push(next);
 	}
+	--FREE_PAGES;
 
 	KeReleaseSpinLock(&LOCK, old);
 	return page->phys();
@@ -83,6 +116,7 @@ usize pmalloc_in_range(usize low, usize high) {
 	auto old = KeAcquireSpinLockRaiseToDpc(&LOCK);
 
 	usize ret = 0;
+again:
 	for (auto& page : LIST) {
 		auto phys = page.phys();
 		if (phys >= low && phys < high) {
@@ -95,10 +129,15 @@ usize pmalloc_in_range(usize low, usize high) {
 			}
 
 			ret = phys;
+			--FREE_PAGES;
 			break;
 		}
 	}
 
+	if (!ret && drain_large_list()) {
+		goto again;
+	}
+
 	KeReleaseSpinLock(&LOCK, old);
 	return ret;
 }
@@ -110,6 +149,7 @@ usize pmalloc_contiguous(usize low, usize high, usize count, usize boundary) {
 
 	usize ret = 0;
 	Page* next;
+again:
 	for (auto* page = LIST.front(); page; page = next) {
 		next = static_cast<Page*>(page->hook.next);
 
@@ -152,6 +192,7 @@ usize pmalloc_contiguous(usize low, usize high, usize count, usize boundary) {
 			new_page->pm.count = page->pm.count - count;
 			LIST.push(new_page);
 			ret = start_phys;
+			FREE_PAGES -= count;
 			break;
 		}
 		else {
@@ -203,20 +244,107 @@ usize pmalloc_contiguous(usize low, usize high, usize count, usize boundary) {
 
 			if (success) {
 				ret = start_phys;
+				FREE_PAGES -= count;
 				break;
 			}
 		}
 	}
 
+	if (!ret && drain_large_list()) {
+		goto again;
+	}
+
+	KeReleaseSpinLock(&LOCK, old);
+	return ret;
+}
+
+usize pmalloc_large() {
+	auto old = KeAcquireSpinLockRaiseToDpc(&LOCK);
+
+	if (auto page = LARGE_LIST.pop()) {
+		--LARGE_COUNT;
+		FREE_PAGES -= LARGE_PAGES;
+		KeReleaseSpinLock(&LOCK, old);
+		return page->phys();
+	}
+
+	// only look at the first runs so that a fragmented free list doesn't get scanned
+	// on every large page allocation, the caller falls back to small pages
+	usize ret = 0;
+	usize scanned = 0;
+	for (auto* page = LIST.front(); page && scanned < LARGE_SCAN_LIMIT; ++scanned) {
+		auto start = page->phys();
+		auto end = start + page->pm.count * PAGE_SIZE;
+		auto aligned = ALIGNUP(start, LARGE_PAGE_SIZE);
+		if (aligned + LARGE_PAGE_SIZE > end) {
+			page = static_cast<Page*>(page->hook.next);
+			continue;
+		}
+
+		LIST.remove(page);
+		if (aligned > start) {
+			page->pm.count = (aligned - start) / PAGE_SIZE;
+			LIST.push(page);
+		}
+		if (aligned + LARGE_PAGE_SIZE < end) {
+			auto after = Page::from_phys(aligned + LARGE_PAGE_SIZE);
+			after->pm.count = (end - aligned - LARGE_PAGE_SIZE) / PAGE_SIZE;
+			LIST.push(after);
+		}
+
+		ret = aligned;
+		FREE_PAGES -= LARGE_PAGES;
+		break;
+	}
+
 	KeReleaseSpinLock(&LOCK, old);
 	return ret;
 }
 
+void pfree_large(usize phys) {
+	assert(phys % LARGE_PAGE_SIZE == 0);
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&LOCK);
+	auto page = Page::from_phys(phys);
+	if (LARGE_COUNT < MAX_LARGE_COUNT) {
+		LARGE_LIST.push(page);
+		++LARGE_COUNT;
+	}
+	else {
+		page->pm.count = LARGE_PAGES;
+		LIST.push(page);
+	}
+	FREE_PAGES += LARGE_PAGES;
+	KeReleaseSpinLock(&LOCK, old);
+}
+
 void pfree(usize phys) {
 	auto old = KeAcquireSpinLockRaiseToDpc(&LOCK);
 	auto page = Page::from_phys(phys);
 	page->pm.count = 1;
 	LIST.push(page);
+	++FREE_PAGES;
+	KeReleaseSpinLock(&LOCK, old);
+}
+
+void pfree_batch(const usize* phys, usize count) {
+	auto old = KeAcquireSpinLockRaiseToDpc(&LOCK);
+	for (usize i = 0; i < count; ++i) {
+		auto page = Page::from_phys(phys[i]);
+		page->pm.count = 1;
+		LIST.push(page);
+	}
+	FREE_PAGES += count;
+	KeReleaseSpinLock(&LOCK, old);
+}
+
+void pfree_list(hz::list<Page, &Page::hook>& pages) {
+	auto old = KeAcquireSpinLockRaiseToDpc(&LOCK);
+	while (auto page = pages.pop()) {
+		page->pm.count = 1;
+		LIST.push(page);
+		++FREE_PAGES;
+	}
 	KeReleaseSpinLock(&LOCK, old);
 }
 
@@ -225,5 +353,14 @@ void pfree_contiguous(usize phys, usize count) {
 	auto page = Page::from_phys(phys);
 	page->pm.count = count;
 	LIST.push(page);
+	FREE_PAGES += count;
 	KeReleaseSpinLock(&LOCK, old);
 }
+
+usize pmalloc_free_pages() {
+	return atomic_load(&FREE_PAGES, memory_order::relaxed);
+}
+
+usize pmalloc_total_pages() {
+	return TOTAL_PAGES;
+}
@@ -24,7 +24,16 @@ struct Page {
 
 		struct {
 			CacheMode cache_mode;
+			// set in the first page of a contiguous allocation
+			u32 contiguous_pages;
+			// the dma pool chunk the page belongs to
+			void* dma_chunk;
 		} allocated;
+
+		struct {
+			u16 entries;
+			bool owned;
+		} page_table;
 	};
 
 	[[nodiscard]] inline usize phys() const {
@@ -39,8 +48,17 @@ struct Page {
 usize pmalloc();
 usize pmalloc_in_range(usize low, usize high);
 usize pmalloc_contiguous(usize low, usize high, usize count, usize boundary);
+// allocates a 2mb aligned 2mb frame, this only does a bounded search and may fail
+// even when such a frame exists
+usize pmalloc_large();
 void pfree(usize phys);
+void pfree_large(usize phys);
 void pfree_contiguous(usize phys, usize count);
+void pfree_batch(const usize* phys, usize count);
+void pfree_list(hz::list<Page, &Page::hook>& pages);
+// the amount of free pages is only a snapshot, it is meant for reclaim heuristics
+usize pmalloc_free_pages();
+usize pmalloc_total_pages();
 void pmalloc_add_from_early();
 void pmalloc_create_struct_pages(usize base, usize size);
 void pmalloc_init(usize max_usable_phys_addr);
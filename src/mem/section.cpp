@@ -0,0 +1,281 @@
+#include "section.hpp"
+#include "mm.hpp"
+#include "malloc.hpp"
+#include "pmalloc.hpp"
+#include "fs/file.hpp"
+#include "fs/vfs.hpp"
+#include "dev/pnp.hpp"
+#include "rtl.hpp"
+#include "sys/misc.hpp"
+#include "sys/user_access.hpp"
+#include "arch/arch_syscall.hpp"
+#include "utils/except.hpp"
+#include "cstring.hpp"
+#include <hz/algorithm.hpp>
+
+NTAPI extern "C" OBJECT_TYPE* MmSectionObjectType = nullptr;
+
+void section_init() {
+	UNICODE_STRING name = RTL_CONSTANT_STRING(u"Section");
+	OBJECT_TYPE_INITIALIZER init {};
+	init.delete_proc = [](PVOID object) {
+		static_cast<Section*>(object)->~Section();
+	};
+	auto status = ObCreateObjectType(&name, &init, nullptr, &MmSectionObjectType);
+	assert(NT_SUCCESS(status));
+}
+
+Section::~Section() {
+	if (on_delete) {
+		on_delete(this);
+	}
+
+	kfree(runs, run_count * sizeof(SectionRun));
+	kfree(relocs, relocs_size);
+	if (reloc_page_start) {
+		kfree(reloc_page_start, (size / PAGE_SIZE + 1) * sizeof(u32));
+	}
+	kfree(reloc_blocks, reloc_block_count * sizeof(u32));
+
+	if (!pages) {
+		return;
+	}
+
+	for (usize i = 0; i < size / PAGE_SIZE; ++i) {
+		if (pages[i]) {
+			pfree(pages[i]);
+		}
+	}
+	kfree(pages, size / PAGE_SIZE * sizeof(usize));
+}
+
+usize Section::get_page(usize offset) {
+	assert(offset < size);
+	// reading the backing file can block
+	assert(KeGetCurrentIrql() < DISPATCH_LEVEL);
+	auto index = offset / PAGE_SIZE;
+
+	if (auto phys = __atomic_load_n(&pages[index], __ATOMIC_ACQUIRE)) {
+		return phys;
+	}
+
+	// the page is filled without any locks held, if another thread installed
+	// the same page meanwhile its frame is used and this one is freed
+	auto phys = pmalloc();
+	if (!phys) {
+		return 0;
+	}
+
+	auto* page = to_virt<u8>(phys);
+	if (file) {
+		read_backing(index * PAGE_SIZE, page, PAGE_SIZE);
+	}
+	else {
+		memset(page, 0, PAGE_SIZE);
+	}
+	if (fixup) {
+		fixup(this, index * PAGE_SIZE, page);
+	}
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&lock);
+	if (auto existing = pages[index]) {
+		KeReleaseSpinLock(&lock, old);
+		pfree(phys);
+		return existing;
+	}
+	__atomic_store_n(&pages[index], phys, __ATOMIC_RELEASE);
+	++resident_pages;
+	KeReleaseSpinLock(&lock, old);
+
+	return phys;
+}
+
+void Section::read_backing(usize offset, void* data, usize amount) {
+	memset(data, 0, amount);
+
+	for (usize i = 0; i < run_count; ++i) {
+		auto& run = runs[i];
+		usize start = hz::max(offset, run.offset);
+		usize end = hz::min(offset + amount, run.offset + run.size);
+		if (start >= end) {
+			continue;
+		}
+
+		// a short read leaves the rest zeroed
+		(void) file->read(
+			static_cast<u8*>(data) + (start - offset),
+			run.file_offset + (start - run.offset),
+			end - start);
+	}
+}
+
+Section* section_create(usize size, PageFlags flags) {
+	size = ALIGNUP(size, PAGE_SIZE);
+
+	PVOID object;
+	auto status = ObCreateObject(
+		KernelMode,
+		MmSectionObjectType,
+		nullptr,
+		KernelMode,
+		nullptr,
+		sizeof(Section),
+		0,
+		sizeof(Section),
+		&object);
+	if (!NT_SUCCESS(status)) {
+		return nullptr;
+	}
+
+	auto* section = new (object) Section {};
+	section->size = size;
+	section->flags = flags;
+	section->pages = static_cast<usize*>(kcalloc(size / PAGE_SIZE * sizeof(usize)));
+	if (!section->pages) {
+		ObfDereferenceObject(section);
+		return nullptr;
+	}
+
+	return section;
+}
+
+static NTSTATUS section_read_file(Section* section, HANDLE file_handle) {
+	for (usize i = 0; i < section->size; i += PAGE_SIZE) {
+		auto phys = section->get_page(i);
+		if (!phys) {
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		IO_STATUS_BLOCK status_block {};
+		LARGE_INTEGER offset {.QuadPart = static_cast<i64>(i)};
+		auto status = ZwReadFile(
+			file_handle,
+			nullptr,
+			nullptr,
+			nullptr,
+			&status_block,
+			to_virt<void>(phys),
+			PAGE_SIZE,
+			&offset,
+			nullptr);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+		// the rest of the section past the end of the file stays zeroed
+		if (status_block.info < PAGE_SIZE) {
+			break;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTAPI NTSTATUS NtCreateSection(
+	PHANDLE section_handle,
+	ACCESS_MASK desired_access,
+	OBJECT_ATTRIBUTES* object_attribs,
+	PLARGE_INTEGER maximum_size,
+	ULONG section_page_protection,
+	ULONG allocation_attribs,
+	HANDLE file_handle) {
+	auto mode = ExGetPreviousMode();
+
+	LARGE_INTEGER max_size {};
+	if (maximum_size) {
+		if (mode == UserMode) {
+			__try {
+				enable_user_access();
+				ProbeForRead(maximum_size, sizeof(LARGE_INTEGER), alignof(LARGE_INTEGER));
+				max_size = *maximum_size;
+				disable_user_access();
+			}
+			__except (1) {
+				disable_user_access();
+				return GetExceptionCode();
+			}
+		}
+		else {
+			max_size = *maximum_size;
+		}
+	}
+
+	// file backed sections are a copy of the file taken when the section is created, views don't see
+	// later changes to the file and writes to them aren't written back. the size of the file can't be
+	// queried yet so they need an explicit size too
+	if (max_size.QuadPart <= 0) {
+		return STATUS_INVALID_PARAMETER_4;
+	}
+	// the pages are always committed, reserving them isn't supported
+	else if (allocation_attribs & ~SEC_COMMIT) {
+		return STATUS_INVALID_PARAMETER_6;
+	}
+
+	PageFlags flags;
+	if (!mm_protection_to_flags(section_page_protection, flags)) {
+		return STATUS_INVALID_PAGE_PROTECTION;
+	}
+
+	usize size = ALIGNUP(static_cast<usize>(max_size.QuadPart), PAGE_SIZE);
+
+	PVOID object;
+	auto status = ObCreateObject(
+		mode,
+		MmSectionObjectType,
+		object_attribs,
+		mode,
+		nullptr,
+		sizeof(Section),
+		0,
+		sizeof(Section),
+		&object);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	auto* section = new (object) Section {};
+	section->size = size;
+	section->flags = flags;
+	section->pages = static_cast<usize*>(kcalloc(size / PAGE_SIZE * sizeof(usize)));
+	if (!section->pages) {
+		ObfDereferenceObject(section);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (file_handle) {
+		status = section_read_file(section, file_handle);
+		if (!NT_SUCCESS(status)) {
+			ObfDereferenceObject(section);
+			return status;
+		}
+	}
+
+	HANDLE handle;
+	status = ObInsertObject(
+		section,
+		nullptr,
+		desired_access,
+		0,
+		nullptr,
+		&handle);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (mode == UserMode) {
+		__try {
+			enable_user_access();
+			ProbeForWrite(section_handle, sizeof(HANDLE), alignof(HANDLE));
+			*section_handle = handle;
+			disable_user_access();
+		}
+		__except (1) {
+			disable_user_access();
+			return GetExceptionCode();
+		}
+	}
+	else {
+		*section_handle = handle;
+	}
+
+	return STATUS_SUCCESS;
+}
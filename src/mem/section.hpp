@@ -0,0 +1,90 @@
+#pragma once
+#include "types.hpp"
+#include "ntdef.h"
+#include "arch/paging.hpp"
+#include "utils/spinlock.hpp"
+#include "fs/object.hpp"
+#include "shared_ptr.hpp"
+
+struct VNode;
+
+// file contents placed at an offset in the section
+struct SectionRun {
+	usize offset;
+	usize size;
+	usize file_offset;
+};
+
+struct Section {
+	~Section();
+
+	// returns the frame backing the page at the given offset, pages are allocated on first use
+	// and filled from the backing file if there is one or zeroed otherwise.
+	// must be called without any spinlocks held
+	usize get_page(usize offset);
+	// reads the original contents from the backing file, parts not covered by a run read as zero
+	void read_backing(usize offset, void* data, usize size);
+
+	inline bool owns_page(usize offset, usize phys) const {
+		return pages[offset / PAGE_SIZE] == phys;
+	}
+
+	usize size {};
+	PageFlags flags {};
+	// one frame per page, owned by the section and shared by every view
+	usize* pages {};
+	usize resident_pages {};
+
+	std::shared_ptr<VNode> file {};
+	SectionRun* runs {};
+	usize run_count {};
+	// called for every page read in from the file, used for applying image relocations
+	void (*fixup)(Section* section, usize offset, u8* page) {};
+	u8* relocs {};
+	usize relocs_size {};
+	usize reloc_delta {};
+	// offsets of the relocation blocks in relocs grouped by the page they start in,
+	// the blocks of page i are reloc_blocks[reloc_page_start[i]] up to reloc_blocks[reloc_page_start[i + 1]]
+	u32* reloc_page_start {};
+	u32* reloc_blocks {};
+	usize reloc_block_count {};
+	// called when the last reference to the section is dropped
+	void (*on_delete)(Section* section) {};
+
+	KSPIN_LOCK lock {};
+};
+
+#define SEC_RESERVE 0x4000000
+#define SEC_COMMIT 0x8000000
+
+enum SECTION_INHERIT {
+	ViewShare = 1,
+	ViewUnmap = 2
+};
+
+void section_init();
+// returns a referenced section without a handle or nullptr on failure
+Section* section_create(usize size, PageFlags flags);
+
+NTAPI extern "C" OBJECT_TYPE* MmSectionObjectType;
+
+NTAPI extern "C" NTSTATUS NtCreateSection(
+	PHANDLE section_handle,
+	ACCESS_MASK desired_access,
+	OBJECT_ATTRIBUTES* object_attribs,
+	PLARGE_INTEGER maximum_size,
+	ULONG section_page_protection,
+	ULONG allocation_attribs,
+	HANDLE file_handle);
+NTAPI extern "C" NTSTATUS NtMapViewOfSection(
+	HANDLE section_handle,
+	HANDLE process_handle,
+	PVOID* base_address,
+	ULONG_PTR zero_bits,
+	SIZE_T commit_size,
+	PLARGE_INTEGER section_offset,
+	PSIZE_T view_size,
+	SECTION_INHERIT inherit_disposition,
+	ULONG allocation_type,
+	ULONG win32_protect);
+NTAPI extern "C" NTSTATUS NtUnmapViewOfSection(HANDLE process_handle, PVOID base_address);
@@ -0,0 +1,124 @@
+#pragma once
+#include "pmalloc.hpp"
+#include "assert.hpp"
+#include "arch/irql.hpp"
+#include "utils/spinlock.hpp"
+#include <hz/array.hpp>
+
+// object sizes don't have to divide the page size, the remainder of each page is left unused
+template<usize N>
+struct SlabAllocator {
+	constexpr explicit SlabAllocator(const hz::array<usize, N>& sizes) {
+		for (usize i = 0; i < N; ++i) {
+			freelists[i].size = sizes[i];
+		}
+	}
+
+	void* alloc(usize size) {
+		auto old = KfRaiseIrql(DISPATCH_LEVEL);
+
+		for (auto& list : freelists) {
+			if (size <= list.size) {
+				KeAcquireSpinLockAtDpcLevel(&list.lock);
+				if (!list.pages.is_empty()) {
+					auto page = list.pages.front();
+
+					auto node = page->slab.freelist.next;
+					assert(node);
+					assert(page->slab.count != PAGE_SIZE / list.size);
+
+					page->slab.freelist.next = static_cast<Node*>(node)->next;
+					++page->slab.count;
+					if (page->slab.count == PAGE_SIZE / list.size) {
+						list.pages.pop_front();
+					}
+
+					KeReleaseSpinLock(&list.lock, old);
+					return node;
+				}
+				else {
+					auto phys = pmalloc();
+					if (!phys) {
+						KeReleaseSpinLock(&list.lock, old);
+						return nullptr;
+					}
+
+					auto page = Page::from_phys(phys);
+
+					usize count = PAGE_SIZE / list.size;
+
+					Node* root = nullptr;
+					for (usize i = 0; i < count; ++i) {
+						auto node = new (to_virt<void>(phys + i * list.size)) Node {};
+
+						node->next = root;
+						root = node;
+					}
+
+					auto node = root;
+					root = root->next;
+
+					page->slab.freelist.next = root;
+					page->slab.count = 1;
+
+					list.pages.push_front(page);
+
+					KeReleaseSpinLock(&list.lock, old);
+					return node;
+				}
+			}
+		}
+
+		KeLowerIrql(old);
+		return nullptr;
+	}
+
+	void dealloc(void* ptr, usize size) {
+		auto old = KfRaiseIrql(DISPATCH_LEVEL);
+
+		for (auto& list : freelists) {
+			if (size <= list.size) {
+				auto* node = new (ptr) Node {};
+
+				auto phys = to_phys(reinterpret_cast<void*>(ALIGNDOWN(reinterpret_cast<usize>(ptr), PAGE_SIZE)));
+				auto page = Page::from_phys(phys);
+				assert(page);
+
+				KeAcquireSpinLockAtDpcLevel(&list.lock);
+
+				--page->slab.count;
+
+				if (page->slab.count == 0) {
+					list.pages.remove(page);
+					pfree(phys);
+					KeReleaseSpinLock(&list.lock, old);
+					return;
+				}
+				else if (page->slab.count == PAGE_SIZE / list.size - 1) {
+					list.pages.push_front(page);
+				}
+
+				node->next = static_cast<Node*>(page->slab.freelist.next);
+				page->slab.freelist.next = node;
+
+				KeReleaseSpinLock(&list.lock, old);
+				return;
+			}
+		}
+
+		KeLowerIrql(old);
+	}
+
+private:
+	struct Node {
+		Node* next;
+	};
+
+	struct Freelist {
+		hz::list<Page, &Page::hook> pages {};
+		usize size {};
+		KSPIN_LOCK lock {};
+	};
+
+	hz::array<Freelist, N> freelists {};
+};
@@ -0,0 +1,111 @@
+#include "system_pte.hpp"
+#include "vspace.hpp"
+#include "malloc.hpp"
+#include "mem/mem.hpp"
+#include "rtl.hpp"
+#include "assert.hpp"
+#include "sched/process.hpp"
+#include <hz/algorithm.hpp>
+
+namespace {
+	constexpr usize POOL_SIZE = 256 * 1024 * 1024;
+	constexpr usize POOL_PAGES = POOL_SIZE / PAGE_SIZE;
+	// released ranges are kept until either limit is hit
+	constexpr usize MAX_PENDING_RANGES = 64;
+	constexpr usize MAX_PENDING_PAGES = 1024;
+
+	struct PendingRange {
+		u32 index;
+		u32 count;
+	};
+
+	KSPIN_LOCK LOCK {};
+	usize POOL_BASE {};
+	RTL_BITMAP BITMAP {};
+	ULONG HINT {};
+	PendingRange PENDING[MAX_PENDING_RANGES] {};
+	usize PENDING_COUNT {};
+	usize PENDING_PAGES {};
+
+	// one flush on every cpu covers the span of the pending ranges, only after it the ranges
+	// can be handed out again. a large span turns into a full flush
+	void flush_pending() {
+		usize first = POOL_PAGES;
+		usize end = 0;
+		for (usize i = 0; i < PENDING_COUNT; ++i) {
+			auto& range = PENDING[i];
+			first = hz::min(first, usize {range.index});
+			end = hz::max(end, usize {range.index} + range.count);
+		}
+
+		KERNEL_MAP->flush(POOL_BASE + first * PAGE_SIZE, end - first);
+
+		for (usize i = 0; i < PENDING_COUNT; ++i) {
+			auto& range = PENDING[i];
+			RtlClearBits(&BITMAP, range.index, range.count);
+		}
+		PENDING_COUNT = 0;
+		PENDING_PAGES = 0;
+	}
+}
+
+void system_pte_init() {
+	// the tables are preallocated per 2mb so the pool has to cover whole ones
+	auto* ptr = KERNEL_VSPACE.alloc(0, POOL_SIZE + LARGE_PAGE_SIZE);
+	assert(ptr);
+	POOL_BASE = ALIGNUP(reinterpret_cast<usize>(ptr), LARGE_PAGE_SIZE);
+
+	bool success = KERNEL_MAP->preallocate_tables(POOL_BASE, POOL_SIZE);
+	assert(success);
+
+	auto* buffer = static_cast<PULONG>(kcalloc(POOL_PAGES / 8));
+	assert(buffer);
+	RtlInitializeBitMap(&BITMAP, buffer, POOL_PAGES);
+}
+
+void* system_pte_reserve(usize count) {
+	if (!count || count > POOL_PAGES) {
+		return nullptr;
+	}
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&LOCK);
+
+	auto index = RtlFindClearBitsAndSet(&BITMAP, count, HINT);
+	if (index == UINT32_MAX && PENDING_COUNT) {
+		flush_pending();
+		index = RtlFindClearBitsAndSet(&BITMAP, count, HINT);
+	}
+	if (index == UINT32_MAX) {
+		KeReleaseSpinLock(&LOCK, old);
+		return nullptr;
+	}
+	HINT = (index + count) % POOL_PAGES;
+
+	KeReleaseSpinLock(&LOCK, old);
+	return reinterpret_cast<void*>(POOL_BASE + index * PAGE_SIZE);
+}
+
+void system_pte_release(void* base, usize count) {
+	auto addr = reinterpret_cast<usize>(base);
+	assert(addr >= POOL_BASE && addr + count * PAGE_SIZE <= POOL_BASE + POOL_SIZE);
+
+	for (usize i = 0; i < count; ++i) {
+		KERNEL_MAP->unmap(addr + i * PAGE_SIZE, false);
+	}
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&LOCK);
+
+	if (PENDING_COUNT == MAX_PENDING_RANGES) {
+		flush_pending();
+	}
+	PENDING[PENDING_COUNT++] = {
+		.index = static_cast<u32>((addr - POOL_BASE) / PAGE_SIZE),
+		.count = static_cast<u32>(count)
+	};
+	PENDING_PAGES += count;
+	if (PENDING_PAGES >= MAX_PENDING_PAGES) {
+		flush_pending();
+	}
+
+	KeReleaseSpinLock(&LOCK, old);
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include "types.hpp"
+
+// a dedicated kernel address range for short lived mappings of mdls and io space,
+// released ranges are only reused after a batched tlb flush
+
+void system_pte_init();
+
+// returns the base of count free pages or nullptr if the pool is exhausted
+void* system_pte_reserve(usize count);
+// unmaps the pages without flushing them, the range is reused once the next batch is flushed
+void system_pte_release(void* base, usize count);
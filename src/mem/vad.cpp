@@ -0,0 +1,278 @@
+#include "vad.hpp"
+#include "mem/mem.hpp"
+#include <hz/algorithm.hpp>
+
+namespace {
+	i32 height(VadNode* node) {
+		return node ? node->height : 0;
+	}
+
+	usize max_gap(VadNode* node) {
+		return node ? node->max_gap : 0;
+	}
+
+	void update(VadNode* node) {
+		node->height = 1 + hz::max(height(node->left), height(node->right));
+		node->max_gap = hz::max(node->gap, hz::max(max_gap(node->left), max_gap(node->right)));
+	}
+
+	// returns the aligned start of a range of size bytes in [gap_start, gap_end) or 0
+	usize fit(usize gap_start, usize gap_end, usize size, usize align) {
+		usize aligned = ALIGNUP(gap_start, align);
+		if (aligned < gap_start || aligned > gap_end || gap_end - aligned < size) {
+			return 0;
+		}
+		return aligned;
+	}
+}
+
+void VadTree::init(usize new_start, usize new_end) {
+	root = nullptr;
+	start = new_start;
+	end = new_end;
+}
+
+VadNode* VadTree::find(usize addr) const {
+	auto* node = root;
+	while (node) {
+		if (addr < node->base) {
+			node = node->left;
+		}
+		else if (addr - node->base >= node->size) {
+			node = node->right;
+		}
+		else {
+			return node;
+		}
+	}
+
+	return nullptr;
+}
+
+VadNode* VadTree::lower_bound(usize addr) const {
+	VadNode* result = nullptr;
+	auto* node = root;
+	while (node) {
+		if (node->base + node->size > addr) {
+			result = node;
+			node = node->left;
+		}
+		else {
+			node = node->right;
+		}
+	}
+
+	return result;
+}
+
+VadNode* VadTree::first() const {
+	auto* node = root;
+	while (node && node->left) {
+		node = node->left;
+	}
+	return node;
+}
+
+VadNode* VadTree::next(VadNode* node) {
+	if (node->right) {
+		node = node->right;
+		while (node->left) {
+			node = node->left;
+		}
+		return node;
+	}
+
+	while (node->parent && node->parent->right == node) {
+		node = node->parent;
+	}
+	return node->parent;
+}
+
+VadNode* VadTree::prev(VadNode* node) {
+	if (node->left) {
+		node = node->left;
+		while (node->right) {
+			node = node->right;
+		}
+		return node;
+	}
+
+	while (node->parent && node->parent->left == node) {
+		node = node->parent;
+	}
+	return node->parent;
+}
+
+// subtrees without a large enough gap are skipped, the alignment can still make a gap
+// that is large enough unusable so this is only an upper bound
+usize VadTree::find_free(VadNode* node, usize size, usize align) const {
+	if (!node || node->max_gap < size) {
+		return 0;
+	}
+
+	if (auto addr = find_free(node->left, size, align)) {
+		return addr;
+	}
+	if (node->gap >= size) {
+		if (auto addr = fit(node->base - node->gap, node->base, size, align)) {
+			return addr;
+		}
+	}
+	return find_free(node->right, size, align);
+}
+
+usize VadTree::find_free(usize size, usize align) const {
+	if (auto addr = find_free(root, size, align)) {
+		return addr;
+	}
+
+	auto* last = root;
+	while (last && last->right) {
+		last = last->right;
+	}
+	return fit(last ? last->base + last->size : start, end, size, align);
+}
+
+bool VadTree::is_free(usize base, usize size) const {
+	if (base < start || base > end || end - base < size) {
+		return false;
+	}
+
+	auto* node = lower_bound(base);
+	return !node || node->base >= base + size;
+}
+
+void VadTree::insert(VadNode* node) {
+	node->left = nullptr;
+	node->right = nullptr;
+	node->height = 1;
+
+	VadNode* parent = nullptr;
+	auto** link = &root;
+	while (*link) {
+		parent = *link;
+		link = node->base < parent->base ? &parent->left : &parent->right;
+	}
+	*link = node;
+	node->parent = parent;
+
+	auto* prev_node = prev(node);
+	node->gap = node->base - (prev_node ? prev_node->base + prev_node->size : start);
+	auto* next_node = next(node);
+	if (next_node) {
+		next_node->gap = next_node->base - (node->base + node->size);
+	}
+
+	fix_up(node);
+	if (next_node) {
+		fix_up(next_node);
+	}
+}
+
+void VadTree::remove(VadNode* node) {
+	auto* next_node = next(node);
+	if (next_node) {
+		next_node->gap += node->gap + node->size;
+	}
+
+	VadNode* fix;
+	if (node->left && node->right) {
+		// the successor is the leftmost node of the right subtree, it takes the place of node
+		auto* succ = next_node;
+		if (succ->parent != node) {
+			fix = succ->parent;
+			replace_child(succ->parent, succ, succ->right);
+			succ->right = node->right;
+			node->right->parent = succ;
+		}
+		else {
+			fix = succ;
+		}
+
+		replace_child(node->parent, node, succ);
+		succ->left = node->left;
+		node->left->parent = succ;
+		succ->height = node->height;
+	}
+	else {
+		fix = node->parent;
+		replace_child(node->parent, node, node->left ? node->left : node->right);
+	}
+
+	fix_up(fix);
+	if (next_node) {
+		fix_up(next_node);
+	}
+}
+
+void VadTree::replace_child(VadNode* parent, VadNode* old, VadNode* node) {
+	if (!parent) {
+		root = node;
+	}
+	else if (parent->left == old) {
+		parent->left = node;
+	}
+	else {
+		parent->right = node;
+	}
+
+	if (node) {
+		node->parent = parent;
+	}
+}
+
+VadNode* VadTree::rotate_left(VadNode* node) {
+	auto* right = node->right;
+	replace_child(node->parent, node, right);
+	node->right = right->left;
+	if (right->left) {
+		right->left->parent = node;
+	}
+	right->left = node;
+	node->parent = right;
+
+	update(node);
+	update(right);
+	return right;
+}
+
+VadNode* VadTree::rotate_right(VadNode* node) {
+	auto* left = node->left;
+	replace_child(node->parent, node, left);
+	node->left = left->right;
+	if (left->right) {
+		left->right->parent = node;
+	}
+	left->right = node;
+	node->parent = left;
+
+	update(node);
+	update(left);
+	return left;
+}
+
+VadNode* VadTree::rebalance(VadNode* node) {
+	update(node);
+
+	auto balance = height(node->left) - height(node->right);
+	if (balance > 1) {
+		if (height(node->left->left) < height(node->left->right)) {
+			rotate_left(node->left);
+		}
+		return rotate_right(node);
+	}
+	else if (balance < -1) {
+		if (height(node->right->right) < height(node->right->left)) {
+			rotate_right(node->right);
+		}
+		return rotate_left(node);
+	}
+
+	return node;
+}
+
+void VadTree::fix_up(VadNode* node) {
+	while (node) {
+		node = rebalance(node)->parent;
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "types.hpp"
+
+// a virtual address descriptor, the node of a VadTree
+struct VadNode {
+	VadNode* parent {};
+	VadNode* left {};
+	VadNode* right {};
+	usize base {};
+	usize size {};
+	// free space between the end of the previous node (or the start of the tree) and base
+	usize gap {};
+	// the largest gap in the subtree
+	usize max_gap {};
+	i32 height {1};
+};
+
+// address ordered avl tree of non-overlapping ranges, augmented with the free gaps between
+// them so that it can be used both for looking up ranges and for allocating address space
+class VadTree {
+public:
+	void init(usize start, usize end);
+
+	// returns the node containing addr
+	[[nodiscard]] VadNode* find(usize addr) const;
+	// returns the first node that ends after addr
+	[[nodiscard]] VadNode* lower_bound(usize addr) const;
+	[[nodiscard]] VadNode* first() const;
+	static VadNode* next(VadNode* node);
+	static VadNode* prev(VadNode* node);
+
+	// returns the lowest free address that fits size bytes at the given alignment or 0
+	[[nodiscard]] usize find_free(usize size, usize align) const;
+	[[nodiscard]] bool is_free(usize base, usize size) const;
+
+	// the range of the node has to be free
+	void insert(VadNode* node);
+	void remove(VadNode* node);
+
+	[[nodiscard]] bool is_empty() const {
+		return !root;
+	}
+
+private:
+	usize find_free(VadNode* node, usize size, usize align) const;
+	void replace_child(VadNode* parent, VadNode* old, VadNode* node);
+	VadNode* rotate_left(VadNode* node);
+	VadNode* rotate_right(VadNode* node);
+	VadNode* rebalance(VadNode* node);
+	void fix_up(VadNode* node);
+
+	VadNode* root {};
+	usize start {};
+	usize end {};
+};
@@ -0,0 +1,547 @@
+#include "mm.hpp"
+#include "section.hpp"
+#include "sched/process.hpp"
+#include "arch/arch_sched.hpp"
+#include "arch/arch_syscall.hpp"
+#include "sys/misc.hpp"
+#include "sys/user_access.hpp"
+#include "utils/except.hpp"
+
+NTAPI extern "C" OBJECT_TYPE* PsProcessType;
+extern "C" usize MmUserProbeAddress;
+
+bool mm_protection_to_flags(ULONG protection, PageFlags& flags) {
+	switch (protection) {
+		case PAGE_NOACCESS:
+			flags = {};
+			return true;
+		case PAGE_READONLY:
+			flags = PageFlags::Read;
+			return true;
+		case PAGE_READWRITE:
+			flags = PageFlags::Read | PageFlags::Write;
+			return true;
+		case PAGE_EXECUTE:
+		case PAGE_EXECUTE_READ:
+			flags = PageFlags::Read | PageFlags::Execute;
+			return true;
+		case PAGE_EXECUTE_READWRITE:
+			flags = PageFlags::Read | PageFlags::Write | PageFlags::Execute;
+			return true;
+		default:
+			return false;
+	}
+}
+
+ULONG mm_flags_to_protection(PageFlags flags) {
+	if (!(flags & PageFlags::Read)) {
+		return PAGE_NOACCESS;
+	}
+	else if (flags & PageFlags::Execute) {
+		return flags & PageFlags::Write ? PAGE_EXECUTE_READWRITE : PAGE_EXECUTE_READ;
+	}
+	else {
+		return flags & PageFlags::Write ? PAGE_READWRITE : PAGE_READONLY;
+	}
+}
+
+NTSTATUS mm_reference_process(HANDLE handle, KPROCESSOR_MODE mode, Process*& process) {
+	if (handle == NtCurrentProcess()) {
+		process = get_current_thread()->process;
+		ObfReferenceObject(process);
+		return STATUS_SUCCESS;
+	}
+
+	return ObReferenceObjectByHandle(
+		handle,
+		0,
+		PsProcessType,
+		mode,
+		reinterpret_cast<PVOID*>(&process),
+		nullptr);
+}
+
+namespace {
+	NTSTATUS read_range(KPROCESSOR_MODE mode, PVOID* base_address, PSIZE_T region_size, usize& base, usize& size) {
+		if (mode == UserMode) {
+			__try {
+				enable_user_access();
+				ProbeForWrite(base_address, sizeof(PVOID), alignof(PVOID));
+				ProbeForWrite(region_size, sizeof(SIZE_T), alignof(SIZE_T));
+				base = reinterpret_cast<usize>(*base_address);
+				size = *region_size;
+				disable_user_access();
+			}
+			__except (1) {
+				disable_user_access();
+				return GetExceptionCode();
+			}
+		}
+		else {
+			base = reinterpret_cast<usize>(*base_address);
+			size = *region_size;
+		}
+
+		if (base >= MmUserProbeAddress) {
+			return STATUS_INVALID_PARAMETER_2;
+		}
+		else if (size > MmUserProbeAddress - base) {
+			return STATUS_INVALID_PARAMETER;
+		}
+		return STATUS_SUCCESS;
+	}
+
+	NTSTATUS write_range(KPROCESSOR_MODE mode, PVOID* base_address, PSIZE_T region_size, usize base, usize size) {
+		if (mode == UserMode) {
+			__try {
+				enable_user_access();
+				*base_address = reinterpret_cast<PVOID>(base);
+				*region_size = size;
+				disable_user_access();
+			}
+			__except (1) {
+				disable_user_access();
+				return GetExceptionCode();
+			}
+		}
+		else {
+			*base_address = reinterpret_cast<PVOID>(base);
+			*region_size = size;
+		}
+
+		return STATUS_SUCCESS;
+	}
+}
+
+NTAPI extern "C" NTSTATUS NtAllocateVirtualMemory(
+	HANDLE process_handle,
+	PVOID* base_address,
+	ULONG_PTR zero_bits,
+	PSIZE_T region_size,
+	ULONG allocation_type,
+	ULONG page_protection) {
+	auto mode = ExGetPreviousMode();
+
+	usize base;
+	usize size;
+	auto status = read_range(mode, base_address, region_size, base, size);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	// todo zero bits
+	if (zero_bits > 53) {
+		return STATUS_INVALID_PARAMETER_3;
+	}
+	else if (!size) {
+		return STATUS_INVALID_PARAMETER_4;
+	}
+	else if (!(allocation_type & (MEM_COMMIT | MEM_RESERVE)) ||
+		(allocation_type & ~(MEM_COMMIT | MEM_RESERVE))) {
+		return STATUS_INVALID_PARAMETER_5;
+	}
+
+	PageFlags flags;
+	if (!mm_protection_to_flags(page_protection, flags)) {
+		return STATUS_INVALID_PAGE_PROTECTION;
+	}
+
+	Process* process;
+	status = mm_reference_process(process_handle, mode, process);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (allocation_type & MEM_RESERVE) {
+		if (base) {
+			size = ALIGNUP(base + size, PAGE_SIZE) - ALIGNDOWN(base, ALLOCATION_GRANULARITY);
+			base = ALIGNDOWN(base, ALLOCATION_GRANULARITY);
+		}
+		else {
+			size = ALIGNUP(size, PAGE_SIZE);
+		}
+
+		usize requested = base;
+		base = process->allocate(
+			reinterpret_cast<void*>(base),
+			size,
+			flags,
+			MappingFlags::Reserved,
+			nullptr);
+		if (!base) {
+			ObfDereferenceObject(process);
+			return requested ? STATUS_CONFLICTING_ADDRESSES : STATUS_NO_MEMORY;
+		}
+
+		if (allocation_type & MEM_COMMIT) {
+			status = process->commit(base, size, flags);
+			if (!NT_SUCCESS(status)) {
+				usize release_size = 0;
+				process->release(base, release_size);
+				ObfDereferenceObject(process);
+				return status;
+			}
+		}
+	}
+	else {
+		status = process->commit(base, size, flags);
+		if (!NT_SUCCESS(status)) {
+			ObfDereferenceObject(process);
+			return status;
+		}
+	}
+
+	ObfDereferenceObject(process);
+	return write_range(mode, base_address, region_size, base, size);
+}
+
+NTAPI extern "C" NTSTATUS NtFreeVirtualMemory(
+	HANDLE process_handle,
+	PVOID* base_address,
+	PSIZE_T region_size,
+	ULONG free_type) {
+	auto mode = ExGetPreviousMode();
+
+	usize base;
+	usize size;
+	auto status = read_range(mode, base_address, region_size, base, size);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (free_type != MEM_DECOMMIT && free_type != MEM_RELEASE) {
+		return STATUS_INVALID_PARAMETER_4;
+	}
+
+	Process* process;
+	status = mm_reference_process(process_handle, mode, process);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (free_type == MEM_RELEASE) {
+		status = process->release(base, size);
+	}
+	else {
+		status = process->decommit(base, size);
+	}
+	ObfDereferenceObject(process);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	return write_range(mode, base_address, region_size, base, size);
+}
+
+NTAPI extern "C" NTSTATUS NtProtectVirtualMemory(
+	HANDLE process_handle,
+	PVOID* base_address,
+	PSIZE_T region_size,
+	ULONG new_protection,
+	PULONG old_protection) {
+	auto mode = ExGetPreviousMode();
+
+	usize base;
+	usize size;
+	auto status = read_range(mode, base_address, region_size, base, size);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (mode == UserMode) {
+		__try {
+			enable_user_access();
+			ProbeForWrite(old_protection, sizeof(ULONG), alignof(ULONG));
+			disable_user_access();
+		}
+		__except (1) {
+			disable_user_access();
+			return GetExceptionCode();
+		}
+	}
+
+	if (!size) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	PageFlags flags;
+	if (!mm_protection_to_flags(new_protection, flags)) {
+		return STATUS_INVALID_PAGE_PROTECTION;
+	}
+
+	Process* process;
+	status = mm_reference_process(process_handle, mode, process);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	PageFlags old_flags;
+	status = process->protect(base, size, flags, old_flags);
+	ObfDereferenceObject(process);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = write_range(mode, base_address, region_size, base, size);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (mode == UserMode) {
+		__try {
+			enable_user_access();
+			*old_protection = mm_flags_to_protection(old_flags);
+			disable_user_access();
+		}
+		__except (1) {
+			disable_user_access();
+			return GetExceptionCode();
+		}
+	}
+	else {
+		*old_protection = mm_flags_to_protection(old_flags);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTAPI extern "C" NTSTATUS NtMapViewOfSection(
+	HANDLE section_handle,
+	HANDLE process_handle,
+	PVOID* base_address,
+	ULONG_PTR zero_bits,
+	SIZE_T commit_size,
+	PLARGE_INTEGER section_offset,
+	PSIZE_T view_size,
+	SECTION_INHERIT inherit_disposition,
+	ULONG allocation_type,
+	ULONG win32_protect) {
+	auto mode = ExGetPreviousMode();
+
+	usize base;
+	usize size;
+	auto status = read_range(mode, base_address, view_size, base, size);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	LARGE_INTEGER offset {};
+	if (section_offset) {
+		if (mode == UserMode) {
+			__try {
+				enable_user_access();
+				ProbeForRead(section_offset, sizeof(LARGE_INTEGER), alignof(LARGE_INTEGER));
+				offset = *section_offset;
+				disable_user_access();
+			}
+			__except (1) {
+				disable_user_access();
+				return GetExceptionCode();
+			}
+		}
+		else {
+			offset = *section_offset;
+		}
+	}
+
+	// todo zero bits
+	if (zero_bits > 53) {
+		return STATUS_INVALID_PARAMETER_4;
+	}
+	else if (offset.QuadPart < 0 || offset.QuadPart % PAGE_SIZE) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	PageFlags flags;
+	bool copy_on_write = false;
+	if (win32_protect == PAGE_WRITECOPY) {
+		flags = PageFlags::Read | PageFlags::Write;
+		copy_on_write = true;
+	}
+	else if (win32_protect == PAGE_EXECUTE_WRITECOPY) {
+		flags = PageFlags::Read | PageFlags::Write | PageFlags::Execute;
+		copy_on_write = true;
+	}
+	else if (!mm_protection_to_flags(win32_protect, flags)) {
+		return STATUS_INVALID_PAGE_PROTECTION;
+	}
+
+	Section* section;
+	status = ObReferenceObjectByHandle(
+		section_handle,
+		0,
+		MmSectionObjectType,
+		mode,
+		reinterpret_cast<PVOID*>(&section),
+		nullptr);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	usize start = offset.QuadPart;
+	if (start >= section->size || size > section->size - start) {
+		ObfDereferenceObject(section);
+		return STATUS_INVALID_VIEW_SIZE;
+	}
+	else if (!size) {
+		size = section->size - start;
+	}
+
+	if (!copy_on_write && (flags & PageFlags::Write) && !(section->flags & PageFlags::Write)) {
+		ObfDereferenceObject(section);
+		return STATUS_SECTION_PROTECTION;
+	}
+
+	Process* process;
+	status = mm_reference_process(process_handle, mode, process);
+	if (!NT_SUCCESS(status)) {
+		ObfDereferenceObject(section);
+		return status;
+	}
+
+	usize requested = base;
+	base = process->map_view(section, start, reinterpret_cast<void*>(base), size, flags, copy_on_write);
+	ObfDereferenceObject(process);
+	if (!base) {
+		ObfDereferenceObject(section);
+		return requested ? STATUS_CONFLICTING_ADDRESSES : STATUS_NO_MEMORY;
+	}
+
+	return write_range(mode, base_address, view_size, base, ALIGNUP(size, PAGE_SIZE));
+}
+
+NTAPI extern "C" NTSTATUS NtUnmapViewOfSection(HANDLE process_handle, PVOID base_address) {
+	Process* process;
+	auto status = mm_reference_process(process_handle, ExGetPreviousMode(), process);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = process->unmap_view(reinterpret_cast<usize>(base_address));
+	ObfDereferenceObject(process);
+	return status;
+}
+
+namespace {
+	ULONG mapping_protection(Process::Mapping* mapping, PageFlags flags) {
+		if ((mapping->mapping_flags & MappingFlags::CopyOnWrite) && (flags & PageFlags::Write)) {
+			return flags & PageFlags::Execute ? PAGE_EXECUTE_WRITECOPY : PAGE_WRITECOPY;
+		}
+		return mm_flags_to_protection(flags);
+	}
+
+	// describes the region starting at addr that has the same state and protection
+	void query_region(Process* process, usize addr, MEMORY_BASIC_INFORMATION& info) {
+		auto old = KeAcquireSpinLockRaiseToDpc(&process->mapping_lock);
+
+		auto* mapping = static_cast<Process::Mapping*>(process->mappings.lower_bound(addr));
+		if (!mapping || addr < mapping->base) {
+			usize end = mapping ? mapping->base : MmUserProbeAddress;
+			info = {
+				.BaseAddress = reinterpret_cast<PVOID>(addr),
+				.AllocationBase = nullptr,
+				.AllocationProtect = 0,
+				.PartitionId = 0,
+				.RegionSize = end - addr,
+				.State = MEM_FREE,
+				.Protect = PAGE_NOACCESS,
+				.Type = 0
+			};
+			KeReleaseSpinLock(&process->mapping_lock, old);
+			return;
+		}
+
+		info = {
+			.BaseAddress = reinterpret_cast<PVOID>(addr),
+			.AllocationBase = reinterpret_cast<PVOID>(mapping->base),
+			.AllocationProtect = mapping_protection(mapping, mapping->flags),
+			.PartitionId = 0,
+			.RegionSize = mapping->base + mapping->size - addr,
+			.State = MEM_COMMIT,
+			.Protect = mapping_protection(mapping, mapping->flags),
+			.Type = (mapping->mapping_flags & MappingFlags::View) ? MEM_MAPPED : MEM_PRIVATE
+		};
+
+		// reserved mappings and partially reprotected ones have the protection of every page
+		if (mapping->page_state) {
+			usize index = (addr - mapping->base) / PAGE_SIZE;
+			usize count = mapping->size / PAGE_SIZE;
+			auto state = mapping->page_state[index];
+
+			usize end = index + 1;
+			while (end < count && mapping->page_state[end] == state) {
+				++end;
+			}
+
+			info.RegionSize = (end - index) * PAGE_SIZE;
+			if (state & PAGE_STATE_COMMITTED) {
+				info.Protect = mapping_protection(mapping, static_cast<PageFlags>(state & ~(PAGE_STATE_COMMITTED | PAGE_STATE_GUARD)));
+				if (state & PAGE_STATE_GUARD) {
+					info.Protect |= PAGE_GUARD;
+				}
+			}
+			else {
+				info.State = MEM_RESERVE;
+				info.Protect = 0;
+			}
+		}
+
+		KeReleaseSpinLock(&process->mapping_lock, old);
+	}
+}
+
+NTAPI extern "C" NTSTATUS NtQueryVirtualMemory(
+	HANDLE process_handle,
+	PVOID base_address,
+	MEMORY_INFORMATION_CLASS memory_info_class,
+	PVOID memory_info,
+	SIZE_T memory_info_length,
+	PSIZE_T return_length) {
+	auto mode = ExGetPreviousMode();
+
+	usize addr = ALIGNDOWN(reinterpret_cast<usize>(base_address), PAGE_SIZE);
+	if (addr >= MmUserProbeAddress) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	else if (memory_info_class != MemoryBasicInformation) {
+		return STATUS_INVALID_INFO_CLASS;
+	}
+	else if (memory_info_length < sizeof(MEMORY_BASIC_INFORMATION)) {
+		return STATUS_INFO_LENGTH_MISMATCH;
+	}
+
+	Process* process;
+	auto status = mm_reference_process(process_handle, mode, process);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	MEMORY_BASIC_INFORMATION info;
+	query_region(process, addr, info);
+	ObfDereferenceObject(process);
+
+	if (mode == UserMode) {
+		__try {
+			enable_user_access();
+			ProbeForWrite(memory_info, sizeof(MEMORY_BASIC_INFORMATION), alignof(MEMORY_BASIC_INFORMATION));
+			*static_cast<MEMORY_BASIC_INFORMATION*>(memory_info) = info;
+			if (return_length) {
+				ProbeForWrite(return_length, sizeof(SIZE_T), alignof(SIZE_T));
+				*return_length = sizeof(MEMORY_BASIC_INFORMATION);
+			}
+			disable_user_access();
+		}
+		__except (1) {
+			disable_user_access();
+			return GetExceptionCode();
+		}
+	}
+	else {
+		*static_cast<MEMORY_BASIC_INFORMATION*>(memory_info) = info;
+		if (return_length) {
+			*return_length = sizeof(MEMORY_BASIC_INFORMATION);
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
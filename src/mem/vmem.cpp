@@ -140,7 +140,7 @@ void VMem::seg_free(VMem::Segment* seg) {
 	free_segs = seg;
 }
 
-usize VMem::xalloc(usize size, usize min, usize max) {
+usize VMem::xalloc(usize size, usize min, usize max, usize align) {
 	size = ALIGNUP(size, _quantum);
 
 	if (!max) {
@@ -161,6 +161,9 @@ usize VMem::xalloc(usize size, usize min, usize max) {
 
 	auto seg_fit = [&](Segment* seg, hz::list<Segment, &Segment::list_hook>& list, bool popped) {
 		usize start = hz::max(seg->base, min);
+		if (align) {
+			start = ALIGNUP(start, align);
+		}
 		usize end = hz::min(seg->base + seg->size, max);
 		if (start > end || end - start < size) {
 			if (popped) {
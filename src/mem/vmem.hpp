@@ -7,7 +7,7 @@ class VMem {
 public:
 	void init(usize base, usize size, usize quantum);
 	void destroy(bool assert_allocations);
-	usize xalloc(usize size, usize min, usize max);
+	usize xalloc(usize size, usize min, usize max, usize align = 0);
 	void xfree(usize ptr, usize size);
 private:
 	static constexpr unsigned int size_to_index(usize size);
@@ -54,12 +54,14 @@ void* VirtualSpace::alloc_backed(usize hint, usize size, PageFlags flags, CacheM
 		if (phys) {
 			pfree(phys);
 		}
+		hz::list<Page, &Page::hook> frames {};
 		for (usize j = 0; j < i; ++j) {
 			virt = reinterpret_cast<u64>(vm) + j * PAGE_SIZE;
-			auto p = KERNEL_MAP->get_phys(virt);
-			KERNEL_MAP->unmap(virt);
-			pfree(p);
+			frames.push(Page::from_phys(KERNEL_MAP->get_phys(virt)));
+			KERNEL_MAP->unmap(virt, false);
 		}
+		KERNEL_MAP->flush(reinterpret_cast<u64>(vm), i);
+		pfree_list(frames);
 
 		free(vm, size);
 		return nullptr;
@@ -71,12 +73,15 @@ void* VirtualSpace::alloc_backed(usize hint, usize size, PageFlags flags, CacheM
 void VirtualSpace::free_backed(void* ptr, usize size) {
 	auto aligned = ALIGNUP(size, PAGE_SIZE);
 
+	// the frames are freed after a single flush of the whole range
+	hz::list<Page, &Page::hook> frames {};
 	for (usize i = 0; i < aligned; i += PAGE_SIZE) {
 		auto virt = reinterpret_cast<u64>(ptr) + i;
-		auto phys = KERNEL_MAP->get_phys(virt);
-		KERNEL_MAP->unmap(virt);
-		pfree(phys);
+		frames.push(Page::from_phys(KERNEL_MAP->get_phys(virt)));
+		KERNEL_MAP->unmap(virt, false);
 	}
+	KERNEL_MAP->flush(reinterpret_cast<u64>(ptr), aligned / PAGE_SIZE);
+	pfree_list(frames);
 
 	free(ptr, size);
 }
@@ -0,0 +1,390 @@
+#include "self_test.hpp"
+#include "stdio.hpp"
+#include "assert.hpp"
+#include "atomic.hpp"
+#include "arch/cpu.hpp"
+#include "dev/clock.hpp"
+#include "mem/mem.hpp"
+#include "mem/pmalloc.hpp"
+#include "mem/section.hpp"
+#include "mem/kernel_stack.hpp"
+#include "sched/process.hpp"
+#include "sched/ps.hpp"
+#include "sched/thread.hpp"
+#include "sched/event.hpp"
+#include "sched/wait.hpp"
+#include <hz/algorithm.hpp>
+#include <hz/array.hpp>
+
+namespace {
+	void sleep_ns(u64 ns) {
+		LARGE_INTEGER interval {.QuadPart = -static_cast<i64>(ns / 100)};
+		KeDelayExecutionThread(KernelMode, false, &interval);
+	}
+
+	void commit_range(Process* process, usize base, usize size) {
+		for (usize offset = 0; offset < size; offset += PAGE_SIZE) {
+			if (!process->commit_page(base + offset)) {
+				panic("[kernel][test]: failed to commit page ", Fmt::Hex, base + offset, Fmt::Reset);
+			}
+		}
+	}
+
+	// pinned so that balancing can't move the thread off the cpu under test
+	void spawn_pinned(kstd::wstring_view name, Cpu* cpu, void (*fn)(void*), void* arg) {
+		auto* thread = create_thread(name, cpu, &*KERNEL_PROCESS, false, fn, arg);
+		assert(thread);
+		thread->affinity = 1ULL << cpu->number;
+		cpu->scheduler.queue(cpu, thread);
+	}
+
+	// CPUS has holes for cpus that didn't start
+	usize online_cpus() {
+		usize online = 0;
+		for (auto* cpu : CPUS) {
+			online += cpu != nullptr;
+		}
+		return online;
+	}
+
+	Cpu* nth_online_cpu(usize n) {
+		n %= online_cpus();
+		for (auto* cpu : CPUS) {
+			if (cpu && !n--) {
+				return cpu;
+			}
+		}
+		__builtin_unreachable();
+	}
+
+	void wait_for_threads(KEVENT* done, u64 timeout_ns, const char* test) {
+		i64 timeout = -static_cast<i64>(timeout_ns / 100);
+		auto status = KeWaitForSingleObject(done, Executive, KernelMode, false, &timeout);
+		if (status == STATUS_TIMEOUT) {
+			panic("[kernel][test]: ", test, " didn't finish in time");
+		}
+	}
+
+	constexpr usize TEARDOWN_ROUNDS = 16;
+	// frames that may legitimately stay allocated after the teardown, e.g. in slab caches
+	constexpr usize TEARDOWN_SLACK = 64;
+	constexpr u64 TEARDOWN_TIMEOUT_NS = NS_IN_S * 5;
+
+	// the reaper runs on its own thread so the frames come back some time after the process was queued
+	void wait_for_teardown(usize before, usize slack, const char* test) {
+		auto start = CLOCK_SOURCE->get_ns();
+		while (pmalloc_free_pages() + slack < before) {
+			if (CLOCK_SOURCE->get_ns() - start > TEARDOWN_TIMEOUT_NS) {
+				panic("[kernel][test]: ", test, " leaked ", before - pmalloc_free_pages(), " pages");
+			}
+			sleep_ns(NS_IN_MS * 10);
+		}
+	}
+
+	// builds address spaces with every kind of mapping and lets the reaper tear them down,
+	// all of their frames have to be back in the allocator afterwards
+	void test_reaper_teardown() {
+		auto rw = PageFlags::Read | PageFlags::Write;
+		usize before = pmalloc_free_pages();
+
+		for (usize round = 0; round < TEARDOWN_ROUNDS; ++round) {
+			auto* process = create_process(u"reaper test");
+			assert(process);
+
+			// big enough to use 2mb frames if there are any
+			auto backed = process->allocate(nullptr, 4 * LARGE_PAGE_SIZE, rw, MappingFlags::Backed, nullptr);
+			assert(backed);
+
+			auto demand_zero = process->allocate(nullptr, 64 * PAGE_SIZE, rw, MappingFlags::DemandZero, nullptr);
+			assert(demand_zero);
+			commit_range(process, demand_zero, 64 * PAGE_SIZE);
+
+			auto reserved = process->allocate(nullptr, 64 * PAGE_SIZE, rw, MappingFlags::Reserved, nullptr);
+			assert(reserved);
+			usize commit_base = reserved + 16 * PAGE_SIZE;
+			usize commit_size = 32 * PAGE_SIZE;
+			auto status = process->commit(commit_base, commit_size, rw);
+			assert(NT_SUCCESS(status));
+			commit_range(process, commit_base, commit_size);
+
+			// every other page of the view gets a private copy
+			auto* section = section_create(32 * PAGE_SIZE, rw);
+			assert(section);
+			auto view = process->map_view(section, 0, nullptr, 32 * PAGE_SIZE, rw, true);
+			assert(view);
+			commit_range(process, view, 32 * PAGE_SIZE);
+			for (usize offset = 0; offset < 32 * PAGE_SIZE; offset += 2 * PAGE_SIZE) {
+				if (!process->copy_on_write(view + offset)) {
+					panic("[kernel][test]: failed to copy page ", Fmt::Hex, view + offset, Fmt::Reset);
+				}
+			}
+
+			ps_reap_process(process);
+		}
+
+		wait_for_teardown(before, TEARDOWN_SLACK, "reaper teardown");
+		println("[kernel][test]: reaper teardown passed");
+	}
+
+	constexpr usize COMPRESS_PAGES = 256;
+	// the first scan only clears the accessed bits, a page may also be skipped once when the scan
+	// runs out of budget before wrapping around
+	constexpr usize COMPRESS_PASSES = 8;
+
+	// compressible but different for every page
+	u8 pattern_byte(usize page, usize offset) {
+		return static_cast<u8>((offset / 64) ^ (page * 7));
+	}
+
+	u8* page_data(Process* process, usize addr) {
+		auto phys = process->page_map.get_phys(addr);
+		if (!phys) {
+			panic("[kernel][test]: page ", Fmt::Hex, addr, Fmt::Reset, " isn't present");
+		}
+		return to_virt<u8>(phys);
+	}
+
+	void compress_all(Process* process, usize base) {
+		usize compressed = 0;
+		for (usize pass = 0; pass < COMPRESS_PASSES && compressed < COMPRESS_PAGES; ++pass) {
+			compressed += process->compress_cold_pages(COMPRESS_PAGES - compressed);
+		}
+
+		for (usize i = 0; i < COMPRESS_PAGES; ++i) {
+			if (!process->page_map.get_marker(base + i * PAGE_SIZE)) {
+				panic("[kernel][test]: page ", i, " wasn't compressed (", compressed, " pages were)");
+			}
+		}
+	}
+
+	// the pages are accessed through the direct map as the process is never made active.
+	// the page trimmer could compress them concurrently but it only runs under memory pressure
+	void test_compression_round_trip() {
+		auto rw = PageFlags::Read | PageFlags::Write;
+		usize before = pmalloc_free_pages();
+
+		auto* process = create_process(u"compression test");
+		assert(process);
+		auto base = process->allocate(nullptr, COMPRESS_PAGES * PAGE_SIZE, rw, MappingFlags::DemandZero, nullptr);
+		assert(base);
+
+		commit_range(process, base, COMPRESS_PAGES * PAGE_SIZE);
+		for (usize i = 0; i < COMPRESS_PAGES; ++i) {
+			auto* data = page_data(process, base + i * PAGE_SIZE);
+			for (usize j = 0; j < PAGE_SIZE; ++j) {
+				data[j] = pattern_byte(i, j);
+			}
+		}
+
+		compress_all(process, base);
+
+		// faulting the pages back in has to restore the exact contents
+		commit_range(process, base, COMPRESS_PAGES * PAGE_SIZE);
+		for (usize i = 0; i < COMPRESS_PAGES; ++i) {
+			auto* data = page_data(process, base + i * PAGE_SIZE);
+			for (usize j = 0; j < PAGE_SIZE; ++j) {
+				if (data[j] != pattern_byte(i, j)) {
+					panic("[kernel][test]: page ", i, " differs at offset ", j, " after decompression");
+				}
+			}
+		}
+
+		// the teardown has to free the compressed copies too
+		compress_all(process, base);
+		ps_reap_process(process);
+		wait_for_teardown(before, TEARDOWN_SLACK, "compression round-trip");
+
+		println("[kernel][test]: compression round-trip passed");
+	}
+
+	// from below a slot of the first level to entries that have to cascade down from the third one
+	constexpr hz::array<u64, 7> SLEEP_DURATIONS_NS {
+		NS_IN_US * 30, NS_IN_US * 200, NS_IN_MS * 3, NS_IN_MS * 9, NS_IN_MS * 40, NS_IN_MS * 270, NS_IN_MS * 600
+	};
+	constexpr usize SLEEP_THREADS = 8;
+	constexpr usize SLEEP_ROUNDS = 2;
+	constexpr u64 SLEEP_TIMEOUT_NS = NS_IN_S * 10;
+
+	struct Sleeper {
+		usize index;
+		u64 max_late_ns;
+	};
+
+	Sleeper SLEEPERS[SLEEP_THREADS] {};
+	hz::atomic<usize> SLEEPERS_RUNNING {};
+	KEVENT SLEEPERS_DONE {};
+
+	void sleeper_fn(void* arg) {
+		auto* sleeper = static_cast<Sleeper*>(arg);
+
+		// every thread uses the durations in a different order so that the wheels hold a mix of them
+		for (usize i = 0; i < SLEEP_ROUNDS * SLEEP_DURATIONS_NS.size(); ++i) {
+			auto duration = SLEEP_DURATIONS_NS[(i + sleeper->index) % SLEEP_DURATIONS_NS.size()];
+			auto start = CLOCK_SOURCE->get_ns();
+			sleep_ns(duration);
+			auto elapsed = CLOCK_SOURCE->get_ns() - start;
+
+			if (elapsed < duration) {
+				panic("[kernel][test]: sleep of ", duration, "ns returned after ", elapsed, "ns");
+			}
+			sleeper->max_late_ns = hz::max(sleeper->max_late_ns, elapsed - duration);
+		}
+
+		if (SLEEPERS_RUNNING.fetch_sub(1, hz::memory_order::acq_rel) == 1) {
+			KeSetEvent(&SLEEPERS_DONE, 0, false);
+		}
+		PsTerminateSystemThread(STATUS_SUCCESS);
+	}
+
+	// a timer that is lost never wakes its thread, one that fires early shows up as a short sleep
+	void test_timer_wheel_expiry() {
+		KeInitializeEvent(&SLEEPERS_DONE, EVENT_TYPE::Notification, false);
+		SLEEPERS_RUNNING.store(SLEEP_THREADS, hz::memory_order::relaxed);
+
+		for (usize i = 0; i < SLEEP_THREADS; ++i) {
+			SLEEPERS[i] = {.index = i, .max_late_ns = 0};
+			spawn_pinned(u"timer test", nth_online_cpu(i), sleeper_fn, &SLEEPERS[i]);
+		}
+
+		wait_for_threads(&SLEEPERS_DONE, SLEEP_TIMEOUT_NS, "timer wheel expiry");
+
+		u64 max_late = 0;
+		for (auto& sleeper : SLEEPERS) {
+			max_late = hz::max(max_late, sleeper.max_late_ns);
+		}
+		println("[kernel][test]: timer wheel expiry passed, max lateness ", max_late / NS_IN_US, "us");
+	}
+
+	constexpr usize PING_PAIRS = 4;
+	constexpr usize PING_ROUNDS = 10000;
+	// every so often the reply is delayed for long enough that the waiting cpu stops its tick
+	constexpr usize PING_DELAY_INTERVAL = 256;
+	constexpr u64 PING_WAIT_TIMEOUT_NS = NS_IN_S;
+	constexpr u64 PING_TIMEOUT_NS = NS_IN_S * 30;
+
+	struct PingPair {
+		KEVENT ping;
+		KEVENT pong;
+	};
+
+	PingPair PING_PAIR_STATE[PING_PAIRS] {};
+	hz::atomic<usize> PINGERS_RUNNING {};
+	KEVENT PINGERS_DONE {};
+
+	// the events are always set from the other thread of the pair, a lost wakeup is a timeout
+	void wait_for_ping(KEVENT* event, usize round) {
+		i64 timeout = -static_cast<i64>(PING_WAIT_TIMEOUT_NS / 100);
+		auto status = KeWaitForSingleObject(event, Executive, KernelMode, false, &timeout);
+		if (status == STATUS_TIMEOUT) {
+			panic("[kernel][test]: lost wakeup in ping-pong round ", round);
+		}
+	}
+
+	void finish_pinger() {
+		if (PINGERS_RUNNING.fetch_sub(1, hz::memory_order::acq_rel) == 1) {
+			KeSetEvent(&PINGERS_DONE, 0, false);
+		}
+		PsTerminateSystemThread(STATUS_SUCCESS);
+	}
+
+	void ping_fn(void* arg) {
+		auto* pair = static_cast<PingPair*>(arg);
+		for (usize round = 0; round < PING_ROUNDS; ++round) {
+			KeSetEvent(&pair->ping, 0, false);
+			wait_for_ping(&pair->pong, round);
+		}
+		finish_pinger();
+	}
+
+	void pong_fn(void* arg) {
+		auto* pair = static_cast<PingPair*>(arg);
+		for (usize round = 0; round < PING_ROUNDS; ++round) {
+			wait_for_ping(&pair->ping, round);
+			if (round % PING_DELAY_INTERVAL == PING_DELAY_INTERVAL - 1) {
+				sleep_ns(NS_IN_MS);
+			}
+			KeSetEvent(&pair->pong, 0, false);
+		}
+		finish_pinger();
+	}
+
+	// the threads of a pair are on different cpus when there is more than one,
+	// so every wake goes through the remote wake list
+	void test_wake_ping_pong() {
+		KeInitializeEvent(&PINGERS_DONE, EVENT_TYPE::Notification, false);
+		PINGERS_RUNNING.store(PING_PAIRS * 2, hz::memory_order::relaxed);
+
+		for (usize i = 0; i < PING_PAIRS; ++i) {
+			auto& pair = PING_PAIR_STATE[i];
+			KeInitializeEvent(&pair.ping, EVENT_TYPE::Synchronization, false);
+			KeInitializeEvent(&pair.pong, EVENT_TYPE::Synchronization, false);
+			spawn_pinned(u"ping test", nth_online_cpu(2 * i), ping_fn, &pair);
+			spawn_pinned(u"pong test", nth_online_cpu(2 * i + 1), pong_fn, &pair);
+		}
+
+		auto start = CLOCK_SOURCE->get_ns();
+		wait_for_threads(&PINGERS_DONE, PING_TIMEOUT_NS, "wake ping-pong");
+		auto elapsed = CLOCK_SOURCE->get_ns() - start;
+
+		println(
+			"[kernel][test]: wake ping-pong passed, ",
+			PING_PAIRS * PING_ROUNDS * 2,
+			" wakes in ",
+			elapsed / NS_IN_MS,
+			"ms");
+	}
+
+	constexpr usize CHURN_ROUNDS = 16;
+	constexpr usize CHURN_THREADS = 64;
+	constexpr u64 CHURN_TIMEOUT_NS = NS_IN_S * 10;
+
+	hz::atomic<usize> CHURNERS_RUNNING {};
+	KEVENT CHURNERS_DONE {};
+
+	void churn_fn(void*) {
+		// cached stacks are reused without being remapped, so every page of half the stack is written
+		volatile u8 buffer[KERNEL_STACK_SIZE / 2];
+		for (usize i = 0; i < sizeof(buffer); i += PAGE_SIZE) {
+			buffer[i] = static_cast<u8>(i);
+		}
+
+		if (CHURNERS_RUNNING.fetch_sub(1, hz::memory_order::acq_rel) == 1) {
+			KeSetEvent(&CHURNERS_DONE, 0, false);
+		}
+		PsTerminateSystemThread(STATUS_SUCCESS);
+	}
+
+	// creates and exits threads in bursts that are placed by load, which goes through
+	// the per-cpu stack caches and keeps balancing busy
+	void test_thread_churn() {
+		usize before = pmalloc_free_pages();
+
+		for (usize round = 0; round < CHURN_ROUNDS; ++round) {
+			KeInitializeEvent(&CHURNERS_DONE, EVENT_TYPE::Notification, false);
+			CHURNERS_RUNNING.store(CHURN_THREADS, hz::memory_order::relaxed);
+
+			for (usize i = 0; i < CHURN_THREADS; ++i) {
+				auto* cpu = Scheduler::select_cpu(UINTPTR_MAX);
+				auto* thread = create_thread(u"churn test", cpu, &*KERNEL_PROCESS, false, churn_fn, nullptr);
+				assert(thread);
+				cpu->scheduler.queue(cpu, thread);
+			}
+
+			wait_for_threads(&CHURNERS_DONE, CHURN_TIMEOUT_NS, "thread churn");
+		}
+
+		// the stack caches stay filled
+		usize cached = online_cpus() * KernelStackCache::MAX_STACKS * (KERNEL_STACK_SIZE / PAGE_SIZE);
+		wait_for_teardown(before, cached + TEARDOWN_SLACK, "thread churn");
+
+		println("[kernel][test]: thread churn passed");
+	}
+}
+
+void run_self_tests() {
+	test_reaper_teardown();
+	test_compression_round_trip();
+	test_timer_wheel_expiry();
+	test_wake_ping_pong();
+	test_thread_churn();
+}
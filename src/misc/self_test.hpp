@@ -0,0 +1,4 @@
+#pragma once
+
+// stress tests of the memory manager and the scheduler, a failure is a panic
+void run_self_tests();
@@ -66,7 +66,7 @@ NTAPI BOOLEAN KeInsertQueueApc(
 				thread->wait_mode == UserMode &&
 				(thread->alertable || thread->apc_state.user_apc_pending)) {
 				thread->wait_status = STATUS_USER_APC;
-				if (thread->cpu->scheduler.unblock(thread)) {
+				if (thread->cpu->scheduler.unblock(thread, increment)) {
 					thread->apc_state.user_apc_pending = true;
 				}
 			}
@@ -38,10 +38,10 @@ LONG KeSetEvent(KEVENT* event, KPRIORITY increment, BOOLEAN wait) {
 	acquire_dispatch_header_lock(&event->header);
 
 	if (event->header.type == static_cast<u8>(EVENT_TYPE::Synchronization)) {
-		dispatch_header_queue_one_waiter(&event->header);
+		dispatch_header_queue_one_waiter(&event->header, increment);
 	}
 	else {
-		dispatch_header_queue_all_waiters(&event->header);
+		dispatch_header_queue_all_waiters(&event->header, increment);
 	}
 
 	release_dispatch_header_lock(&event->header);
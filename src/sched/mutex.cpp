@@ -47,7 +47,7 @@ NTAPI LONG KeReleaseMutex(KMUTANT* mutex, BOOLEAN wait) {
 
 		mutex->owner_thread = nullptr;
 		enable_apc = mutex->apc_disable;
-		dispatch_header_queue_one_waiter(&mutex->header);
+		dispatch_header_queue_one_waiter(&mutex->header, 0);
 
 		release_dispatch_header_lock(&mutex->header);
 
@@ -1,7 +1,31 @@
 #include "process.hpp"
 #include "mem/vspace.hpp"
 #include "assert.hpp"
+#include "cstring.hpp"
+#include "mem/malloc.hpp"
+#include "mem/section.hpp"
 #include "priv/peb.h"
+#include <hz/algorithm.hpp>
+
+namespace {
+	constexpr usize PHYS_BATCH_SIZE = 64;
+	// how many pages a scan for cold pages looks at for each page it is asked to compress
+	constexpr usize COLD_SCAN_FACTOR = 4;
+	// cold pages are taken in batches so that one tlb flush covers several of them
+	constexpr usize COLD_BATCH_SIZE = 16;
+
+	void add_counter(usize& value, usize& peak, usize amount) {
+		value += amount;
+		peak = hz::max(peak, value);
+	}
+
+	void align_range(usize& base, usize& size) {
+		if (size) {
+			size = ALIGNUP(base + size, PAGE_SIZE) - ALIGNDOWN(base, PAGE_SIZE);
+		}
+		base = ALIGNDOWN(base, PAGE_SIZE);
+	}
+}
 
 struct ProcessPeb {
 	PEB peb;
@@ -12,8 +36,7 @@ struct ProcessPeb {
 Process::Process(kstd::wstring_view name)
 	// NOLINTNEXTLINE
 	: name {name}, page_map {&*KERNEL_MAP}, user {true} {
-	usize start = 0x200000;
-	vmem.init(start, 0x7FFFFFFFE000 - start, PAGE_SIZE);
+	mappings.init(0x200000, 0x7FFFFFFFE000);
 
 	UniqueKernelMapping tmp_peb_mapping;
 	peb = reinterpret_cast<PEB*>(allocate(
@@ -26,6 +49,10 @@ Process::Process(kstd::wstring_view name)
 	auto* tmp_peb = new (tmp_peb_mapping.data()) ProcessPeb {};
 	tmp_peb->peb.ProcessParameters = offset(peb, PRTL_USER_PROCESS_PARAMETERS, offsetof(ProcessPeb, params));
 	tmp_peb->peb.Ldr = offset(peb, PPEB_LDR_DATA, offsetof(ProcessPeb, ldr_data));
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&PROCESS_LIST_LOCK);
+	PROCESS_LIST.push(this);
+	KeReleaseSpinLock(&PROCESS_LIST_LOCK, old);
 }
 
 Process::Process(const PageMap& map)
@@ -52,8 +79,16 @@ void Process::add_thread(Thread* thread) {
 void Process::remove_thread(Thread* thread) {
 	auto old = KeAcquireSpinLockRaiseToDpc(&threads_lock);
 	threads.remove(thread);
+	bool last = threads.is_empty();
 	KeReleaseSpinLock(&threads_lock, old);
-	ObfDereferenceObject(this);
+
+	// the address space goes away with the last thread, the reaper takes over the thread's reference
+	if (last && user) {
+		ps_reap_process(this);
+	}
+	else {
+		ObfDereferenceObject(this);
+	}
 }
 
 Process::~Process() {
@@ -61,47 +96,144 @@ Process::~Process() {
 	// but it doesn't really matter as the object is going to be freed by the previous call anyway
 	SCHED_HANDLE_TABLE.remove(handle);
 
+	if (user) {
+		auto old = KeAcquireSpinLockRaiseToDpc(&PROCESS_LIST_LOCK);
+		PROCESS_LIST.remove(this);
+		KeReleaseSpinLock(&PROCESS_LIST_LOCK, old);
+	}
+
+	// usually already done by the reaper, this only has to clean up after processes that never ran
+	delete_address_space();
+}
+
+void Process::delete_address_space() {
+	struct State {
+		Process* process;
+		Mapping* mapping;
+		usize count;
+		usize batch[PHYS_BATCH_SIZE];
+	} state {this, nullptr, 0, {}};
+
 	auto old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
 
-	Mapping* next;
-	for (Mapping* mapping = mappings.get_first(); mapping; mapping = next) {
-		next = static_cast<Mapping*>(mapping->hook.successor);
+	// a scan for cold pages drops the lock while it compresses the pages it took from the tables
+	while (trimming) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		__builtin_ia32_pause();
+		old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+	}
 
-		auto base = mapping->base;
-		for (usize i = 0; i < mapping->size; i += PAGE_SIZE) {
-			auto phys = page_map.get_phys(base + i);
-			assert(phys);
-			pfree(phys);
-		}
+	// the page tables are walked once in address order alongside the mappings
+	// that own the frames, instead of translating every page separately
+	state.mapping = static_cast<Mapping*>(mappings.first());
+	if (user) {
+		page_map.unmap_user_half([](void* arg, u64 virt, const u64* phys, usize count) {
+			auto& state = *static_cast<State*>(arg);
+			for (usize i = 0; i < count; ++i, virt += PAGE_SIZE) {
+				if (!phys[i]) {
+					continue;
+				}
 
-		vmem.xfree(base, mapping->size);
+				while (state.mapping && state.mapping->base + state.mapping->size <= virt) {
+					state.mapping = static_cast<Mapping*>(VadTree::next(state.mapping));
+				}
+				auto* mapping = state.mapping;
+				if (!mapping || virt < mapping->base) {
+					continue;
+				}
+
+				if (mapping->mapping_flags & MappingFlags::View) {
+					if (state.process->is_shared_page(mapping, virt, phys[i])) {
+						continue;
+					}
+				}
+				else if (!(mapping->mapping_flags & (MappingFlags::Backed | MappingFlags::DemandZero | MappingFlags::Reserved))) {
+					continue;
+				}
+
+				state.batch[state.count++] = phys[i];
+				if (state.count == PHYS_BATCH_SIZE) {
+					pfree_batch(state.batch, state.count);
+					state.count = 0;
+				}
+			}
+		}, &state);
+		pfree_batch(state.batch, state.count);
+	}
+
+	while (auto* page = compressed_pages.pop()) {
+		compressed_store_free(page);
+	}
+
+	while (auto* mapping = static_cast<Mapping*>(mappings.first())) {
+		if (mapping->page_state) {
+			kfree(mapping->page_state, mapping->size / PAGE_SIZE);
+		}
+		if (mapping->section) {
+			ObfDereferenceObject(mapping->section);
+		}
+		unlink_mapping(mapping);
 		delete mapping;
 	}
+	vm_counters.working_set_size = 0;
+	vm_counters.commit_charge = 0;
 
 	KeReleaseSpinLock(&mapping_lock, old);
-
-	vmem.destroy(true);
 }
 
 usize Process::allocate(void* base, usize size, PageFlags flags, MappingFlags mapping_flags, UniqueKernelMapping* kernel_mapping) {
 	auto real_base = ALIGNDOWN(reinterpret_cast<usize>(base), PAGE_SIZE);
 	size = ALIGNUP(size + reinterpret_cast<usize>(base) % PAGE_SIZE, PAGE_SIZE);
 
+	// the kernel alias needs the frames up front
+	if (kernel_mapping && (mapping_flags & MappingFlags::DemandZero)) {
+		mapping_flags &= ~MappingFlags::DemandZero;
+		mapping_flags |= MappingFlags::Backed;
+	}
+
 	if (!size) {
 		return 0;
 	}
 
-	auto virt = vmem.xalloc(size, real_base, real_base);
-	if (!virt) {
+	u8* page_state = nullptr;
+	if (mapping_flags & MappingFlags::Reserved) {
+		page_state = static_cast<u8*>(kcalloc(size / PAGE_SIZE));
+		if (!page_state) {
+			return 0;
+		}
+	}
+
+	auto* mapping = new Mapping {};
+	mapping->size = size;
+	mapping->flags = flags;
+	mapping->mapping_flags = mapping_flags;
+	mapping->page_state = page_state;
+
+	// the range is reserved up front, the mapping doesn't fault anything in until it is fully set up
+	bool inserted = false;
+	if (!real_base && size >= LARGE_PAGE_SIZE && (mapping_flags & MappingFlags::Backed)) {
+		inserted = insert_mapping(mapping, 0, LARGE_PAGE_SIZE);
+	}
+	else if (!real_base && (mapping_flags & MappingFlags::Reserved)) {
+		inserted = insert_mapping(mapping, 0, ALLOCATION_GRANULARITY);
+	}
+	if (!inserted && !insert_mapping(mapping, real_base, PAGE_SIZE)) {
+		kfree(page_state, size / PAGE_SIZE);
+		delete mapping;
 		return 0;
 	}
+	usize virt = mapping->base;
 
 	UniqueKernelMapping unique_kernel_mapping {};
 	usize kernel_virt = 0;
 	if (kernel_mapping) {
 		auto* ptr = KERNEL_VSPACE.alloc(0, size);
 		if (!ptr) {
-			vmem.xfree(virt, size);
+			KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+			unlink_mapping(mapping);
+			KeReleaseSpinLock(&mapping_lock, old);
+			kfree(page_state, size / PAGE_SIZE);
+			delete mapping;
 			return 0;
 		}
 		kernel_virt = reinterpret_cast<usize>(ptr);
@@ -115,7 +247,24 @@ usize Process::allocate(void* base, usize size, PageFlags flags, MappingFlags ma
 		CacheMode cache_mode = CacheMode::WriteBack;
 		auto page_flags = flags | PageFlags::User;
 
-		for (usize i = 0; i < size; i += PAGE_SIZE) {
+		// use 2mb pages for the aligned parts when there is a frame available,
+		// the kernel alias is always built from 4k pages so don't bother in that case.
+		// after the first failure the rest of the allocation uses 4k pages.
+		bool try_large = !kernel_mapping;
+		for (usize i = 0; i < size;) {
+			if (try_large && (virt + i) % LARGE_PAGE_SIZE == 0 && size - i >= LARGE_PAGE_SIZE) {
+				auto phys = pmalloc_large();
+				if (phys) {
+					memset(to_virt<void>(phys), 0, LARGE_PAGE_SIZE);
+					if (page_map.map_2mb(virt + i, phys, page_flags, cache_mode)) {
+						i += LARGE_PAGE_SIZE;
+						continue;
+					}
+					pfree_large(phys);
+				}
+				try_large = false;
+			}
+
 			auto phys = pmalloc();
 			if (!phys || !page_map.map(virt + i, phys, page_flags, cache_mode) ||
 			    (kernel_mapping && !KERNEL_MAP->map(
@@ -123,28 +272,33 @@ usize Process::allocate(void* base, usize size, PageFlags flags, MappingFlags ma
 					phys,
 					PageFlags::Read | PageFlags::Write,
 					CacheMode::WriteBack))) {
-				for (usize j = 0; j < i; j += PAGE_SIZE) {
-					auto page_phys = page_map.get_phys(virt + j);
-					page_map.unmap(virt + j);
-					pfree(page_phys);
+				if (phys) {
+					page_map.unmap(virt + i);
+					pfree(phys);
 				}
+				release_pages(virt, i);
 
-				vmem.xfree(virt, size);
+				KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+				unlink_mapping(mapping);
+				KeReleaseSpinLock(&mapping_lock, old);
+				kfree(page_state, size / PAGE_SIZE);
+				delete mapping;
 				return 0;
 			}
+
+			i += PAGE_SIZE;
 		}
 	}
 
-	auto mapping = new Mapping {
-		.base = virt,
-		.size = size,
-		.flags = flags,
-		.mapping_flags = mapping_flags
-	};
-
-	KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
-	mappings.insert(mapping);
-	KeReleaseSpinLock(&mapping_lock, old);
+	// demand zero mappings are charged up front and only count towards the working set once faulted in
+	if (mapping_flags & (MappingFlags::Backed | MappingFlags::DemandZero)) {
+		KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+		if (mapping_flags & MappingFlags::Backed) {
+			add_counter(vm_counters.working_set_size, vm_counters.peak_working_set_size, size);
+		}
+		add_counter(vm_counters.commit_charge, vm_counters.peak_commit_charge, size);
+		KeReleaseSpinLock(&mapping_lock, old);
+	}
 
 	if (kernel_mapping) {
 		*kernel_mapping = std::move(unique_kernel_mapping);
@@ -156,33 +310,726 @@ usize Process::allocate(void* base, usize size, PageFlags flags, MappingFlags ma
 void Process::free(usize ptr, usize) {
 	KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
 
-	auto mapping = mappings.find<usize, &Mapping::base>(ptr);
-	if (!mapping) {
+	auto* mapping = find_mapping(ptr);
+	if (!mapping || mapping->base != ptr) {
 		KeReleaseSpinLock(&mapping_lock, old);
 		return;
 	}
 
+	remove_mapping(mapping);
+	KeReleaseSpinLock(&mapping_lock, old);
+}
+
+void Process::remove_mapping(Mapping* mapping) {
 	usize base = mapping->base;
-	if (mapping->mapping_flags & MappingFlags::Backed) {
-		for (usize i = 0; i < mapping->size; i += PAGE_SIZE) {
-			auto page_phys = page_map.get_phys(base + i);
-			page_map.unmap(base + i);
-			pfree(page_phys);
+	if (mapping->mapping_flags & (MappingFlags::Backed | MappingFlags::DemandZero)) {
+		vm_counters.working_set_size -= release_pages(base, mapping->size) * PAGE_SIZE;
+		vm_counters.commit_charge -= mapping->size;
+	}
+	else if (mapping->mapping_flags & MappingFlags::Reserved) {
+		vm_counters.working_set_size -= release_pages(base, mapping->size) * PAGE_SIZE;
+		for (usize i = 0; i < mapping->size / PAGE_SIZE; ++i) {
+			if (mapping->page_state[i] & PAGE_STATE_COMMITTED) {
+				vm_counters.commit_charge -= PAGE_SIZE;
+			}
 		}
 	}
+	else if (mapping->mapping_flags & MappingFlags::View) {
+		usize private_pages;
+		vm_counters.working_set_size -= release_view_pages(mapping, private_pages) * PAGE_SIZE;
+		vm_counters.commit_charge -= private_pages * PAGE_SIZE;
+	}
 
-	vmem.xfree(base, mapping->size);
+	if (mapping->page_state) {
+		kfree(mapping->page_state, mapping->size / PAGE_SIZE);
+	}
+	if (mapping->section) {
+		ObfDereferenceObject(mapping->section);
+	}
 
-	mappings.remove(mapping);
+	unlink_mapping(mapping);
 	delete mapping;
+}
+
+// returns the number of pages that were freed
+usize Process::release_pages(usize base, usize size) {
+	usize freed = 0;
+	u64 phys[PHYS_BATCH_SIZE];
+	// the frames can only be reused once no cpu has a translation to them cached,
+	// so they are freed after a single flush of the whole range
+	hz::list<Page, &Page::hook> frames {};
+	for (usize i = 0; i < size;) {
+		if ((base + i) % LARGE_PAGE_SIZE == 0 && size - i >= LARGE_PAGE_SIZE) {
+			if (auto large_phys = page_map.unmap_2mb(base + i)) {
+				pfree_large(large_phys);
+				freed += LARGE_PAGE_SIZE / PAGE_SIZE;
+				i += LARGE_PAGE_SIZE;
+				continue;
+			}
+		}
+
+		// don't cross a 2mb boundary so that the next one gets a chance to be freed as a whole
+		usize count = hz::min((size - i) / PAGE_SIZE, PHYS_BATCH_SIZE);
+		count = hz::min(count, (LARGE_PAGE_SIZE - (base + i) % LARGE_PAGE_SIZE) / PAGE_SIZE);
+		page_map.get_frame_range(base + i, count, phys);
+		for (usize j = 0; j < count; ++j) {
+			usize addr = base + i + j * PAGE_SIZE;
+			if (!phys[j]) {
+				if (!compressed_pages.is_empty()) {
+					if (auto marker = page_map.get_marker(addr)) {
+						auto* page = CompressedPage::from_marker(marker);
+						compressed_pages.remove(page);
+						compressed_store_free(page);
+						page_map.unmap(addr, false);
+					}
+				}
+				continue;
+			}
+			// a large page that couldn't be split stays mapped, its frame is leaked instead of freed
+			if (!page_map.unmap(addr, false)) {
+				continue;
+			}
+			frames.push(Page::from_phys(phys[j]));
+			++freed;
+		}
+
+		i += count * PAGE_SIZE;
+	}
+
+	if (!frames.is_empty()) {
+		page_map.flush(base, size / PAGE_SIZE);
+		pfree_list(frames);
+	}
+	return freed;
+}
+
+// the section keeps its own frames, only the private copies made by copy on write are freed.
+// returns the number of pages that were mapped
+usize Process::release_view_pages(Mapping* mapping, usize& private_pages) {
+	usize resident = 0;
+	private_pages = 0;
+	u64 phys[PHYS_BATCH_SIZE];
+	hz::list<Page, &Page::hook> frames {};
+	for (usize i = 0; i < mapping->size; i += PHYS_BATCH_SIZE * PAGE_SIZE) {
+		usize count = hz::min((mapping->size - i) / PAGE_SIZE, PHYS_BATCH_SIZE);
+		page_map.get_frame_range(mapping->base + i, count, phys);
+		for (usize j = 0; j < count; ++j) {
+			if (!phys[j]) {
+				continue;
+			}
+
+			usize addr = mapping->base + i + j * PAGE_SIZE;
+			page_map.unmap(addr, false);
+			++resident;
+			if (!is_shared_page(mapping, addr, phys[j])) {
+				frames.push(Page::from_phys(phys[j]));
+				++private_pages;
+			}
+		}
+	}
+
+	// the shared pages stay in the section but the view must not reach them anymore either
+	if (resident) {
+		page_map.flush(mapping->base, mapping->size / PAGE_SIZE);
+		pfree_list(frames);
+	}
+	return resident;
+}
+
+bool Process::is_shared_page(Mapping* mapping, usize addr, usize phys) {
+	return mapping->section->owns_page(mapping->section_offset + (addr - mapping->base), phys);
+}
+
+usize Process::allocate_stack(usize reserve, usize commit) {
+	// the lowest page is never committed so that overflowing the whole reservation faults
+	commit = hz::min(hz::max(ALIGNUP(commit, PAGE_SIZE), usize {PAGE_SIZE}), reserve - 2 * PAGE_SIZE);
+
+	auto base = allocate(nullptr, reserve, PageFlags::Read | PageFlags::Write, MappingFlags::Reserved, nullptr);
+	if (!base) {
+		return 0;
+	}
+
+	usize commit_base = base + reserve - commit;
+	usize commit_size = commit;
+	if (!NT_SUCCESS(this->commit(commit_base, commit_size, PageFlags::Read | PageFlags::Write))) {
+		free(base, reserve);
+		return 0;
+	}
+
+	KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+	auto* mapping = find_mapping(base);
+	mapping->page_state[(reserve - commit) / PAGE_SIZE - 1] =
+		PAGE_STATE_COMMITTED | PAGE_STATE_GUARD | static_cast<u8>(PageFlags::Read | PageFlags::Write);
+	add_counter(vm_counters.commit_charge, vm_counters.peak_commit_charge, PAGE_SIZE);
+	KeReleaseSpinLock(&mapping_lock, old);
+
+	return base;
+}
+
+bool Process::commit_page(usize addr) {
+	addr = ALIGNDOWN(addr, PAGE_SIZE);
+
+	KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+	++vm_counters.page_fault_count;
+
+	auto mapping = find_mapping(addr);
+	PageFlags flags {};
+	if (mapping && (mapping->mapping_flags & MappingFlags::Reserved)) {
+		usize index = (addr - mapping->base) / PAGE_SIZE;
+		auto state = mapping->page_state[index];
+		if (state & PAGE_STATE_COMMITTED) {
+			flags = static_cast<PageFlags>(state & ~(PAGE_STATE_COMMITTED | PAGE_STATE_GUARD));
+		}
+
+		// the guard moves down until it reaches the page above the lowest one
+		if (state & PAGE_STATE_GUARD) {
+			mapping->page_state[index] = state & ~PAGE_STATE_GUARD;
+			if (index > 1 && !(mapping->page_state[index - 1] & PAGE_STATE_COMMITTED)) {
+				mapping->page_state[index - 1] = state;
+				add_counter(vm_counters.commit_charge, vm_counters.peak_commit_charge, PAGE_SIZE);
+			}
+		}
+	}
+	else if (mapping && (mapping->mapping_flags & (MappingFlags::DemandZero | MappingFlags::View))) {
+		flags = mapping->page_flags(addr);
+	}
+
+	if (!(flags & PageFlags::Read)) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return false;
+	}
+
+	// another thread may have faulted the page in already
+	if (auto frame = page_map.get_frame(addr)) {
+		bool present = page_map.is_present(addr);
+		// a readable private page that isn't present was taken by compress_cold_pages,
+		// it keeps the page if it finds it mapped again once it's done compressing
+		if (!present && !(mapping->mapping_flags & MappingFlags::View)) {
+			present = page_map.map(addr, frame, flags | PageFlags::User, CacheMode::WriteBack);
+		}
+		KeReleaseSpinLock(&mapping_lock, old);
+		return present;
+	}
+
+	if (mapping->mapping_flags & MappingFlags::View) {
+		// the section might have to read the page from its file so the lock can't be held for that,
+		// a fault taken at a raised irql can't block for the read at all
+		if (old >= DISPATCH_LEVEL) {
+			KeReleaseSpinLock(&mapping_lock, old);
+			return false;
+		}
+
+		auto* section = mapping->section;
+		usize offset = mapping->section_offset + (addr - mapping->base);
+		ObfReferenceObject(section);
+		KeReleaseSpinLock(&mapping_lock, old);
+
+		auto phys = section->get_page(offset);
+
+		// the view can change while the lock isn't held, the access is retried if it did
+		old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+		mapping = find_mapping(addr);
+		bool success = phys;
+		if (phys && mapping && mapping->section == section &&
+			mapping->section_offset + (addr - mapping->base) == offset &&
+			!page_map.get_frame(addr)) {
+			flags = mapping->page_flags(addr);
+			if (mapping->mapping_flags & MappingFlags::CopyOnWrite) {
+				flags &= ~PageFlags::Write;
+			}
+			success = (flags & PageFlags::Read) &&
+				page_map.map(addr, phys, flags | PageFlags::User, CacheMode::WriteBack);
+			if (success) {
+				add_counter(vm_counters.working_set_size, vm_counters.peak_working_set_size, PAGE_SIZE);
+			}
+		}
+		KeReleaseSpinLock(&mapping_lock, old);
+
+		ObfDereferenceObject(section);
+		return success;
+	}
+
+	bool success = fault_in(mapping, addr, flags);
+	KeReleaseSpinLock(&mapping_lock, old);
+	return success;
+}
+
+// only for private pages, views are faulted in by commit_page
+bool Process::fault_in(Mapping* mapping, usize addr, PageFlags flags) {
+	assert(!(mapping->mapping_flags & MappingFlags::View));
+
+	auto phys = pmalloc();
+	if (!phys) {
+		return false;
+	}
+
+	// the compressed copy keeps the protection the page had
+	CompressedPage* compressed = nullptr;
+	if (auto marker = page_map.get_marker(addr)) {
+		compressed = CompressedPage::from_marker(marker);
+		compressed_store_load(compressed, to_virt<void>(phys));
+		flags = static_cast<PageFlags>(compressed->flags);
+	}
+	else {
+		memset(to_virt<void>(phys), 0, PAGE_SIZE);
+	}
+
+	if (!page_map.map(addr, phys, flags | PageFlags::User, CacheMode::WriteBack)) {
+		pfree(phys);
+		return false;
+	}
+
+	if (compressed) {
+		compressed_pages.remove(compressed);
+		compressed_store_free(compressed);
+	}
+
+	add_counter(vm_counters.working_set_size, vm_counters.peak_working_set_size, PAGE_SIZE);
+	return true;
+}
+
+bool Process::copy_on_write(usize addr) {
+	addr = ALIGNDOWN(addr, PAGE_SIZE);
+
+	KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+	++vm_counters.page_fault_count;
+
+	// writes to pages that aren't writable are protection violations, even if they were already copied
+	auto mapping = find_mapping(addr);
+	if (!mapping || !(mapping->mapping_flags & MappingFlags::CopyOnWrite) ||
+		!(mapping->page_flags(addr) & PageFlags::Write)) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return false;
+	}
+
+	auto phys = page_map.get_phys(addr);
+	if (!phys) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return false;
+	}
+
+	// another thread may have copied the page already
+	if (is_shared_page(mapping, addr, phys)) {
+		auto copy = pmalloc();
+		if (!copy) {
+			KeReleaseSpinLock(&mapping_lock, old);
+			return false;
+		}
+		memcpy(to_virt<void>(copy), to_virt<void>(phys), PAGE_SIZE);
+
+		// the entry is replaced in place, the table of a present page exists so this can't fail
+		bool success = page_map.map(addr, copy, mapping->page_flags(addr) | PageFlags::User, CacheMode::WriteBack);
+		assert(success);
+		add_counter(vm_counters.commit_charge, vm_counters.peak_commit_charge, PAGE_SIZE);
+		KeReleaseSpinLock(&mapping_lock, old);
+
+		// other cpus could still read the shared page through the old translation,
+		// the fault handler runs with interrupts enabled so waiting for them is fine
+		page_map.flush(addr, 1);
+		return true;
+	}
+
+	KeReleaseSpinLock(&mapping_lock, old);
+	return true;
+}
+
+NTSTATUS Process::commit(usize& base, usize& size, PageFlags flags) {
+	align_range(base, size);
+
+	KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+
+	NTSTATUS status;
+	auto* mapping = find_range(base, size, status);
+	if (!mapping) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return status;
+	}
+	if (!(mapping->mapping_flags & MappingFlags::Reserved)) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return STATUS_CONFLICTING_ADDRESSES;
+	}
+
+	// the frames are allocated on first touch, already committed pages keep their protection
+	auto* state = mapping->page_state + (base - mapping->base) / PAGE_SIZE;
+	for (usize i = 0; i < size / PAGE_SIZE; ++i) {
+		if (!(state[i] & PAGE_STATE_COMMITTED)) {
+			state[i] = PAGE_STATE_COMMITTED | static_cast<u8>(flags);
+			add_counter(vm_counters.commit_charge, vm_counters.peak_commit_charge, PAGE_SIZE);
+		}
+	}
+
+	KeReleaseSpinLock(&mapping_lock, old);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS Process::decommit(usize& base, usize& size) {
+	align_range(base, size);
+
+	KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+
+	NTSTATUS status;
+	auto* mapping = find_range(base, size, status);
+	if (!mapping) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return status;
+	}
+	if (!(mapping->mapping_flags & MappingFlags::Reserved)) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return STATUS_UNABLE_TO_FREE_VM;
+	}
+
+	vm_counters.working_set_size -= release_pages(base, size) * PAGE_SIZE;
+	auto* state = mapping->page_state + (base - mapping->base) / PAGE_SIZE;
+	for (usize i = 0; i < size / PAGE_SIZE; ++i) {
+		if (state[i] & PAGE_STATE_COMMITTED) {
+			vm_counters.commit_charge -= PAGE_SIZE;
+		}
+	}
+	memset(state, 0, size / PAGE_SIZE);
+
+	KeReleaseSpinLock(&mapping_lock, old);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS Process::release(usize& base, usize& size) {
+	align_range(base, size);
+
+	KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+
+	auto* mapping = find_mapping(base);
+	if (!mapping) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return STATUS_MEMORY_NOT_ALLOCATED;
+	}
+	if (mapping->base != base) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return STATUS_FREE_VM_NOT_AT_BASE;
+	}
+	if (!(mapping->mapping_flags & MappingFlags::Reserved) || (size && size != mapping->size)) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return STATUS_UNABLE_TO_FREE_VM;
+	}
+
+	size = mapping->size;
+	remove_mapping(mapping);
+
+	KeReleaseSpinLock(&mapping_lock, old);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS Process::protect(usize& base, usize& size, PageFlags flags, PageFlags& old_flags) {
+	align_range(base, size);
+
+	KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+
+	NTSTATUS status;
+	auto* mapping = find_range(base, size, status);
+	if (!mapping) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return status;
+	}
+	if (mapping->mapping_flags & MappingFlags::DisallowUserProtectionChange) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return STATUS_ACCESS_DENIED;
+	}
+
+	// large pages are split up front so that the protection can't be left half applied
+	if (mapping->mapping_flags & MappingFlags::Backed) {
+		for (usize addr = ALIGNDOWN(base, LARGE_PAGE_SIZE); addr < base + size; addr += LARGE_PAGE_SIZE) {
+			if (!page_map.split(addr)) {
+				KeReleaseSpinLock(&mapping_lock, old);
+				return STATUS_INSUFFICIENT_RESOURCES;
+			}
+		}
+	}
+
+	usize count = size / PAGE_SIZE;
+	bool partial = base != mapping->base || size != mapping->size;
+
+	if (!(mapping->mapping_flags & MappingFlags::Reserved) && partial && !mapping->page_state) {
+		auto* page_state = static_cast<u8*>(kmalloc(mapping->size / PAGE_SIZE));
+		if (!page_state) {
+			KeReleaseSpinLock(&mapping_lock, old);
+			return STATUS_NO_MEMORY;
+		}
+		memset(page_state, PAGE_STATE_COMMITTED | static_cast<u8>(mapping->flags), mapping->size / PAGE_SIZE);
+		mapping->page_state = page_state;
+	}
+
+	// compressed pages are brought back first so that the new protection applies to them
+	if (!compressed_pages.is_empty()) {
+		for (usize i = 0; i < count; ++i) {
+			usize addr = base + i * PAGE_SIZE;
+			if (page_map.get_marker(addr) && !fault_in(mapping, addr, mapping->page_flags(addr))) {
+				KeReleaseSpinLock(&mapping_lock, old);
+				return STATUS_NO_MEMORY;
+			}
+		}
+	}
+	if (mapping->mapping_flags & MappingFlags::Reserved) {
+		auto* state = mapping->page_state + (base - mapping->base) / PAGE_SIZE;
+		for (usize i = 0; i < count; ++i) {
+			if (!(state[i] & PAGE_STATE_COMMITTED)) {
+				KeReleaseSpinLock(&mapping_lock, old);
+				return STATUS_NOT_COMMITTED;
+			}
+		}
+
+		old_flags = static_cast<PageFlags>(state[0] & ~(PAGE_STATE_COMMITTED | PAGE_STATE_GUARD));
+		for (usize i = 0; i < count; ++i) {
+			state[i] = PAGE_STATE_COMMITTED | static_cast<u8>(flags);
+		}
+	}
+	else {
+		if ((mapping->mapping_flags & MappingFlags::View) && !(mapping->mapping_flags & MappingFlags::CopyOnWrite) &&
+			(flags & PageFlags::Write) && !(mapping->section->flags & PageFlags::Write)) {
+			KeReleaseSpinLock(&mapping_lock, old);
+			return STATUS_SECTION_PROTECTION;
+		}
+
+		old_flags = mapping->page_flags(base);
+		if (mapping->page_state) {
+			memset(
+				mapping->page_state + (base - mapping->base) / PAGE_SIZE,
+				PAGE_STATE_COMMITTED | static_cast<u8>(flags),
+				count);
+		}
+		else {
+			mapping->flags = flags;
+		}
+	}
+
+	for (usize i = 0; i < count; ++i) {
+		usize addr = base + i * PAGE_SIZE;
+		auto page_flags = flags | PageFlags::User;
+		// pages still shared with the section stay read only until they are written to
+		if (mapping->mapping_flags & MappingFlags::CopyOnWrite) {
+			auto phys = page_map.get_frame(addr);
+			if (phys && is_shared_page(mapping, addr, phys)) {
+				page_flags &= ~PageFlags::Write;
+			}
+		}
+		page_map.protect(addr, page_flags, CacheMode::WriteBack);
+	}
+
+	KeReleaseSpinLock(&mapping_lock, old);
+	return STATUS_SUCCESS;
+}
+
+usize Process::map_view(Section* section, usize offset, void* base, usize size, PageFlags flags, bool copy_on_write) {
+	auto real_base = ALIGNDOWN(reinterpret_cast<usize>(base), PAGE_SIZE);
+	size = ALIGNUP(size + reinterpret_cast<usize>(base) % PAGE_SIZE, PAGE_SIZE);
+	if (!size) {
+		return 0;
+	}
+
+	auto* mapping = new Mapping {};
+	mapping->size = size;
+	mapping->flags = flags;
+	mapping->mapping_flags = copy_on_write ? (MappingFlags::View | MappingFlags::CopyOnWrite) : MappingFlags::View;
+	mapping->section = section;
+	mapping->section_offset = offset;
+
+	if (!insert_mapping(mapping, real_base, ALLOCATION_GRANULARITY)) {
+		delete mapping;
+		return 0;
+	}
+
+	return mapping->base;
+}
+
+NTSTATUS Process::unmap_view(usize base) {
+	KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+
+	auto* mapping = find_mapping(base);
+	if (!mapping || !(mapping->mapping_flags & MappingFlags::View)) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return STATUS_NOT_MAPPED_VIEW;
+	}
+
+	remove_mapping(mapping);
+
 	KeReleaseSpinLock(&mapping_lock, old);
+	return STATUS_SUCCESS;
+}
+
+usize Process::compress_cold_pages(usize max_pages) {
+	usize compressed = 0;
+	usize budget = max_pages * COLD_SCAN_FACTOR;
+
+	struct ColdPage {
+		usize addr;
+		u64 phys;
+		PageFlags flags;
+		CompressedPage* page;
+	} batch[COLD_BATCH_SIZE];
+	usize count = 0;
+
+	KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+
+	// the lock is dropped while a batch is compressed, a single scan at a time makes sure
+	// that a taken page can't be taken again by another scan in the meantime
+	if (trimming) {
+		KeReleaseSpinLock(&mapping_lock, old);
+		return 0;
+	}
+	trimming = true;
+
+	// other cpus can still write to the taken pages through their tlbs until the flush, so they are
+	// only compressed after it. neither the flush nor the compression hold the mapping lock,
+	// a fault on a taken page maps it again and the page is kept when the lock is reacquired.
+	auto compress_batch = [&]() {
+		if (!count) {
+			return;
+		}
+
+		KeReleaseSpinLock(&mapping_lock, old);
+
+		page_map.flush(batch[0].addr, (batch[count - 1].addr - batch[0].addr) / PAGE_SIZE + 1);
+		for (usize i = 0; i < count; ++i) {
+			batch[i].page = compressed_store_put(to_virt<void>(batch[i].phys), batch[i].flags);
+		}
+
+		old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+
+		for (usize i = 0; i < count; ++i) {
+			auto& cold = batch[i];
+
+			// the page could have been faulted in, protected or released while the lock wasn't held
+			auto* mapping = find_mapping(cold.addr);
+			bool taken = mapping &&
+				(mapping->mapping_flags & (MappingFlags::DemandZero | MappingFlags::Reserved)) &&
+				(mapping->page_flags(cold.addr) & PageFlags::Read) &&
+				!page_map.is_present(cold.addr) &&
+				page_map.get_frame(cold.addr) == cold.phys;
+
+			if (taken && cold.page) {
+				page_map.set_marker(cold.addr, cold.page->to_marker());
+				compressed_pages.push(cold.page);
+				pfree(cold.phys);
+				vm_counters.working_set_size -= PAGE_SIZE;
+				++compressed;
+				continue;
+			}
+
+			if (cold.page) {
+				compressed_store_free(cold.page);
+			}
+			if (taken) {
+				// the table of the page is still there so this can't fail
+				bool success = page_map.map(cold.addr, cold.phys, cold.flags, CacheMode::WriteBack);
+				assert(success);
+			}
+		}
+		count = 0;
+	};
+
+	// the scan continues where the previous one stopped so that every page
+	// gets the same amount of time to be accessed again
+	usize addr = trim_cursor;
+	auto* mapping = static_cast<Mapping*>(mappings.lower_bound(addr));
+	while (mapping && compressed + count < max_pages && budget) {
+		addr = hz::max(addr, mapping->base);
+		// only private anonymous pages, backed mappings might have a kernel alias
+		if (addr >= mapping->base + mapping->size ||
+			!(mapping->mapping_flags & (MappingFlags::DemandZero | MappingFlags::Reserved))) {
+			mapping = static_cast<Mapping*>(VadTree::next(mapping));
+			continue;
+		}
+
+		--budget;
+		PageFlags flags;
+		if (auto phys = page_map.take_cold_page(addr, flags)) {
+			batch[count++] = {addr, phys, flags, nullptr};
+			if (count == COLD_BATCH_SIZE) {
+				compress_batch();
+				// the mappings could have changed while the lock wasn't held
+				mapping = static_cast<Mapping*>(mappings.lower_bound(addr + PAGE_SIZE));
+			}
+		}
+
+		addr += PAGE_SIZE;
+	}
+	compress_batch();
+	trim_cursor = mapping ? addr : 0;
+
+	trimming = false;
+	KeReleaseSpinLock(&mapping_lock, old);
+	return compressed;
+}
+
+PageFlags Process::Mapping::page_flags(usize addr) const {
+	if (!page_state) {
+		return flags;
+	}
+
+	auto state = page_state[(addr - base) / PAGE_SIZE];
+	if (!(state & PAGE_STATE_COMMITTED)) {
+		return {};
+	}
+	return static_cast<PageFlags>(state & ~(PAGE_STATE_COMMITTED | PAGE_STATE_GUARD));
+}
+
+Process::Mapping* Process::find_mapping(usize addr) {
+	return static_cast<Mapping*>(mappings.find(addr));
+}
+
+// base is either the exact address for the mapping or 0 for the lowest free one with the alignment
+bool Process::insert_mapping(Mapping* mapping, usize base, usize align) {
+	KIRQL old = KeAcquireSpinLockRaiseToDpc(&mapping_lock);
+
+	if (base) {
+		if (!mappings.is_free(base, mapping->size)) {
+			KeReleaseSpinLock(&mapping_lock, old);
+			return false;
+		}
+	}
+	else {
+		base = mappings.find_free(mapping->size, align);
+		if (!base) {
+			KeReleaseSpinLock(&mapping_lock, old);
+			return false;
+		}
+	}
+
+	mapping->base = base;
+	mappings.insert(mapping);
+	add_counter(vm_counters.virtual_size, vm_counters.peak_virtual_size, mapping->size);
+
+	KeReleaseSpinLock(&mapping_lock, old);
+	return true;
+}
+
+void Process::unlink_mapping(Mapping* mapping) {
+	mappings.remove(mapping);
+	vm_counters.virtual_size -= mapping->size;
+}
+
+Process::Mapping* Process::find_range(usize base, usize& size, NTSTATUS& status) {
+	auto* mapping = find_mapping(base);
+	if (!mapping) {
+		status = STATUS_MEMORY_NOT_ALLOCATED;
+		return nullptr;
+	}
+
+	usize available = mapping->base + mapping->size - base;
+	if (!size) {
+		size = available;
+	}
+	else if (size > available) {
+		status = STATUS_CONFLICTING_ADDRESSES;
+		return nullptr;
+	}
+
+	return mapping;
 }
 
 UniqueKernelMapping::~UniqueKernelMapping() {
 	if (ptr) {
-		for (usize i = 0; i < size; ++i) {
-			KERNEL_MAP->unmap(reinterpret_cast<u64>(ptr) + i);
+		for (usize i = 0; i < size; i += PAGE_SIZE) {
+			KERNEL_MAP->unmap(reinterpret_cast<u64>(ptr) + i, false);
 		}
+		KERNEL_MAP->flush(reinterpret_cast<u64>(ptr), ALIGNUP(size, PAGE_SIZE) / PAGE_SIZE);
 		KERNEL_VSPACE.free(ptr, size);
 	}
 }
@@ -191,3 +1038,6 @@ Process* KERNEL_PROCESS;
 hz::manually_init<PageMap> KERNEL_MAP;
 
 HandleTable SCHED_HANDLE_TABLE {};
+
+KSPIN_LOCK PROCESS_LIST_LOCK {};
+hz::list<Process, &Process::list_hook> PROCESS_LIST {};
@@ -1,9 +1,8 @@
 #pragma once
-#include <hz/rb_tree.hpp>
-#include "compare.hpp"
 #include "string.hpp"
 #include "string_view.hpp"
-#include "mem/vmem.hpp"
+#include "mem/vad.hpp"
+#include "mem/compressed_store.hpp"
 #include "arch/paging.hpp"
 #include "fs/object.hpp"
 #include "flags_enum.hpp"
@@ -55,14 +54,42 @@ struct UniqueKernelMapping {
 };
 
 struct _PEB;
+struct Section;
 
 enum class MappingFlags {
 	None,
 	Backed = 1 << 0,
-	DisallowUserProtectionChange = 1 << 1
+	DisallowUserProtectionChange = 1 << 1,
+	DemandZero = 1 << 2,
+	// pages are committed individually, see Mapping::page_state
+	Reserved = 1 << 3,
+	// a view of a section, the frames are owned by the section
+	View = 1 << 4,
+	// writes to the view go to private copies of the section's pages
+	CopyOnWrite = 1 << 5
 };
 FLAGS_ENUM(MappingFlags);
 
+constexpr usize ALLOCATION_GRANULARITY = 0x10000;
+constexpr u8 PAGE_STATE_COMMITTED = 1 << 7;
+// a committed stack page that commits the page below it as the new guard when it is first touched
+constexpr u8 PAGE_STATE_GUARD = 1 << 6;
+
+// used when the image doesn't specify the stack size, same as the defaults of the msvc linker
+constexpr usize DEFAULT_STACK_RESERVE = 1024 * 1024;
+constexpr usize DEFAULT_STACK_COMMIT = PAGE_SIZE;
+
+struct VmCounters {
+	usize virtual_size;
+	usize peak_virtual_size;
+	usize page_fault_count;
+	usize working_set_size;
+	usize peak_working_set_size;
+	// committed private memory, shared section pages are charged to the section
+	usize commit_charge;
+	usize peak_commit_charge;
+};
+
 struct Process {
 	explicit Process(kstd::wstring_view name);
 	explicit Process(const PageMap& map);
@@ -71,49 +98,98 @@ struct Process {
 	usize allocate(void* base, usize size, PageFlags page_flags, MappingFlags mapping_flags, UniqueKernelMapping* mapping);
 	void free(usize ptr, usize size);
 
+	// reserves a user thread stack and commits the top commit bytes and a guard page below them,
+	// the rest is committed as the stack grows into the guard page
+	usize allocate_stack(usize reserve, usize commit);
+
+	bool commit_page(usize addr);
+	bool copy_on_write(usize addr);
+
+	NTSTATUS commit(usize& base, usize& size, PageFlags flags);
+	NTSTATUS decommit(usize& base, usize& size);
+	NTSTATUS release(usize& base, usize& size);
+	NTSTATUS protect(usize& base, usize& size, PageFlags flags, PageFlags& old_flags);
+
+	// takes over the caller's reference to the section
+	usize map_view(Section* section, usize offset, void* base, usize size, PageFlags flags, bool copy_on_write = false);
+	NTSTATUS unmap_view(usize base);
+
 	void mark_as_exiting(int exit_status);
 
 	void add_thread(Thread* thread);
 	void remove_thread(Thread* thread);
 
+	// frees every mapping and the user page tables
+	void delete_address_space();
+
+	// compresses up to max_pages private pages that weren't accessed since the previous scan,
+	// returns the number of pages that were compressed
+	usize compress_cold_pages(usize max_pages);
+
 	kstd::wstring name;
 	HANDLE handle {INVALID_HANDLE_VALUE};
 	PageMap page_map;
 	ProcessPriority priority {ProcessPriority::Normal};
 	bool user;
 
-	struct Mapping {
-		hz::rb_tree_hook hook {};
-		usize base {};
-		usize size {};
+	// the mappings are the vads of the process, the same tree is used for allocating address space
+	struct Mapping : VadNode {
 		PageFlags flags {};
 		MappingFlags mapping_flags {};
-
-		constexpr bool operator==(const Mapping& other) const {
-			return base == other.base;
-		}
-
-		constexpr int operator<=>(const Mapping& other) const {
-			return kstd::threeway(base, other.base);
-		}
+		// PAGE_STATE_COMMITTED | PageFlags for each page of a reserved mapping,
+		// other mappings get it when only a part of them is reprotected
+		u8* page_state {};
+		Section* section {};
+		usize section_offset {};
+
+		// the protection of the page at addr, none if it isn't committed
+		[[nodiscard]] PageFlags page_flags(usize addr) const;
 	};
 
 	KSPIN_LOCK mapping_lock {};
-	hz::rb_tree<Mapping, &Mapping::hook> mappings {};
+	VadTree mappings {};
+	// protected by mapping_lock
+	VmCounters vm_counters {};
+	// protected by mapping_lock
+	hz::list<CompressedPage, &CompressedPage::hook> compressed_pages {};
+	// where the next scan for cold pages continues, protected by mapping_lock
+	usize trim_cursor {};
+	// set while a scan has pages taken out of the page map, protected by mapping_lock
+	bool trimming {};
 	hz::list<Thread, &Thread::process_hook> threads {};
 	KSPIN_LOCK threads_lock {};
 	usize ntdll_base {};
+	// from the optional header of the main image
+	usize stack_reserve {DEFAULT_STACK_RESERVE};
+	usize stack_commit {DEFAULT_STACK_COMMIT};
 	_PEB* peb {};
+	hz::list_hook reap_hook {};
+	hz::list_hook list_hook {};
 	bool exiting {};
 	int exit_status {};
 	KSPIN_LOCK lock {};
 	HandleTable handle_table {};
 
 private:
-	VMem vmem {};
+	Mapping* find_mapping(usize addr);
+	bool insert_mapping(Mapping* mapping, usize base, usize align);
+	void unlink_mapping(Mapping* mapping);
+	Mapping* find_range(usize base, usize& size, NTSTATUS& status);
+	usize release_pages(usize base, usize size);
+	usize release_view_pages(Mapping* mapping, usize& private_pages);
+	bool is_shared_page(Mapping* mapping, usize addr, usize phys);
+	void remove_mapping(Mapping* mapping);
+	bool fault_in(Mapping* mapping, usize addr, PageFlags flags);
 };
 
+// hands the process to the reaper thread which deletes its address space and drops the reference
+void ps_reap_process(Process* process);
+
 extern Process* KERNEL_PROCESS;
 extern hz::manually_init<PageMap> KERNEL_MAP;
 
 extern HandleTable SCHED_HANDLE_TABLE;
+
+// every user process that is still alive
+extern KSPIN_LOCK PROCESS_LIST_LOCK;
+extern hz::list<Process, &Process::list_hook> PROCESS_LIST;
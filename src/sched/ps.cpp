@@ -4,6 +4,13 @@
 #include "rtl.hpp"
 #include "sys/misc.hpp"
 #include "process.hpp"
+#include "event.hpp"
+#include "wait.hpp"
+#include "mem/mm.hpp"
+#include "sys/user_access.hpp"
+#include "arch/arch_syscall.hpp"
+#include "utils/except.hpp"
+#include "cstring.hpp"
 
 NTAPI extern "C" OBJECT_TYPE* PsProcessType = nullptr;
 NTAPI extern "C" OBJECT_TYPE* PsThreadType = nullptr;
@@ -54,6 +61,46 @@ void ps_init() {
 	KERNEL_PROCESS->handle = handle;
 }
 
+namespace {
+	KSPIN_LOCK REAP_LOCK {};
+	hz::list<Process, &Process::reap_hook> REAP_LIST {};
+	KEVENT REAP_EVENT {};
+
+	[[noreturn]] void process_reaper(void*) {
+		while (true) {
+			KeWaitForSingleObject(&REAP_EVENT, Executive, KernelMode, false, nullptr);
+
+			while (true) {
+				auto old = KeAcquireSpinLockRaiseToDpc(&REAP_LOCK);
+				auto* process = REAP_LIST.pop_front();
+				KeReleaseSpinLock(&REAP_LOCK, old);
+				if (!process) {
+					break;
+				}
+
+				process->delete_address_space();
+				ObfDereferenceObject(process);
+			}
+		}
+	}
+}
+
+void ps_reaper_init() {
+	KeInitializeEvent(&REAP_EVENT, EVENT_TYPE::Synchronization, false);
+
+	auto* cpu = get_current_cpu();
+	auto* thread = create_thread(u"process reaper", cpu, &*KERNEL_PROCESS, false, process_reaper, nullptr);
+	assert(thread);
+	cpu->scheduler.queue(cpu, thread);
+}
+
+void ps_reap_process(Process* process) {
+	auto old = KeAcquireSpinLockRaiseToDpc(&REAP_LOCK);
+	REAP_LIST.push(process);
+	KeReleaseSpinLock(&REAP_LOCK, old);
+	KeSetEvent(&REAP_EVENT, 0, false);
+}
+
 Process* create_process(kstd::wstring_view name) {
 	auto mode = ExGetPreviousMode();
 	void* ptr;
@@ -148,7 +195,7 @@ NTAPI NTSTATUS PsCreateSystemThread(
 	CLIENT_ID* client_id,
 	PKSTART_ROUTINE start_routine,
 	PVOID start_ctx) {
-	auto* cpu = get_current_cpu();
+	auto* cpu = Scheduler::select_cpu(UINTPTR_MAX);
 
 	Thread* thread;
 
@@ -221,3 +268,68 @@ NTAPI NTSTATUS PsLookupProcessByProcessId(
 NTAPI HANDLE PsGetProcessId(Process* process) {
 	return process->handle;
 }
+
+NTAPI NTSTATUS NtQueryInformationProcess(
+	HANDLE process_handle,
+	PROCESSINFOCLASS process_info_class,
+	PVOID process_info,
+	ULONG process_info_length,
+	PULONG return_length) {
+	auto mode = ExGetPreviousMode();
+
+	if (process_info_class != ProcessVmCounters) {
+		return STATUS_INVALID_INFO_CLASS;
+	}
+	else if (process_info_length != sizeof(VM_COUNTERS) && process_info_length != sizeof(VM_COUNTERS_EX)) {
+		return STATUS_INFO_LENGTH_MISMATCH;
+	}
+
+	Process* process;
+	auto status = mm_reference_process(process_handle, mode, process);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	auto old = KeAcquireSpinLockRaiseToDpc(&process->mapping_lock);
+	auto vm = process->vm_counters;
+	KeReleaseSpinLock(&process->mapping_lock, old);
+
+	// page tables are the only non paged memory charged to a process
+	VM_COUNTERS_EX counters {};
+	counters.PeakVirtualSize = vm.peak_virtual_size;
+	counters.VirtualSize = vm.virtual_size;
+	counters.PageFaultCount = static_cast<ULONG>(vm.page_fault_count);
+	counters.PeakWorkingSetSize = vm.peak_working_set_size;
+	counters.WorkingSetSize = vm.working_set_size;
+	counters.QuotaPeakNonPagedPoolUsage = process->page_map.get_page_table_size();
+	counters.QuotaNonPagedPoolUsage = process->page_map.get_page_table_size();
+	counters.PagefileUsage = vm.commit_charge;
+	counters.PeakPagefileUsage = vm.peak_commit_charge;
+	counters.PrivateUsage = vm.commit_charge;
+	ObfDereferenceObject(process);
+
+	if (mode == UserMode) {
+		__try {
+			enable_user_access();
+			ProbeForWrite(process_info, process_info_length, alignof(VM_COUNTERS));
+			memcpy(process_info, &counters, process_info_length);
+			if (return_length) {
+				ProbeForWrite(return_length, sizeof(ULONG), alignof(ULONG));
+				*return_length = process_info_length;
+			}
+			disable_user_access();
+		}
+		__except (1) {
+			disable_user_access();
+			return GetExceptionCode();
+		}
+	}
+	else {
+		memcpy(process_info, &counters, process_info_length);
+		if (return_length) {
+			*return_length = process_info_length;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
@@ -11,7 +11,31 @@ struct CLIENT_ID {
 
 using PKSTART_ROUTINE = void (*)(PVOID start_ctx);
 
+enum PROCESSINFOCLASS {
+	ProcessBasicInformation = 0,
+	ProcessVmCounters = 3
+};
+
+struct VM_COUNTERS {
+	SIZE_T PeakVirtualSize;
+	SIZE_T VirtualSize;
+	ULONG PageFaultCount;
+	SIZE_T PeakWorkingSetSize;
+	SIZE_T WorkingSetSize;
+	SIZE_T QuotaPeakPagedPoolUsage;
+	SIZE_T QuotaPagedPoolUsage;
+	SIZE_T QuotaPeakNonPagedPoolUsage;
+	SIZE_T QuotaNonPagedPoolUsage;
+	SIZE_T PagefileUsage;
+	SIZE_T PeakPagefileUsage;
+};
+
+struct VM_COUNTERS_EX : VM_COUNTERS {
+	SIZE_T PrivateUsage;
+};
+
 void ps_init();
+void ps_reaper_init();
 
 struct Thread;
 struct Cpu;
@@ -37,3 +61,10 @@ NTAPI extern "C" NTSTATUS PsLookupProcessByProcessId(
 	HANDLE process_id,
 	Process** process);
 NTAPI extern "C" HANDLE PsGetProcessId(Process* process);
+
+NTAPI extern "C" NTSTATUS NtQueryInformationProcess(
+	HANDLE process_handle,
+	PROCESSINFOCLASS process_info_class,
+	PVOID process_info,
+	ULONG process_info_length,
+	PULONG return_length);
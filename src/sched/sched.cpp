@@ -4,7 +4,10 @@
 #include "utils/thread_safety.hpp"
 #include "utils/shared_data.hpp"
 #include "atomic.hpp"
+#include "arch/irq.hpp"
+#include "dev/irq.hpp"
 #include <hz/bit.hpp>
+#include <hz/algorithm.hpp>
 
 namespace {
 	constexpr u32 find_level(u32 mask) {
@@ -53,12 +56,160 @@ Scheduler::Scheduler(Cpu* cpu) {
 
 void Scheduler::queue_private(Cpu* cpu, Thread* thread) {
 	thread->status = ThreadStatus::Ready;
+	thread->cpu = cpu;
 
 	auto level = get_thread_level(thread);
 	levels[level].threads.push(thread);
 	ready_summary |= 1 << level;
+	ready_count.fetch_add(1, hz::memory_order::relaxed);
 
 	set_thread_expiry(cpu, thread);
+	thread->ready_since_cycles = get_cycle_count();
+
+	// the new thread has to get its turn
+	if (cpu == get_current_cpu() && tick_stopped) {
+		update_tick(cpu);
+	}
+}
+
+// the periodic tick is only needed for preempting threads, with nothing else to run it is stopped
+void Scheduler::update_tick(Cpu* cpu) {
+	auto now = CLOCK_SOURCE->get_ns();
+
+	// other cpus count the threads they push to the wake list before checking whether the tick
+	// is stopped, so either they see it stopped and interrupt this cpu or the count is seen here
+	bool stop = !ready_count.load(hz::memory_order::relaxed);
+	if (stop) {
+		__atomic_store_n(&tick_stopped, true, __ATOMIC_SEQ_CST);
+		stop = !ready_count.load(hz::memory_order::seq_cst);
+	}
+	if (!stop && tick_stopped) {
+		__atomic_store_n(&tick_stopped, false, __ATOMIC_RELAXED);
+		next_tick_ns = now + CLOCK_INTERVAL_MS * NS_IN_MS;
+	}
+
+	next_sleep_ns.store(sleep_timers.next_expiry_ns(), hz::memory_order::relaxed);
+	program_tick(cpu, now);
+}
+
+// the timer fires at the next tick or earlier for the first sleeper or timer
+void Scheduler::program_tick(Cpu* cpu, u64 now) {
+	u64 deadline;
+	if (tick_stopped) {
+		deadline = now + NOHZ_MAX_SLEEP_MS * NS_IN_MS;
+	}
+	else {
+		deadline = hz::max(next_tick_ns, now);
+	}
+
+	deadline = hz::min(deadline, next_sleep_ns.load(hz::memory_order::relaxed));
+	deadline = hz::min(deadline, cpu->timer_queue.next_expiry_ns.load(hz::memory_order::relaxed));
+	deadline = hz::max(deadline, now);
+
+	u64 us = (deadline - now + NS_IN_US - 1) / NS_IN_US;
+	us = hz::max(hz::min(us, cpu->tick_source->max_us), u64 {1});
+	cpu->tick_source->oneshot(us);
+}
+
+void Scheduler::timer_added(Cpu* cpu) {
+	KeAcquireSpinLockAtDpcLevel(&lock);
+	update_tick(cpu);
+	KeReleaseSpinLockFromDpcLevel(&lock);
+}
+
+u32 Scheduler::get_load(const Cpu* cpu) const {
+	u32 load = ready_count.load(hz::memory_order::relaxed);
+	auto* current = __atomic_load_n(&cpu->current_thread, __ATOMIC_RELAXED);
+	if (current && current != &cpu->idle_thread) {
+		++load;
+	}
+	return load;
+}
+
+Cpu* Scheduler::select_cpu(KAFFINITY affinity) {
+	auto* best = get_current_cpu();
+	u32 best_load = UINT32_MAX;
+	if (affinity & 1ULL << best->number) {
+		best_load = best->scheduler.get_load(best);
+	}
+
+	for (auto* cpu : CPUS) {
+		if (!cpu || cpu == best || !(affinity & 1ULL << cpu->number)) {
+			continue;
+		}
+
+		auto load = cpu->scheduler.get_load(cpu);
+		if (load < best_load) {
+			best = cpu;
+			best_load = load;
+		}
+	}
+
+	return best;
+}
+
+// pulls the highest priority thread this cpu is allowed to run from the busiest other cpu,
+// everything is only tried to be locked as the other cpu might be stealing from this one
+bool Scheduler::steal(Cpu* cpu, u32 min_imbalance) {
+	Cpu* busiest = nullptr;
+	u32 busiest_count = 0;
+	for (auto* other : CPUS) {
+		if (!other || other == cpu) {
+			continue;
+		}
+
+		auto count = other->scheduler.ready_count.load(hz::memory_order::relaxed);
+		if (count > busiest_count) {
+			busiest = other;
+			busiest_count = count;
+		}
+	}
+
+	auto own_count = ready_count.load(hz::memory_order::relaxed);
+	if (!busiest || busiest_count < own_count + min_imbalance) {
+		return false;
+	}
+
+	auto& victim = busiest->scheduler;
+	if (!KeTryToAcquireSpinLockAtDpcLevel(&victim.lock)) {
+		return false;
+	}
+	// the threads woken by other cpus are counted already, they can be stolen once they are queued
+	victim.drain_remote_wakes(busiest);
+
+	Thread* stolen = nullptr;
+	for (u32 summary = victim.ready_summary; summary && !stolen;) {
+		auto index = find_level(summary) - 1;
+		summary &= ~(1U << index);
+
+		for (auto& thread : victim.levels[index].threads) {
+			if (!(thread.affinity & 1ULL << cpu->number)) {
+				continue;
+			}
+			// a thread that was just preempted keeps its lock until its context is saved
+			if (!KeTryToAcquireSpinLockAtDpcLevel(&thread.lock)) {
+				continue;
+			}
+
+			stolen = &thread;
+			victim.levels[index].threads.remove(stolen);
+			if (victim.levels[index].threads.is_empty()) {
+				victim.ready_summary &= ~(1U << index);
+			}
+			victim.ready_count.fetch_sub(1, hz::memory_order::relaxed);
+			break;
+		}
+	}
+
+	KeReleaseSpinLockFromDpcLevel(&victim.lock);
+
+	if (!stolen) {
+		return false;
+	}
+
+	queue_private(cpu, stolen);
+	KeReleaseSpinLockFromDpcLevel(&stolen->lock);
+	return true;
 }
 
 void Scheduler::update_schedule(Cpu* cpu) {
@@ -73,7 +224,15 @@ void Scheduler::update_schedule(Cpu* cpu) {
 		KeReleaseSpinLockFromDpcLevel(&destroy_lock);
 	}
 
+	drain_remote_wakes(cpu);
+
 	auto index = find_level(ready_summary);
+	// about to go idle or already idle, take work from a busier cpu instead
+	if (!index && (cpu->current_thread == &cpu->idle_thread || cpu->current_thread->status != ThreadStatus::Running)) {
+		if (steal(cpu, 1)) {
+			index = find_level(ready_summary);
+		}
+	}
 	if (!index) {
 		if (cpu->current_thread->status != ThreadStatus::Running) {
 			cpu->next_thread = &cpu->idle_thread;
@@ -90,6 +249,7 @@ void Scheduler::update_schedule(Cpu* cpu) {
 	if (level.threads.is_empty()) {
 		ready_summary &= ~(1 << (index - 1));
 	}
+	ready_count.fetch_sub(1, hz::memory_order::relaxed);
 
 	cpu->next_thread = thread;
 }
@@ -123,20 +283,19 @@ void Scheduler::yield() {
 			return;
 		}
 
+		end_starvation_boost(current);
 		queue_private(cpu, current);
 	}
 	else {
-		for (auto cpu_it : CPUS) {
-			if (current->affinity & 1ULL << cpu_it->number) {
-				KeAcquireSpinLockAtDpcLevel(&cpu_it->scheduler.lock);
-				cpu_it->scheduler.queue_private(cpu_it, current);
-				KeReleaseSpinLockFromDpcLevel(&cpu_it->scheduler.lock);
-				break;
-			}
-		}
+		end_starvation_boost(current);
+		auto* target = select_cpu(current->affinity);
+		KeAcquireSpinLockAtDpcLevel(&target->scheduler.lock);
+		target->scheduler.queue_private(target, current);
+		KeReleaseSpinLockFromDpcLevel(&target->scheduler.lock);
+		arch_send_reschedule_ipi(target);
 	}
 
-	cpu->current_thread = cpu->next_thread;
+	set_current(cpu, cpu->next_thread);
 	cpu->next_thread = nullptr;
 
 	KeReleaseSpinLockFromDpcLevel(&lock);
@@ -165,6 +324,7 @@ void Scheduler::block(ThreadStatus status) {
 	}
 
 	current->status = status;
+	end_starvation_boost(current);
 
 	auto cpu = get_current_cpu();
 
@@ -172,7 +332,7 @@ void Scheduler::block(ThreadStatus status) {
 
 	update_schedule(cpu);
 
-	cpu->current_thread = cpu->next_thread;
+	set_current(cpu, cpu->next_thread);
 	cpu->next_thread = nullptr;
 
 	KeReleaseSpinLockFromDpcLevel(&lock);
@@ -189,7 +349,7 @@ void Scheduler::block(ThreadStatus status) {
 	KeLowerIrql(old);
 }
 
-bool Scheduler::unblock(Thread* thread) {
+bool Scheduler::unblock(Thread* thread, i32 increment) {
 	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
 	assert(thread->lock.value.load(hz::memory_order::relaxed));
 
@@ -202,10 +362,41 @@ bool Scheduler::unblock(Thread* thread) {
 		return false;
 	}
 
+	// boosts don't add up, the thread keeps the larger one
+	if (increment > thread->priority_boost) {
+		thread->priority_boost = static_cast<u8>(hz::min(increment, static_cast<i32>(REALTIME_START - 1)));
+		thread->starvation_boost = false;
+	}
+
+	// threads of other cpus are pushed to their wake list instead of taking the remote lock,
+	// the cpu is only interrupted if the thread should run before the current one
+	auto* cpu = thread->cpu;
+	if (cpu != get_current_cpu()) {
+		thread->status = ThreadStatus::Ready;
+
+		auto* head = remote_wakes.load(hz::memory_order::relaxed);
+		do {
+			thread->remote_wake_next = head;
+		} while (!remote_wakes.compare_exchange_weak(
+			head,
+			thread,
+			hz::memory_order::release,
+			hz::memory_order::relaxed));
+		ready_count.fetch_add(1, hz::memory_order::seq_cst);
+
+		// equal priorities need the tick of the cpu for taking turns,
+		// without a tick the thread would only be noticed when the cpu next wakes up
+		if (__atomic_load_n(&tick_stopped, __ATOMIC_SEQ_CST) ||
+			get_thread_level(thread) >= current_level.load(hz::memory_order::relaxed)) {
+			arch_send_reschedule_ipi(cpu);
+		}
+		return true;
+	}
+
 	KeAcquireSpinLockAtDpcLevel(&lock);
 
 	if (thread->status == ThreadStatus::Sleeping) {
-		sleeping_threads.remove(thread);
+		sleep_timers.remove(&thread->sleep_timer);
 	}
 
 	queue_private(thread->cpu, thread);
@@ -215,11 +406,86 @@ bool Scheduler::unblock(Thread* thread) {
 	return true;
 }
 
+// only the oldest thread of every level is checked, the levels are in queueing order
+void Scheduler::boost_starved(Cpu* cpu) {
+	u64 now = get_cycle_count();
+	u64 limit = STARVATION_MS * cpu->cycles_per_clock_interval / CLOCK_INTERVAL_MS;
+
+	for (usize index = 1; index < REALTIME_START - 1; ++index) {
+		if (!(ready_summary & 1U << index)) {
+			continue;
+		}
+
+		auto& level = levels[index];
+		auto* thread = level.threads.front();
+		if (now - thread->ready_since_cycles < limit) {
+			continue;
+		}
+		// a thread that was just preempted keeps its lock until its context is saved
+		if (!KeTryToAcquireSpinLockAtDpcLevel(&thread->lock)) {
+			continue;
+		}
+
+		level.threads.remove(thread);
+		if (level.threads.is_empty()) {
+			ready_summary &= ~(1U << index);
+		}
+		ready_count.fetch_sub(1, hz::memory_order::relaxed);
+
+		thread->priority_boost = static_cast<u8>(REALTIME_START - 1 - get_base_level(thread));
+		thread->starvation_boost = true;
+		queue_private(cpu, thread);
+
+		KeReleaseSpinLockFromDpcLevel(&thread->lock);
+	}
+}
+
+void Scheduler::drain_remote_wakes(Cpu* cpu) {
+	auto* thread = remote_wakes.exchange(nullptr, hz::memory_order::acquire);
+
+	// the list is in reverse wake order
+	Thread* reversed = nullptr;
+	while (thread) {
+		auto* next = thread->remote_wake_next;
+		thread->remote_wake_next = reversed;
+		reversed = thread;
+		thread = next;
+	}
+
+	while (reversed) {
+		// the thread can be woken again as soon as it is queued
+		auto* next = reversed->remote_wake_next;
+
+		KeAcquireSpinLockAtDpcLevel(&reversed->lock);
+		if (reversed->sleep_timer.queued) {
+			sleep_timers.remove(&reversed->sleep_timer);
+		}
+		ready_count.fetch_sub(1, hz::memory_order::relaxed);
+		queue_private(cpu, reversed);
+		KeReleaseSpinLockFromDpcLevel(&reversed->lock);
+
+		reversed = next;
+	}
+}
+
+void Scheduler::set_current(Cpu* cpu, Thread* thread) {
+	__atomic_store_n(&cpu->current_thread, thread, __ATOMIC_RELAXED);
+	current_level.store(thread == &cpu->idle_thread ? 0 : get_thread_level(thread), hz::memory_order::relaxed);
+}
+
 void Scheduler::sleep(u64 ns) {
 	if (!ns) {
 		return;
 	}
 
+	sleep_until(CLOCK_SOURCE->get_ns() + ns);
+}
+
+void Scheduler::sleep_until(u64 deadline_ns) {
+	if (deadline_ns <= CLOCK_SOURCE->get_ns()) {
+		return;
+	}
+
 	auto current = get_current_thread();
 
 	// raising the irql to DISPATCH_LEVEL also prevents preemption
@@ -232,27 +498,19 @@ void Scheduler::sleep(u64 ns) {
 		return;
 	}
 
-	u64 sleep_end = CLOCK_SOURCE->get_ns() + ns;
-
 	KeAcquireSpinLockAtDpcLevel(&lock);
 
-	Thread* next_sleeping = nullptr;
-	for (auto& thread : sleeping_threads) {
-		if (thread.sleep_end_ns > sleep_end) {
-			next_sleeping = &thread;
-			break;
-		}
-	}
-
-	sleeping_threads.insert_before(next_sleeping, current);
+	current->sleep_timer.expiry_ns = deadline_ns;
+	sleep_timers.insert(&current->sleep_timer);
 
-	current->sleep_end_ns = sleep_end;
 	current->status = ThreadStatus::Sleeping;
+	end_starvation_boost(current);
 
 	auto cpu = get_current_cpu();
 	update_schedule(cpu);
+	update_tick(cpu);
 
-	cpu->current_thread = cpu->next_thread;
+	set_current(cpu, cpu->next_thread);
 	cpu->next_thread = nullptr;
 
 	KeReleaseSpinLockFromDpcLevel(&lock);
@@ -274,7 +532,13 @@ void Scheduler::queue(Cpu* cpu, Thread* thread) {
 	KeAcquireSpinLockAtDpcLevel(&thread->lock);
 	queue_private(cpu, thread);
 	KeReleaseSpinLockFromDpcLevel(&thread->lock);
+	bool remote = cpu != get_current_cpu();
 	KeReleaseSpinLock(&lock, irql);
+
+	// the target cpu might be idle with its tick stopped
+	if (remote) {
+		arch_send_reschedule_ipi(cpu);
+	}
 }
 
 void Scheduler::handle_quantum_end(Cpu* cpu) {
@@ -282,15 +546,45 @@ void Scheduler::handle_quantum_end(Cpu* cpu) {
 	KeAcquireSpinLockAtDpcLevel(&lock);
 
 	auto now = CLOCK_SOURCE->get_ns();
-	for (auto& thread : sleeping_threads) {
-		if (thread.sleep_end_ns > now) {
-			break;
+	TimerWheel::List expired {};
+	sleep_timers.advance(now, expired);
+	while (auto* entry = expired.pop_front()) {
+		auto* thread = hz::container_of(entry, &Thread::sleep_timer);
+		KeAcquireSpinLockAtDpcLevel(&thread->lock);
+		// already woken by another cpu and waiting in the remote wake list
+		if (thread->status == ThreadStatus::Sleeping) {
+			queue_private(thread->cpu, thread);
 		}
+		KeReleaseSpinLockFromDpcLevel(&thread->lock);
+	}
+
+	drain_remote_wakes(cpu);
+
+	// woken before the quantum ended for a sleeper, the current thread keeps running
+	// unless one of the woken threads should preempt it
+	auto current = cpu->current_thread;
+	if (!cpu->quantum_end && current != &cpu->idle_thread) {
+		if (!ready_summary || find_level(ready_summary) - 1 <= get_thread_level(current)) {
+			update_tick(cpu);
+			KeReleaseSpinLockFromDpcLevel(&lock);
+			return;
+		}
+	}
+
+	// boosts decay one level per quantum, starvation boosts only last for one
+	if (cpu->quantum_end && current->priority_boost) {
+		if (current->starvation_boost) {
+			end_starvation_boost(current);
+		}
+		else {
+			--current->priority_boost;
+		}
+	}
 
-		KeAcquireSpinLockAtDpcLevel(&thread.lock);
-		sleeping_threads.remove(&thread);
-		queue_private(thread.cpu, &thread);
-		KeReleaseSpinLockFromDpcLevel(&thread.lock);
+	if (++quantums_since_balance >= BALANCE_INTERVAL_QUANTUMS) {
+		quantums_since_balance = 0;
+		steal(cpu, BALANCE_IMBALANCE);
+		boost_starved(cpu);
 	}
 
 	update_schedule(cpu);
@@ -298,7 +592,10 @@ void Scheduler::handle_quantum_end(Cpu* cpu) {
 	cpu->quantum_end = false;
 
 	if (!cpu->next_thread) {
+		// the boost of the current thread might have decayed
+		set_current(cpu, cpu->current_thread);
 		set_thread_expiry(cpu, cpu->current_thread);
+		update_tick(cpu);
 		KeReleaseSpinLockFromDpcLevel(&lock);
 		return;
 	}
@@ -306,9 +603,15 @@ void Scheduler::handle_quantum_end(Cpu* cpu) {
 	auto prev = cpu->current_thread;
 	KeAcquireSpinLockAtDpcLevel(&prev->lock);
 
-	queue_private(cpu, prev);
-	cpu->current_thread = cpu->next_thread;
+	// the idle thread is never queued, the cpu returns to it when nothing else is ready.
+	// a preempted thread loses its starvation boost even if its quantum didn't end
+	if (prev != &cpu->idle_thread) {
+		end_starvation_boost(prev);
+		queue_private(cpu, prev);
+	}
+	set_current(cpu, cpu->next_thread);
 	cpu->next_thread = nullptr;
+	update_tick(cpu);
 
 	KeReleaseSpinLockFromDpcLevel(&lock);
 
@@ -321,30 +624,59 @@ void Scheduler::handle_quantum_end(Cpu* cpu) {
 }
 
 void Scheduler::on_timer(Cpu* cpu) {
-	auto now = get_cycle_count();
+	auto now_ns = CLOCK_SOURCE->get_ns();
 
-	if (cpu->number == 0) {
-		u64 ticks = Scheduler::CLOCK_INTERVAL_MS * (NS_IN_MS / 100);
-		atomic_fetch_add(&SharedUserData->system_time.u64, ticks, memory_order::relaxed);
-	}
+	system_time_update();
 
-	auto current = cpu->current_thread;
+	auto& scheduler = cpu->scheduler;
+
+	// the timer also fires between ticks for sleepers and timers, only the ticks use up the quantum
+	if (!scheduler.tick_stopped && now_ns >= scheduler.next_tick_ns) {
+		scheduler.next_tick_ns = now_ns + CLOCK_INTERVAL_MS * NS_IN_MS;
 
-	assert(now >= current->last_run_start_cycles);
-	auto elapsed = now - current->last_run_start_cycles;
+		auto now = get_cycle_count();
+		auto current = cpu->current_thread;
 
-	if (elapsed < current->cycle_quota) {
-		current->cycle_quota -= elapsed;
+		assert(now >= current->last_run_start_cycles);
+		auto elapsed = now - current->last_run_start_cycles;
+
+		if (elapsed < current->cycle_quota) {
+			current->cycle_quota -= elapsed;
+		}
+		else {
+			current->cycle_quota = 0;
+			cpu->quantum_end = true;
+		}
 	}
-	else {
-		current->cycle_quota = 0;
-		cpu->quantum_end = true;
-		KeInsertQueueDpc(&cpu->scheduler.dpc, nullptr, nullptr);
+
+	if (now_ns >= cpu->timer_queue.next_expiry_ns.load(hz::memory_order::relaxed)) {
+		KeInsertQueueDpc(&cpu->timer_queue.dpc, nullptr, nullptr);
+	}
+
+	// a stopped tick only fires for a sleeper, a timer or the idle limit, the dpc decides when the next one comes.
+	// threads woken by other cpus without an ipi are queued on the next tick
+	if (cpu->quantum_end ||
+		scheduler.tick_stopped ||
+		now_ns >= scheduler.next_sleep_ns.load(hz::memory_order::relaxed) ||
+		scheduler.remote_wakes.load(hz::memory_order::relaxed)) {
+		KeInsertQueueDpc(&scheduler.dpc, nullptr, nullptr);
 	}
 
-	cpu->tick_source->oneshot(Scheduler::CLOCK_INTERVAL_MS * 1000);
+	scheduler.program_tick(cpu, now_ns);
+}
+
+// sent by other cpus when they wake a thread that should preempt the current one,
+// the scheduler dpc drains the wake list
+bool Scheduler::on_reschedule_ipi(KINTERRUPT*, void*) {
+	auto* cpu = get_current_cpu();
+	KeInsertQueueDpc(&cpu->scheduler.dpc, nullptr, nullptr);
+	return true;
 }
 
+KINTERRUPT RESCHEDULE_IRQ_HANDLER {
+	.fn = Scheduler::on_reschedule_ipi
+};
+
 void sched_init() {
 	auto* cpu = get_current_cpu();
 
@@ -355,5 +687,7 @@ void sched_init() {
 		false,
 		sched_thread_destroyer,
 		&cpu->scheduler};
+	// it works on the queue of its own cpu so it can't be moved to another one
+	destroyer_thread->affinity = 1ULL << cpu->number;
 	cpu->scheduler.queue(cpu, destroyer_thread);
 }
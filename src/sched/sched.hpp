@@ -9,6 +9,9 @@
 #include <hz/list.hpp>
 #include <hz/new.hpp>
 #include <hz/container_of.hpp>
+#include <hz/atomic.hpp>
+
+struct KINTERRUPT;
 
 struct Scheduler {
 	explicit Scheduler(Cpu* cpu);
@@ -17,24 +20,58 @@ struct Scheduler {
 
 	void block(ThreadStatus status);
 
-	bool unblock(Thread* thread) REQUIRES(thread->lock);
+	// increment is the priority boost for the woken thread
+	bool unblock(Thread* thread, i32 increment) REQUIRES(thread->lock);
 	void sleep(u64 ns);
+	// sleeps until the clock source reaches deadline_ns
+	void sleep_until(u64 deadline_ns);
 
 	void queue(Cpu* cpu, Thread* thread) EXCLUDES(thread->lock);
 
 	static void on_timer(Cpu* cpu);
+	static bool on_reschedule_ipi(KINTERRUPT* irq, void* ctx);
 
 	void handle_quantum_end(Cpu* cpu);
 
+	// reprograms the tick for a timer that was added on the current cpu
+	void timer_added(Cpu* cpu) EXCLUDES(lock);
+
+	// the least loaded cpu the affinity allows, used for placing new threads
+	static Cpu* select_cpu(KAFFINITY affinity);
+
 	static constexpr usize REALTIME_START = 16;
 	static constexpr usize CLOCK_INTERVAL_MS = 15;
 	static constexpr usize QUANTUM_CLOCK_INTERVALS = 2;
+	// busy cpus look for an imbalance once per this many quantum ends, idle ones on every one
+	static constexpr usize BALANCE_INTERVAL_QUANTUMS = 4;
+	// the difference in ready threads needed before a busy cpu pulls one from another cpu
+	static constexpr u32 BALANCE_IMBALANCE = 2;
+	// the longest a cpu with nothing to switch to goes without a tick, threads woken by other
+	// cpus that don't preempt the current one are only noticed on the next tick
+	static constexpr usize NOHZ_MAX_SLEEP_MS = 100;
+	// ready threads that haven't run for this long are boosted to the highest non-realtime level
+	static constexpr usize STARVATION_MS = 4000;
+
+	// set when the periodic tick is stopped because there is nothing to switch to, only written
+	// by the owning cpu. other cpus read it atomically when pushing to the wake list
+	bool tick_stopped {};
+	// when the next periodic tick is due, only meaningful while the tick isn't stopped
+	u64 next_tick_ns {};
+	// the first sleeper expiry, read without the lock by the timer interrupt
+	hz::atomic<u64> next_sleep_ns {UINT64_MAX};
 
 private:
 	friend void sched_thread_destroyer(void* arg);
 
 	void queue_private(Cpu* cpu, Thread* thread) REQUIRES(lock, thread->lock);
 	void update_schedule(Cpu* cpu) REQUIRES(lock);
+	void drain_remote_wakes(Cpu* cpu) REQUIRES(lock);
+	void set_current(Cpu* cpu, Thread* thread) REQUIRES(lock);
+	bool steal(Cpu* cpu, u32 min_imbalance) REQUIRES(lock);
+	void boost_starved(Cpu* cpu) REQUIRES(lock);
+	void update_tick(Cpu* cpu) REQUIRES(lock);
+	void program_tick(Cpu* cpu, u64 now);
+	[[nodiscard]] u32 get_load(const Cpu* cpu) const;
 
 	struct Level {
 		hz::list<Thread, &Thread::hook> threads;
@@ -56,6 +93,25 @@ private:
 	};
 
 	static usize get_thread_level(Thread* thread) {
+		auto base = get_base_level(thread);
+		// realtime threads are never boosted and boosts never reach the realtime levels
+		if (base >= REALTIME_START) {
+			return base;
+		}
+
+		auto level = base + thread->priority_boost;
+		return level < REALTIME_START ? level : REALTIME_START - 1;
+	}
+
+	// a starvation boost only lasts while the thread runs
+	static void end_starvation_boost(Thread* thread) {
+		if (thread->starvation_boost) {
+			thread->priority_boost = 0;
+			thread->starvation_boost = false;
+		}
+	}
+
+	static usize get_base_level(Thread* thread) {
 		if (thread->priority == ThreadPriority::Idle) {
 			if (thread->process->priority == ProcessPriority::RealTime) {
 				return 16;
@@ -80,7 +136,16 @@ private:
 
 	Level levels[32] GUARDED_BY(lock) {};
 	u32 ready_summary GUARDED_BY(lock) {};
-	hz::list<Thread, &Thread::hook> sleeping_threads GUARDED_BY(lock) {};
+	// modified with the lock held, read without it by other cpus when balancing.
+	// threads in the wake list are counted too
+	hz::atomic<u32> ready_count {};
+	// the level of the running thread or 0 for the idle thread, read by other cpus
+	// that wake threads without dereferencing the thread the cpu is running
+	hz::atomic<u32> current_level {};
+	usize quantums_since_balance GUARDED_BY(lock) {};
+	TimerWheel sleep_timers GUARDED_BY(lock) {};
+	// threads woken by other cpus, pushed without the lock and drained by the owning cpu
+	hz::atomic<Thread*> remote_wakes {};
 	hz::list<Thread, &Thread::hook> destroy_queue GUARDED_BY(destroy_lock) {};
 	KSPIN_LOCK lock {};
 	KSPIN_LOCK destroy_lock {};
@@ -19,7 +19,7 @@ i32 KeReleaseSemaphore(KSEMAPHORE* semaphore, KPRIORITY increment, i32 adjustmen
 	auto old = KfRaiseIrql(DISPATCH_LEVEL);
 	acquire_dispatch_header_lock(&semaphore->header);
 
-	dispatch_header_queue_one_waiter(&semaphore->header);
+	dispatch_header_queue_one_waiter(&semaphore->header, increment);
 
 	release_dispatch_header_lock(&semaphore->header);
 	KeLowerIrql(old);
@@ -6,6 +6,7 @@
 #include "apc.hpp"
 #include "arch/irq.hpp"
 #include "process.hpp"
+#include "dev/clock.hpp"
 
 Thread::Thread(kstd::wstring_view name, Cpu* cpu, Process* process)
 	: ArchThread {}, name {name}, cpu {cpu}, process {process} {
@@ -21,17 +22,24 @@ Thread::Thread(kstd::wstring_view name, Cpu* cpu, Process* process, bool user, v
 	process->add_thread(this);
 
 	if (user) {
-		UniqueKernelMapping tmp_teb_mapping;
 		teb = reinterpret_cast<TEB*>(process->allocate(
 			nullptr,
 			sizeof(TEB),
 			PageFlags::Read | PageFlags::Write,
-			MappingFlags::Backed,
-			&tmp_teb_mapping));
+			MappingFlags::DemandZero,
+			nullptr));
 		assert(teb);
-		auto* tmp_teb = new (tmp_teb_mapping.data()) TEB {};
+
+		// only the first page is initialized here, the rest is committed on first use
+		static_assert(offsetof(TEB, ProcessEnvironmentBlock) < PAGE_SIZE);
+		auto status = process->commit_page(reinterpret_cast<usize>(teb));
+		assert(status);
+		auto* tmp_teb = to_virt<TEB>(process->page_map.get_phys(reinterpret_cast<usize>(teb)));
 		tmp_teb->ProcessEnvironmentBlock = process->peb;
 		tmp_teb->NtTib.Self = &teb->NtTib;
+		tmp_teb->NtTib.StackBase = reinterpret_cast<PVOID>(user_stack_base + user_stack_size);
+		// the kernel grows the stack without updating the teb, so the limit covers the whole reservation
+		tmp_teb->NtTib.StackLimit = reinterpret_cast<PVOID>(user_stack_base);
 	}
 }
 
@@ -82,10 +90,8 @@ NTAPI void KeDelayExecutionThread(
 	thread->wait_mode = wait_mode;
 	thread->wait_status = STATUS_SUCCESS;
 
-	assert(interval->QuadPart <= 0);
-	u64 ns = static_cast<u64>(-interval->QuadPart) * 100;
-
-	thread->cpu->scheduler.sleep(ns);
+	// negative intervals are relative, positive ones absolute system times
+	thread->cpu->scheduler.sleep_until(due_time_to_ns(interval->QuadPart));
 	KeLowerIrql(old);
 }
 
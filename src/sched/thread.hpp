@@ -7,6 +7,7 @@
 #include "descriptors.hpp"
 #include "string.hpp"
 #include "handle_table.hpp"
+#include "timer_wheel.hpp"
 #include <hz/list.hpp>
 #include <hz/optional.hpp>
 
@@ -70,10 +71,17 @@ struct Thread : public ArchThread {
 	u64 last_run_start_cycles {};
 	u64 cycle_quota {};
 	ThreadPriority priority {ThreadPriority::Normal};
+	// levels above the base level given on wakeup, decays by one on every quantum end
+	u8 priority_boost {};
+	// the boost was given for starving and is dropped after one quantum
+	bool starvation_boost {};
+	u64 ready_since_cycles {};
 	ThreadStatus status {};
 	KSPIN_LOCK lock {};
 	bool dont_block {};
-	u64 sleep_end_ns {};
+	TimerWheelEntry sleep_timer {};
+	// links the thread into the remote wake list of its cpu
+	Thread* remote_wake_next {};
 	KPROCESSOR_MODE previous_mode {};
 	KAPC_STATE apc_state {};
 	KPROCESSOR_MODE wait_mode {};
@@ -94,7 +102,7 @@ struct Thread : public ArchThread {
 };
 
 #ifdef __x86_64__
-static_assert(offsetof(Thread, lock) == 176);
+static_assert(offsetof(Thread, lock) == 184);
 #else
 #error unsupported architecture
 #endif
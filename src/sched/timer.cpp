@@ -0,0 +1,418 @@
+#include "timer.hpp"
+#include "wait.hpp"
+#include "arch/cpu.hpp"
+#include "arch/irql.hpp"
+#include "assert.hpp"
+#include "dev/clock.hpp"
+#include "fs/object.hpp"
+#include "sys/misc.hpp"
+#include "sys/user_access.hpp"
+#include "arch/arch_syscall.hpp"
+#include "utils/except.hpp"
+#include "rtl.hpp"
+#include <hz/bit.hpp>
+#include <hz/container_of.hpp>
+
+OBJECT_TYPE* ExTimerObjectType = nullptr;
+
+void timer_init() {
+	UNICODE_STRING name = RTL_CONSTANT_STRING(u"Timer");
+	OBJECT_TYPE_INITIALIZER init {};
+	init.delete_proc = [](PVOID object) {
+		KeCancelTimer(static_cast<KTIMER*>(object));
+	};
+	auto status = ObCreateObjectType(&name, &init, nullptr, &ExTimerObjectType);
+	assert(NT_SUCCESS(status));
+}
+
+// rounds the expiry up to the coarsest power of two boundary the tolerance allows,
+// timers with close deadlines end up expiring in the same interrupt
+static u64 coalesce(u64 expiry_ns, u32 tolerable_delay) {
+	if (!tolerable_delay) {
+		return expiry_ns;
+	}
+
+	u64 tolerance = u64 {tolerable_delay} * NS_IN_MS;
+	u64 granularity = u64 {1} << (hz::bit_width(tolerance) - 1);
+	if (expiry_ns > UINT64_MAX - (granularity - 1)) {
+		return UINT64_MAX;
+	}
+	return (expiry_ns + granularity - 1) & ~(granularity - 1);
+}
+
+static void timer_signal(KTIMER* timer) {
+	auto* state = reinterpret_cast<hz::atomic<i32>*>(&timer->header.signal_state);
+
+	acquire_dispatch_header_lock(&timer->header);
+	if (timer->header.type == TimerSynchronizationObject) {
+		state->store(1, hz::memory_order::release);
+		dispatch_header_queue_one_waiter(&timer->header, 0);
+	}
+	else {
+		state->store(INT32_MAX, hz::memory_order::release);
+		dispatch_header_queue_all_waiters(&timer->header, 0);
+	}
+	release_dispatch_header_lock(&timer->header);
+
+	if (timer->dpc) {
+		auto time = system_time_get();
+		KeInsertQueueDpc(
+			timer->dpc,
+			reinterpret_cast<void*>(time & 0xFFFFFFFF),
+			reinterpret_cast<void*>(time >> 32));
+	}
+}
+
+TimerQueue::TimerQueue(Cpu* cpu) : number {cpu->number} {
+	// KeInitializeDpc can't be used here as the current cpu is not yet initialized
+	dpc.importance = static_cast<u8>(DpcImportance::Medium);
+	dpc.number = cpu->number;
+	dpc.deferred_routine = [](KDPC*, void* deferred_ctx, void*, void*) {
+		auto* cpu = static_cast<Cpu*>(deferred_ctx);
+		cpu->timer_queue.run(CLOCK_SOURCE->get_ns());
+	};
+	dpc.deferred_ctx = cpu;
+}
+
+NO_THREAD_SAFETY_ANALYSIS
+bool TimerQueue::set(KTIMER* timer, u64 expiry_ns, u32 period, u32 tolerable_delay, KDPC* dpc) {
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	while (true) {
+		auto processor = __atomic_load_n(&timer->processor, __ATOMIC_RELAXED);
+		auto& old_queue = CPUS[processor]->timer_queue;
+
+		// the locks are always taken in cpu order
+		if (old_queue.number < number) {
+			KeAcquireSpinLockAtDpcLevel(&old_queue.lock);
+			KeAcquireSpinLockAtDpcLevel(&lock);
+		}
+		else {
+			KeAcquireSpinLockAtDpcLevel(&lock);
+			if (&old_queue != this) {
+				KeAcquireSpinLockAtDpcLevel(&old_queue.lock);
+			}
+		}
+
+		// the timer was moved to another queue while the locks were being acquired
+		if (timer->processor != processor) {
+			if (&old_queue != this) {
+				KeReleaseSpinLockFromDpcLevel(&old_queue.lock);
+			}
+			KeReleaseSpinLockFromDpcLevel(&lock);
+			continue;
+		}
+
+		bool queued = timer->entry.queued;
+		if (queued) {
+			old_queue.wheel.remove(&timer->entry);
+			if (&old_queue != this) {
+				old_queue.next_expiry_ns.store(old_queue.wheel.next_expiry_ns(), hz::memory_order::relaxed);
+			}
+		}
+
+		reinterpret_cast<hz::atomic<i32>*>(&timer->header.signal_state)->store(0, hz::memory_order::relaxed);
+		timer->entry.expiry_ns = expiry_ns;
+		timer->dpc = dpc;
+		timer->period = period;
+		timer->tolerable_delay = tolerable_delay;
+		__atomic_store_n(&timer->processor, number, __ATOMIC_RELAXED);
+
+		wheel.insert(&timer->entry);
+		next_expiry_ns.store(wheel.next_expiry_ns(), hz::memory_order::relaxed);
+
+		if (&old_queue != this) {
+			KeReleaseSpinLockFromDpcLevel(&old_queue.lock);
+		}
+		KeReleaseSpinLockFromDpcLevel(&lock);
+		return queued;
+	}
+}
+
+// the timers are signalled with the queue lock held so that a cancelled timer is never touched again
+void TimerQueue::run(u64 now_ns) {
+	assert(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	KeAcquireSpinLockAtDpcLevel(&lock);
+
+	TimerWheel::List expired {};
+	wheel.advance(now_ns, expired);
+	while (auto* entry = expired.pop_front()) {
+		auto* timer = hz::container_of(entry, &KTIMER::entry);
+
+		if (timer->period) {
+			// periods missed while the cpu was late are skipped
+			u64 period_ns = u64 {timer->period} * NS_IN_MS;
+			u64 next = entry->expiry_ns + period_ns;
+			if (next <= now_ns) {
+				next = now_ns + period_ns;
+			}
+			entry->expiry_ns = coalesce(next, timer->tolerable_delay);
+			wheel.insert(entry);
+		}
+
+		timer_signal(timer);
+	}
+
+	next_expiry_ns.store(wheel.next_expiry_ns(), hz::memory_order::relaxed);
+
+	KeReleaseSpinLockFromDpcLevel(&lock);
+}
+
+// returns whether the timer was queued
+bool timer_remove(KTIMER* timer) {
+	while (true) {
+		auto& queue = CPUS[timer->processor]->timer_queue;
+		KeAcquireSpinLockAtDpcLevel(&queue.lock);
+
+		// the timer was moved to another queue while the lock was being acquired
+		if (timer->processor != queue.number) {
+			KeReleaseSpinLockFromDpcLevel(&queue.lock);
+			continue;
+		}
+
+		bool queued = timer->entry.queued;
+		if (queued) {
+			queue.wheel.remove(&timer->entry);
+			queue.next_expiry_ns.store(queue.wheel.next_expiry_ns(), hz::memory_order::relaxed);
+		}
+
+		KeReleaseSpinLockFromDpcLevel(&queue.lock);
+		return queued;
+	}
+}
+
+NTAPI void KeInitializeTimer(KTIMER* timer) {
+	KeInitializeTimerEx(timer, TIMER_TYPE::Notification);
+}
+
+NTAPI void KeInitializeTimerEx(KTIMER* timer, TIMER_TYPE type) {
+	timer->header.type = type == TIMER_TYPE::Synchronization ? TimerSynchronizationObject : TimerNotificationObject;
+	timer->header.reserved.store(0, hz::memory_order::relaxed);
+	timer->header.signal_state = 0;
+	InitializeListHead(&timer->header.wait_list_head);
+	timer->entry = {};
+	timer->dpc = nullptr;
+	timer->processor = get_current_cpu()->number;
+	timer->period = 0;
+	timer->tolerable_delay = 0;
+}
+
+NTAPI BOOLEAN KeSetTimer(KTIMER* timer, LARGE_INTEGER due_time, KDPC* dpc) {
+	return KeSetCoalescableTimer(timer, due_time, 0, 0, dpc);
+}
+
+NTAPI BOOLEAN KeSetTimerEx(KTIMER* timer, LARGE_INTEGER due_time, LONG period, KDPC* dpc) {
+	assert(period >= 0);
+	return KeSetCoalescableTimer(timer, due_time, static_cast<ULONG>(period), 0, dpc);
+}
+
+// the timer is put into the queue of the current cpu
+NTAPI BOOLEAN KeSetCoalescableTimer(
+	KTIMER* timer,
+	LARGE_INTEGER due_time,
+	ULONG period,
+	ULONG tolerable_delay,
+	KDPC* dpc) {
+	auto expiry = coalesce(due_time_to_ns(due_time.QuadPart), tolerable_delay);
+
+	auto old = KfRaiseIrql(DISPATCH_LEVEL);
+
+	auto* cpu = get_current_cpu();
+	bool was_queued = cpu->timer_queue.set(timer, expiry, period, tolerable_delay, dpc);
+
+	auto now = CLOCK_SOURCE->get_ns();
+	if (expiry <= now) {
+		cpu->timer_queue.run(now);
+	}
+	else {
+		cpu->scheduler.timer_added(cpu);
+	}
+
+	KeLowerIrql(old);
+	return was_queued;
+}
+
+NTAPI BOOLEAN KeCancelTimer(KTIMER* timer) {
+	auto old = KfRaiseIrql(DISPATCH_LEVEL);
+	bool was_queued = timer_remove(timer);
+	KeLowerIrql(old);
+	return was_queued;
+}
+
+NTAPI BOOLEAN KeReadStateTimer(KTIMER* timer) {
+	return reinterpret_cast<hz::atomic<i32>*>(
+		&timer->header.signal_state)->load(hz::memory_order::relaxed) > 0;
+}
+
+NTAPI NTSTATUS NtCreateTimer(
+	PHANDLE timer_handle,
+	ACCESS_MASK desired_access,
+	OBJECT_ATTRIBUTES* object_attribs,
+	TIMER_TYPE timer_type) {
+	if (timer_type != TIMER_TYPE::Notification && timer_type != TIMER_TYPE::Synchronization) {
+		return STATUS_INVALID_PARAMETER_4;
+	}
+
+	auto mode = ExGetPreviousMode();
+
+	PVOID object;
+	auto status = ObCreateObject(
+		mode,
+		ExTimerObjectType,
+		object_attribs,
+		mode,
+		nullptr,
+		sizeof(KTIMER),
+		0,
+		sizeof(KTIMER),
+		&object);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	auto* timer = static_cast<KTIMER*>(object);
+	KeInitializeTimerEx(timer, timer_type);
+
+	HANDLE handle;
+	status = ObInsertObject(
+		timer,
+		nullptr,
+		desired_access,
+		0,
+		nullptr,
+		&handle);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (mode == UserMode) {
+		__try {
+			enable_user_access();
+			ProbeForWrite(timer_handle, sizeof(HANDLE), alignof(HANDLE));
+			*timer_handle = handle;
+			disable_user_access();
+		}
+		__except (1) {
+			disable_user_access();
+			return GetExceptionCode();
+		}
+	}
+	else {
+		*timer_handle = handle;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+// timer apcs aren't supported, user mode has to wait on the timer instead
+NTAPI NTSTATUS NtSetTimer(
+	HANDLE timer_handle,
+	PLARGE_INTEGER due_time,
+	PTIMER_APC_ROUTINE timer_apc_routine,
+	PVOID,
+	BOOLEAN,
+	LONG period,
+	BOOLEAN* previous_state) {
+	if (timer_apc_routine) {
+		return STATUS_NOT_IMPLEMENTED;
+	}
+	else if (period < 0) {
+		return STATUS_INVALID_PARAMETER_6;
+	}
+
+	auto mode = ExGetPreviousMode();
+
+	LARGE_INTEGER due {};
+	if (mode == UserMode) {
+		__try {
+			enable_user_access();
+			ProbeForRead(due_time, sizeof(LARGE_INTEGER), alignof(LARGE_INTEGER));
+			due = *due_time;
+			disable_user_access();
+		}
+		__except (1) {
+			disable_user_access();
+			return GetExceptionCode();
+		}
+	}
+	else {
+		due = *due_time;
+	}
+
+	KTIMER* timer;
+	auto status = ObReferenceObjectByHandle(
+		timer_handle,
+		TIMER_MODIFY_STATE,
+		ExTimerObjectType,
+		mode,
+		reinterpret_cast<PVOID*>(&timer),
+		nullptr);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	BOOLEAN state = KeReadStateTimer(timer);
+	KeSetTimerEx(timer, due, period, nullptr);
+	ObfDereferenceObject(timer);
+
+	if (previous_state) {
+		if (mode == UserMode) {
+			__try {
+				enable_user_access();
+				ProbeForWrite(previous_state, sizeof(BOOLEAN), alignof(BOOLEAN));
+				*previous_state = state;
+				disable_user_access();
+			}
+			__except (1) {
+				disable_user_access();
+				return GetExceptionCode();
+			}
+		}
+		else {
+			*previous_state = state;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTAPI NTSTATUS NtCancelTimer(HANDLE timer_handle, BOOLEAN* current_state) {
+	auto mode = ExGetPreviousMode();
+
+	KTIMER* timer;
+	auto status = ObReferenceObjectByHandle(
+		timer_handle,
+		TIMER_MODIFY_STATE,
+		ExTimerObjectType,
+		mode,
+		reinterpret_cast<PVOID*>(&timer),
+		nullptr);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	KeCancelTimer(timer);
+	BOOLEAN state = KeReadStateTimer(timer);
+	ObfDereferenceObject(timer);
+
+	if (current_state) {
+		if (mode == UserMode) {
+			__try {
+				enable_user_access();
+				ProbeForWrite(current_state, sizeof(BOOLEAN), alignof(BOOLEAN));
+				*current_state = state;
+				disable_user_access();
+			}
+			__except (1) {
+				disable_user_access();
+				return GetExceptionCode();
+			}
+		}
+		else {
+			*current_state = state;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include "dispatch_header.hpp"
+#include "dpc.hpp"
+#include "timer_wheel.hpp"
+#include "utils/spinlock.hpp"
+#include "fs/object.hpp"
+#include <hz/atomic.hpp>
+
+#define TIMER_QUERY_STATE 1
+#define TIMER_MODIFY_STATE 2
+
+enum class TIMER_TYPE {
+	Notification,
+	Synchronization
+};
+
+struct KTIMER {
+	DISPATCHER_HEADER header;
+	TimerWheelEntry entry;
+	KDPC* dpc;
+	// the cpu whose queue the timer was last inserted into
+	u32 processor;
+	// in milliseconds, 0 for one shot timers
+	u32 period;
+	// in milliseconds, how late the timer may expire to share the expiry with other timers
+	u32 tolerable_delay;
+};
+
+// the layout is shared with drivers through wdm.h
+static_assert(sizeof(KTIMER) == 80);
+
+struct Cpu;
+
+// the timers of a cpu, expired from its timer interrupt through a dpc
+struct TimerQueue {
+	explicit TimerQueue(Cpu* cpu);
+
+	// moves the timer into this queue with new parameters, returns whether it was queued before.
+	// the old and the new queue are both locked so that a concurrent set or cancel can't
+	// observe the timer in neither of them
+	bool set(KTIMER* timer, u64 expiry_ns, u32 period, u32 tolerable_delay, KDPC* dpc);
+	// expires every timer that is due at now
+	void run(u64 now_ns);
+
+	// the earliest expiry in the queue, read without the lock by the timer interrupt
+	hz::atomic<u64> next_expiry_ns {UINT64_MAX};
+	KDPC dpc {};
+
+private:
+	friend bool timer_remove(KTIMER* timer);
+
+	TimerWheel wheel GUARDED_BY(lock) {};
+	KSPIN_LOCK lock {};
+	u32 number;
+};
+
+NTAPI extern "C" void KeInitializeTimer(KTIMER* timer);
+NTAPI extern "C" void KeInitializeTimerEx(KTIMER* timer, TIMER_TYPE type);
+NTAPI extern "C" BOOLEAN KeSetTimer(KTIMER* timer, LARGE_INTEGER due_time, KDPC* dpc);
+NTAPI extern "C" BOOLEAN KeSetTimerEx(KTIMER* timer, LARGE_INTEGER due_time, LONG period, KDPC* dpc);
+NTAPI extern "C" BOOLEAN KeSetCoalescableTimer(
+	KTIMER* timer,
+	LARGE_INTEGER due_time,
+	ULONG period,
+	ULONG tolerable_delay,
+	KDPC* dpc);
+NTAPI extern "C" BOOLEAN KeCancelTimer(KTIMER* timer);
+NTAPI extern "C" BOOLEAN KeReadStateTimer(KTIMER* timer);
+
+using PTIMER_APC_ROUTINE = void (*)(PVOID timer_ctx, ULONG timer_low_value, LONG timer_high_value);
+
+NTAPI extern "C" NTSTATUS NtCreateTimer(
+	PHANDLE timer_handle,
+	ACCESS_MASK desired_access,
+	OBJECT_ATTRIBUTES* object_attribs,
+	TIMER_TYPE timer_type);
+NTAPI extern "C" NTSTATUS NtSetTimer(
+	HANDLE timer_handle,
+	PLARGE_INTEGER due_time,
+	PTIMER_APC_ROUTINE timer_apc_routine,
+	PVOID timer_ctx,
+	BOOLEAN resume_timer,
+	LONG period,
+	BOOLEAN* previous_state);
+NTAPI extern "C" NTSTATUS NtCancelTimer(HANDLE timer_handle, BOOLEAN* current_state);
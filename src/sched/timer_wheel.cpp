@@ -0,0 +1,179 @@
+#include "timer_wheel.hpp"
+#include "assert.hpp"
+#include <hz/algorithm.hpp>
+#include <hz/bit.hpp>
+
+void TimerWheel::insert_at_clock(TimerWheelEntry* entry) {
+	u64 expires = entry->expiry_ns >> UNIT_SHIFT;
+	if (expires < clock) {
+		expires = clock;
+	}
+
+	u64 delta = expires - clock;
+	usize level = 0;
+	while (level + 1 < LEVELS && delta >= u64 {1} << (LEVEL_SHIFT * (level + 1))) {
+		++level;
+	}
+	// entries beyond the last level wait in it and are put back when it is cascaded
+	if (delta >= u64 {1} << (LEVEL_SHIFT * LEVELS)) {
+		expires = clock + (u64 {1} << (LEVEL_SHIFT * LEVELS)) - 1;
+	}
+
+	auto index = (expires >> (LEVEL_SHIFT * level)) & (SLOTS - 1);
+	entry->level = static_cast<u8>(level);
+	entry->index = static_cast<u8>(index);
+	levels[level].slots[index].push(entry);
+	levels[level].occupied |= u64 {1} << index;
+}
+
+void TimerWheel::insert(TimerWheelEntry* entry) {
+	assert(!entry->queued);
+	entry->queued = true;
+	++count;
+	insert_at_clock(entry);
+}
+
+void TimerWheel::remove(TimerWheelEntry* entry) {
+	assert(entry->queued);
+	auto& level = levels[entry->level];
+	auto& slot = level.slots[entry->index];
+	slot.remove(entry);
+	if (slot.is_empty()) {
+		level.occupied &= ~(u64 {1} << entry->index);
+	}
+	entry->queued = false;
+	--count;
+}
+
+// redistributes the slots of the higher levels that start at the current unit
+void TimerWheel::cascade() {
+	for (usize i = 1; i < LEVELS; ++i) {
+		auto index = (clock >> (LEVEL_SHIFT * i)) & (SLOTS - 1);
+		auto& level = levels[i];
+		if (level.occupied & u64 {1} << index) {
+			level.occupied &= ~(u64 {1} << index);
+			auto& slot = level.slots[index];
+			while (auto* entry = slot.pop_front()) {
+				insert_at_clock(entry);
+			}
+		}
+
+		if (index) {
+			break;
+		}
+	}
+}
+
+// the first unit after the current one at which an occupied slot of a higher level is cascaded,
+// the current slot of every level was already cascaded so its entries belong to the next round
+u64 TimerWheel::next_cascade() const {
+	u64 best = UINT64_MAX;
+	for (usize i = 1; i < LEVELS; ++i) {
+		auto occupied = levels[i].occupied;
+		if (!occupied) {
+			continue;
+		}
+
+		u64 block = clock >> (LEVEL_SHIFT * i);
+		auto index = block & (SLOTS - 1);
+		u64 later = index == SLOTS - 1 ? 0 : occupied & (~u64 {0} << (index + 1));
+		u64 start;
+		if (later) {
+			start = (block & ~u64 {SLOTS - 1}) + hz::countr_zero(later);
+		}
+		else {
+			start = (block & ~u64 {SLOTS - 1}) + hz::countr_zero(occupied) + SLOTS;
+		}
+
+		best = hz::min(best, start << (LEVEL_SHIFT * i));
+	}
+
+	return best;
+}
+
+void TimerWheel::advance(u64 now_ns, List& expired) {
+	u64 target = now_ns >> UNIT_SHIFT;
+
+	while (true) {
+		if (!count) {
+			clock = hz::max(clock, target);
+			return;
+		}
+
+		auto index = clock & (SLOTS - 1);
+		auto& first = levels[0];
+		if (first.occupied & u64 {1} << index) {
+			auto& slot = first.slots[index];
+
+			// only the current unit can have entries that haven't expired yet
+			List pending {};
+			while (auto* entry = slot.pop_front()) {
+				if (clock < target || entry->expiry_ns <= now_ns) {
+					entry->queued = false;
+					--count;
+					expired.push(entry);
+				}
+				else {
+					pending.push(entry);
+				}
+			}
+			while (auto* entry = pending.pop_front()) {
+				slot.push(entry);
+			}
+
+			if (slot.is_empty()) {
+				first.occupied &= ~(u64 {1} << index);
+			}
+		}
+
+		if (clock >= target) {
+			break;
+		}
+
+		// skip to the next occupied slot or the start of the next block, whichever comes first,
+		// without anything left in the first level the blocks up to the next cascade are empty
+		u64 next;
+		if (first.occupied) {
+			next = (clock | (SLOTS - 1)) + 1;
+			u64 later = index == SLOTS - 1 ? 0 : first.occupied & (~u64 {0} << (index + 1));
+			if (later) {
+				next = (clock & ~u64 {SLOTS - 1}) + hz::countr_zero(later);
+			}
+		}
+		else {
+			next = next_cascade();
+		}
+
+		clock = hz::min(next, target);
+		if (!(clock & (SLOTS - 1))) {
+			cascade();
+		}
+	}
+}
+
+u64 TimerWheel::next_expiry_ns() const {
+	if (!count) {
+		return UINT64_MAX;
+	}
+
+	u64 best = UINT64_MAX;
+
+	// the first level has the exact expiry times, the first occupied slot from the current unit
+	// on has the earliest ones
+	if (auto occupied = levels[0].occupied) {
+		auto index = clock & (SLOTS - 1);
+		auto rotated = index ? (occupied >> index | occupied << (SLOTS - index)) : occupied;
+		auto slot = (index + hz::countr_zero(rotated)) & (SLOTS - 1);
+		for (auto& entry : levels[0].slots[slot]) {
+			best = hz::min(best, entry.expiry_ns);
+		}
+	}
+
+	// the higher levels only need to be cascaded in time
+	auto cascade_at = next_cascade();
+	if (cascade_at != UINT64_MAX) {
+		best = hz::min(best, cascade_at << UNIT_SHIFT);
+	}
+
+	return best;
+}
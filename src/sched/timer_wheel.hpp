@@ -0,0 +1,51 @@
+#pragma once
+#include "types.hpp"
+#include <hz/list.hpp>
+
+struct TimerWheelEntry {
+	hz::list_hook hook {};
+	u64 expiry_ns {};
+	u8 level {};
+	u8 index {};
+	bool queued {};
+};
+
+// a hierarchical timing wheel with constant time insertion and removal,
+// the first level has a slot for every 65us and each next one covers 64 slots of the previous one
+struct TimerWheel {
+	using List = hz::list<TimerWheelEntry, &TimerWheelEntry::hook>;
+
+	void insert(TimerWheelEntry* entry);
+	void remove(TimerWheelEntry* entry);
+
+	// moves every entry that expired at now to expired
+	void advance(u64 now_ns, List& expired);
+
+	// the earliest time advance has to be called at to not miss an entry, UINT64_MAX if there are none
+	[[nodiscard]] u64 next_expiry_ns() const;
+
+	[[nodiscard]] bool is_empty() const {
+		return !count;
+	}
+
+private:
+	static constexpr u32 UNIT_SHIFT = 16;
+	static constexpr u32 LEVEL_SHIFT = 6;
+	static constexpr usize SLOTS = 1 << LEVEL_SHIFT;
+	static constexpr usize LEVELS = 6;
+
+	struct Level {
+		List slots[SLOTS] {};
+		// a bit for every slot that has entries
+		u64 occupied {};
+	};
+
+	void insert_at_clock(TimerWheelEntry* entry);
+	void cascade();
+	[[nodiscard]] u64 next_cascade() const;
+
+	Level levels[LEVELS] {};
+	// the unit that is being processed, every level has already been cascaded for it
+	u64 clock {};
+	usize count {};
+};
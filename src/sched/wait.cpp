@@ -2,13 +2,14 @@
 #include "arch/cpu.hpp"
 #include "assert.hpp"
 #include "sys/misc.hpp"
+#include "dev/clock.hpp"
 #include "utils/except.hpp"
 #include "arch/arch_syscall.hpp"
 #include "mutex.hpp"
 #include "atomic.hpp"
 #include <hz/container_of.hpp>
 
-void dispatch_header_queue_one_waiter(DISPATCHER_HEADER* header) {
+void dispatch_header_queue_one_waiter(DISPATCHER_HEADER* header, i32 increment) {
 	if (IsListEmpty(&header->wait_list_head)) {
 		return;
 	}
@@ -17,11 +18,11 @@ void dispatch_header_queue_one_waiter(DISPATCHER_HEADER* header) {
 	auto thread = block->thread;
 	block->thread = nullptr;
 	KIRQL old = KeAcquireSpinLockRaiseToDpc(&thread->lock);
-	thread->cpu->scheduler.unblock(thread);
+	thread->cpu->scheduler.unblock(thread, increment);
 	KeReleaseSpinLock(&thread->lock, old);
 }
 
-void dispatch_header_queue_all_waiters(DISPATCHER_HEADER* header) {
+void dispatch_header_queue_all_waiters(DISPATCHER_HEADER* header, i32 increment) {
 	KIRQL old = KfRaiseIrql(DISPATCH_LEVEL);
 
 	while (!IsListEmpty(&header->wait_list_head)) {
@@ -29,7 +30,7 @@ void dispatch_header_queue_all_waiters(DISPATCHER_HEADER* header) {
 		auto thread = block->thread;
 		block->thread = nullptr;
 		KeAcquireSpinLockAtDpcLevel(&thread->lock);
-		thread->cpu->scheduler.unblock(thread);
+		thread->cpu->scheduler.unblock(thread, increment);
 		KeReleaseSpinLockFromDpcLevel(&thread->lock);
 	}
 
@@ -47,9 +48,10 @@ NTAPI NTSTATUS KeWaitForMultipleObjects(
 	bool alertable,
 	i64* timeout,
 	KWAIT_BLOCK* wait_block_array) {
-	i64 real_timeout = 0;
+	// the deadline is fixed up front so that waking up early doesn't extend the wait
+	u64 deadline_ns = 0;
 	if (timeout) {
-		real_timeout = *timeout;
+		deadline_ns = due_time_to_ns(*timeout);
 	}
 
 	KWAIT_BLOCK builtin_block[THREAD_WAIT_OBJECTS];
@@ -232,23 +234,12 @@ NTAPI NTSTATUS KeWaitForMultipleObjects(
 	}
 
 	if (timeout) {
-		if (real_timeout == 0) {
+		if (CLOCK_SOURCE->get_ns() >= deadline_ns) {
 			status = STATUS_TIMEOUT;
 			goto cleanup;
 		}
 
-		if (real_timeout > 0) {
-			// todo
-			panic("absolute timeout is not supported");
-		}
-		real_timeout *= -1;
-		// timeout is in 100ns units
-		real_timeout *= 100;
-
-		auto value = real_timeout;
-		real_timeout = 0;
-
-		thread->cpu->scheduler.sleep(value);
+		thread->cpu->scheduler.sleep_until(deadline_ns);
 		goto again;
 	}
 	else {
@@ -29,8 +29,9 @@ enum KWAIT_REASON {
 	UserRequest
 };
 
-void dispatch_header_queue_one_waiter(DISPATCHER_HEADER* header) REQUIRES(header);
-void dispatch_header_queue_all_waiters(DISPATCHER_HEADER* header) REQUIRES(header);
+// increment is the priority boost for the woken threads
+void dispatch_header_queue_one_waiter(DISPATCHER_HEADER* header, i32 increment) REQUIRES(header);
+void dispatch_header_queue_all_waiters(DISPATCHER_HEADER* header, i32 increment) REQUIRES(header);
 NTAPI extern "C" NTSTATUS KeWaitForMultipleObjects(
 	u32 count,
 	void* objects[],
@@ -0,0 +1,276 @@
+#include "rtl.hpp"
+#include "types.hpp"
+#include "cstring.hpp"
+#include <hz/algorithm.hpp>
+
+namespace {
+	constexpr usize LZNT1_CHUNK_SIZE = 0x1000;
+	constexpr u16 LZNT1_SIGNATURE = 3 << 12;
+	constexpr u16 LZNT1_COMPRESSED = 1 << 15;
+	constexpr usize LZNT1_MIN_MATCH = 3;
+	constexpr usize LZNT1_HASH_SIZE = 0x1000;
+
+	// the split between the offset and the length of a back reference depends on
+	// how far into the chunk it is, offsets never need more bits than the position has
+	void lznt1_split(usize pos, u32& offset_shift, u32& length_mask) {
+		offset_shift = 12;
+		length_mask = 0xFFF;
+		for (usize i = pos - 1; i >= 0x10; i >>= 1) {
+			--offset_shift;
+			length_mask >>= 1;
+		}
+	}
+
+	u32 lznt1_hash(const u8* ptr) {
+		u32 value = ptr[0] | ptr[1] << 8 | ptr[2] << 16;
+		return (value * 2654435761U) >> 20 & (LZNT1_HASH_SIZE - 1);
+	}
+
+	// returns the size of the compressed data or 0 if it doesn't fit into cap
+	usize lznt1_compress_chunk(const u8* src, usize size, u8* dst, usize cap, i16* head) {
+		for (usize i = 0; i < LZNT1_HASH_SIZE; ++i) {
+			head[i] = -1;
+		}
+
+		usize out = 0;
+		usize pos = 0;
+		while (pos < size) {
+			if (out == cap) {
+				return 0;
+			}
+			usize flag_index = out++;
+			u8 flags = 0;
+
+			for (u32 bit = 0; bit < 8 && pos < size; ++bit) {
+				usize match_len = 0;
+				usize match_offset = 0;
+				u32 offset_shift = 12;
+				if (pos + LZNT1_MIN_MATCH <= size) {
+					auto hash = lznt1_hash(src + pos);
+					auto candidate = head[hash];
+					head[hash] = static_cast<i16>(pos);
+
+					if (candidate >= 0) {
+						u32 length_mask;
+						lznt1_split(pos, offset_shift, length_mask);
+						usize max_offset = usize {1} << (16 - offset_shift);
+						usize max_len = hz::min(usize {length_mask} + LZNT1_MIN_MATCH, size - pos);
+
+						auto offset = pos - static_cast<usize>(candidate);
+						if (offset <= max_offset) {
+							usize len = 0;
+							while (len < max_len && src[candidate + len] == src[pos + len]) {
+								++len;
+							}
+							if (len >= LZNT1_MIN_MATCH) {
+								match_len = len;
+								match_offset = offset;
+							}
+						}
+					}
+				}
+
+				if (match_len) {
+					if (cap - out < 2) {
+						return 0;
+					}
+					auto token = static_cast<u16>((match_offset - 1) << offset_shift | (match_len - LZNT1_MIN_MATCH));
+					dst[out++] = token & 0xFF;
+					dst[out++] = token >> 8;
+					flags |= 1 << bit;
+
+					for (usize i = 1; i < match_len && pos + i + LZNT1_MIN_MATCH <= size; ++i) {
+						head[lznt1_hash(src + pos + i)] = static_cast<i16>(pos + i);
+					}
+					pos += match_len;
+				}
+				else {
+					if (out == cap) {
+						return 0;
+					}
+					dst[out++] = src[pos++];
+				}
+			}
+
+			dst[flag_index] = flags;
+		}
+
+		return out;
+	}
+
+	// returns the amount of bytes written to dst or -1 if the chunk is malformed
+	isize lznt1_decompress_chunk(const u8* src, usize size, u8* dst, usize cap) {
+		usize in = 0;
+		usize out = 0;
+		while (in < size && out < cap) {
+			u8 flags = src[in++];
+			for (u32 bit = 0; bit < 8 && in < size && out < cap; ++bit) {
+				if (!(flags & 1 << bit)) {
+					dst[out++] = src[in++];
+					continue;
+				}
+
+				if (size - in < 2 || !out) {
+					return -1;
+				}
+				u16 token = src[in] | src[in + 1] << 8;
+				in += 2;
+
+				u32 offset_shift;
+				u32 length_mask;
+				lznt1_split(out, offset_shift, length_mask);
+				usize offset = (token >> offset_shift) + 1;
+				usize len = (token & length_mask) + LZNT1_MIN_MATCH;
+				if (offset > out) {
+					return -1;
+				}
+
+				// the source may overlap with the destination so this has to go byte by byte
+				len = hz::min(len, cap - out);
+				for (usize i = 0; i < len; ++i, ++out) {
+					dst[out] = dst[out - offset];
+				}
+			}
+		}
+
+		return static_cast<isize>(out);
+	}
+}
+
+NTAPI NTSTATUS RtlGetCompressionWorkSpaceSize(
+	USHORT compression_format_and_engine,
+	PULONG compress_buffer_workspace_size,
+	PULONG compress_fragment_workspace_size) {
+	switch (compression_format_and_engine & COMPRESSION_FORMAT_MASK) {
+		case COMPRESSION_FORMAT_NONE:
+		case COMPRESSION_FORMAT_DEFAULT:
+			return STATUS_INVALID_PARAMETER;
+		case COMPRESSION_FORMAT_LZNT1:
+			*compress_buffer_workspace_size = LZNT1_HASH_SIZE * sizeof(i16);
+			*compress_fragment_workspace_size = 0;
+			return STATUS_SUCCESS;
+		default:
+			return STATUS_UNSUPPORTED_COMPRESSION;
+	}
+}
+
+NTAPI NTSTATUS RtlCompressBuffer(
+	USHORT compression_format_and_engine,
+	PUCHAR uncompressed_buffer,
+	ULONG uncompressed_buffer_size,
+	PUCHAR compressed_buffer,
+	ULONG compressed_buffer_size,
+	ULONG,
+	PULONG final_compressed_size,
+	PVOID work_space) {
+	switch (compression_format_and_engine & COMPRESSION_FORMAT_MASK) {
+		case COMPRESSION_FORMAT_NONE:
+		case COMPRESSION_FORMAT_DEFAULT:
+			return STATUS_INVALID_PARAMETER;
+		case COMPRESSION_FORMAT_LZNT1:
+			break;
+		default:
+			return STATUS_UNSUPPORTED_COMPRESSION;
+	}
+
+	auto* head = static_cast<i16*>(work_space);
+
+	usize out = 0;
+	for (usize in = 0; in < uncompressed_buffer_size; in += LZNT1_CHUNK_SIZE) {
+		usize chunk_size = hz::min(usize {uncompressed_buffer_size} - in, LZNT1_CHUNK_SIZE);
+		if (compressed_buffer_size - out < 2) {
+			return STATUS_BUFFER_TOO_SMALL;
+		}
+
+		// chunks that don't shrink are stored as is
+		usize cap = hz::min(compressed_buffer_size - out - 2, chunk_size - 1);
+		auto* dst = compressed_buffer + out + 2;
+		u16 header;
+		usize size = lznt1_compress_chunk(uncompressed_buffer + in, chunk_size, dst, cap, head);
+		if (size) {
+			header = LZNT1_SIGNATURE | LZNT1_COMPRESSED | (size + 2 - 3);
+		}
+		else {
+			if (compressed_buffer_size - out - 2 < chunk_size) {
+				return STATUS_BUFFER_TOO_SMALL;
+			}
+			memcpy(dst, uncompressed_buffer + in, chunk_size);
+			size = chunk_size;
+			header = LZNT1_SIGNATURE | (size + 2 - 3);
+		}
+
+		compressed_buffer[out] = header & 0xFF;
+		compressed_buffer[out + 1] = header >> 8;
+		out += 2 + size;
+	}
+
+	// the terminator is optional and isn't part of the compressed size
+	if (compressed_buffer_size - out >= 2) {
+		compressed_buffer[out] = 0;
+		compressed_buffer[out + 1] = 0;
+	}
+
+	*final_compressed_size = out;
+	return STATUS_SUCCESS;
+}
+
+NTAPI NTSTATUS RtlDecompressBuffer(
+	USHORT compression_format,
+	PUCHAR uncompressed_buffer,
+	ULONG uncompressed_buffer_size,
+	PUCHAR compressed_buffer,
+	ULONG compressed_buffer_size,
+	PULONG final_uncompressed_size) {
+	switch (compression_format & COMPRESSION_FORMAT_MASK) {
+		case COMPRESSION_FORMAT_NONE:
+		case COMPRESSION_FORMAT_DEFAULT:
+			return STATUS_INVALID_PARAMETER;
+		case COMPRESSION_FORMAT_LZNT1:
+			break;
+		default:
+			return STATUS_UNSUPPORTED_COMPRESSION;
+	}
+
+	usize in = 0;
+	usize out = 0;
+	while (compressed_buffer_size - in >= 2 && out < uncompressed_buffer_size) {
+		u16 header = compressed_buffer[in] | compressed_buffer[in + 1] << 8;
+		if (!header) {
+			break;
+		}
+
+		usize chunk_size = (header & 0xFFF) + 3;
+		if (chunk_size > compressed_buffer_size - in) {
+			return STATUS_BAD_COMPRESSION_BUFFER;
+		}
+
+		auto* src = compressed_buffer + in + 2;
+		usize cap = uncompressed_buffer_size - out;
+		usize size;
+		if (header & LZNT1_COMPRESSED) {
+			auto result = lznt1_decompress_chunk(src, chunk_size - 2, uncompressed_buffer + out, cap);
+			if (result < 0) {
+				return STATUS_BAD_COMPRESSION_BUFFER;
+			}
+			size = static_cast<usize>(result);
+		}
+		else {
+			size = hz::min(chunk_size - 2, cap);
+			memcpy(uncompressed_buffer + out, src, size);
+		}
+
+		in += chunk_size;
+		out += size;
+
+		// a chunk that decompresses to less than the chunk size is padded with zeroes if more follow
+		if (size < LZNT1_CHUNK_SIZE && compressed_buffer_size - in >= 2 &&
+			(compressed_buffer[in] | compressed_buffer[in + 1])) {
+			usize pad = hz::min(LZNT1_CHUNK_SIZE - size, uncompressed_buffer_size - out);
+			memset(uncompressed_buffer + out, 0, pad);
+			out += pad;
+		}
+	}
+
+	*final_uncompressed_size = out;
+	return STATUS_SUCCESS;
+}
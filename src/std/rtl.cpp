@@ -604,7 +604,7 @@ NTAPI ULONG RtlFindClearBitsAndSet(RTL_BITMAP* bitmap, ULONG number_to_find, ULO
 	// todo improve
 	ULONG start = hint_index;
 	while (true) {
-		for (ULONG index = start; index < bitmap->size_of_bit_map;) {
+		for (ULONG index = start; index + number_to_find <= bitmap->size_of_bit_map;) {
 			bool found = true;
 			for (ULONG i = 0; i < number_to_find; ++i) {
 				auto value = ptr[(index + i) / 32];
@@ -175,3 +175,31 @@ NTAPI extern "C" NTSTATUS RtlQueryRegistryValues(
 	RTL_QUERY_TABLE* query_table,
 	PVOID ctx,
 	PVOID environment);
+
+#define COMPRESSION_FORMAT_NONE 0
+#define COMPRESSION_FORMAT_DEFAULT 1
+#define COMPRESSION_FORMAT_LZNT1 2
+#define COMPRESSION_FORMAT_MASK 0xFF
+#define COMPRESSION_ENGINE_STANDARD 0
+#define COMPRESSION_ENGINE_MAXIMUM 0x100
+
+NTAPI extern "C" NTSTATUS RtlGetCompressionWorkSpaceSize(
+	USHORT compression_format_and_engine,
+	PULONG compress_buffer_workspace_size,
+	PULONG compress_fragment_workspace_size);
+NTAPI extern "C" NTSTATUS RtlCompressBuffer(
+	USHORT compression_format_and_engine,
+	PUCHAR uncompressed_buffer,
+	ULONG uncompressed_buffer_size,
+	PUCHAR compressed_buffer,
+	ULONG compressed_buffer_size,
+	ULONG uncompressed_chunk_size,
+	PULONG final_compressed_size,
+	PVOID work_space);
+NTAPI extern "C" NTSTATUS RtlDecompressBuffer(
+	USHORT compression_format,
+	PUCHAR uncompressed_buffer,
+	ULONG uncompressed_buffer_size,
+	PUCHAR compressed_buffer,
+	ULONG compressed_buffer_size,
+	PULONG final_uncompressed_size);
@@ -3,6 +3,11 @@
 #include "sched/thread.hpp"
 #include "syscalls.hpp"
 #include "misc.hpp"
+#include "mem/mm.hpp"
+#include "mem/section.hpp"
+#include "sched/ps.hpp"
+#include "sched/timer.hpp"
+#include "sched/wait.hpp"
 #include "utils/except_internals.hpp"
 #include <hz/array.hpp>
 #include <hz/pair.hpp>
@@ -32,15 +37,163 @@ extern "C" NTAPI NTSTATUS NtContinue(CONTEXT* ctx, BOOLEAN test_alert) {
 
 static constexpr auto SYSCALL_ARRAY = []() {
 	hz::array<hz::pair<kstd::string_view, SyscallFn>, SYS_MAX> arr {};
-	arr[SYS_ALLOCATE_VIRTUAL_MEMORY] = {"NtAllocateVirtualMemory", nullptr};
-	arr[SYS_FREE_VIRTUAL_MEMORY] = {"NtFreeVirtualMemory", nullptr};
-	arr[SYS_PROTECT_VIRTUAL_MEMORY] = {"NtProtectVirtualMemory", nullptr};
+	arr[SYS_ALLOCATE_VIRTUAL_MEMORY] = {"NtAllocateVirtualMemory", [](SyscallFrame* frame) {
+		u64 allocation_type;
+		u64 page_protection;
+		if (!frame->arg4(allocation_type) || !frame->arg5(page_protection)) {
+			*frame->ret() = STATUS_ACCESS_VIOLATION;
+			return;
+		}
+
+		*frame->ret() = NtAllocateVirtualMemory(
+			reinterpret_cast<HANDLE>(*frame->arg0()),
+			reinterpret_cast<PVOID*>(frame->arg1()),
+			frame->arg2(),
+			reinterpret_cast<PSIZE_T>(frame->arg3()),
+			allocation_type,
+			page_protection);
+	}};
+	arr[SYS_FREE_VIRTUAL_MEMORY] = {"NtFreeVirtualMemory", [](SyscallFrame* frame) {
+		*frame->ret() = NtFreeVirtualMemory(
+			reinterpret_cast<HANDLE>(*frame->arg0()),
+			reinterpret_cast<PVOID*>(frame->arg1()),
+			reinterpret_cast<PSIZE_T>(frame->arg2()),
+			frame->arg3());
+	}};
+	arr[SYS_PROTECT_VIRTUAL_MEMORY] = {"NtProtectVirtualMemory", [](SyscallFrame* frame) {
+		u64 old_protection;
+		if (!frame->arg4(old_protection)) {
+			*frame->ret() = STATUS_ACCESS_VIOLATION;
+			return;
+		}
+
+		*frame->ret() = NtProtectVirtualMemory(
+			reinterpret_cast<HANDLE>(*frame->arg0()),
+			reinterpret_cast<PVOID*>(frame->arg1()),
+			reinterpret_cast<PSIZE_T>(frame->arg2()),
+			frame->arg3(),
+			reinterpret_cast<PULONG>(old_protection));
+	}};
 	arr[SYS_OPEN_FILE] = {"NtOpenFile", nullptr};
 	arr[SYS_READ_FILE] = {"NtReadFile", nullptr};
 	arr[SYS_CLOSE] = {"NtClose", nullptr};
 	arr[SYS_CONTINUE] = {"NtContinue", [](SyscallFrame* frame) {
 		*frame->ret() = NtContinue(reinterpret_cast<CONTEXT*>(*frame->arg0()), frame->arg1());
 	}};
+	arr[SYS_CREATE_SECTION] = {"NtCreateSection", [](SyscallFrame* frame) {
+		u64 section_page_protection;
+		u64 allocation_attribs;
+		u64 file_handle;
+		if (!frame->arg4(section_page_protection) || !frame->arg5(allocation_attribs) || !frame->arg6(file_handle)) {
+			*frame->ret() = STATUS_ACCESS_VIOLATION;
+			return;
+		}
+
+		*frame->ret() = NtCreateSection(
+			reinterpret_cast<PHANDLE>(*frame->arg0()),
+			frame->arg1(),
+			reinterpret_cast<OBJECT_ATTRIBUTES*>(frame->arg2()),
+			reinterpret_cast<PLARGE_INTEGER>(frame->arg3()),
+			section_page_protection,
+			allocation_attribs,
+			reinterpret_cast<HANDLE>(file_handle));
+	}};
+	arr[SYS_MAP_VIEW_OF_SECTION] = {"NtMapViewOfSection", [](SyscallFrame* frame) {
+		u64 commit_size;
+		u64 section_offset;
+		u64 view_size;
+		u64 inherit_disposition;
+		u64 allocation_type;
+		u64 win32_protect;
+		if (!frame->arg4(commit_size) || !frame->arg5(section_offset) || !frame->arg6(view_size) ||
+			!frame->arg7(inherit_disposition) || !frame->arg8(allocation_type) || !frame->arg9(win32_protect)) {
+			*frame->ret() = STATUS_ACCESS_VIOLATION;
+			return;
+		}
+
+		*frame->ret() = NtMapViewOfSection(
+			reinterpret_cast<HANDLE>(*frame->arg0()),
+			reinterpret_cast<HANDLE>(frame->arg1()),
+			reinterpret_cast<PVOID*>(frame->arg2()),
+			frame->arg3(),
+			commit_size,
+			reinterpret_cast<PLARGE_INTEGER>(section_offset),
+			reinterpret_cast<PSIZE_T>(view_size),
+			static_cast<SECTION_INHERIT>(inherit_disposition),
+			allocation_type,
+			win32_protect);
+	}};
+	arr[SYS_UNMAP_VIEW_OF_SECTION] = {"NtUnmapViewOfSection", [](SyscallFrame* frame) {
+		*frame->ret() = NtUnmapViewOfSection(
+			reinterpret_cast<HANDLE>(*frame->arg0()),
+			reinterpret_cast<PVOID>(frame->arg1()));
+	}};
+	arr[SYS_QUERY_VIRTUAL_MEMORY] = {"NtQueryVirtualMemory", [](SyscallFrame* frame) {
+		u64 memory_info_length;
+		u64 return_length;
+		if (!frame->arg4(memory_info_length) || !frame->arg5(return_length)) {
+			*frame->ret() = STATUS_ACCESS_VIOLATION;
+			return;
+		}
+
+		*frame->ret() = NtQueryVirtualMemory(
+			reinterpret_cast<HANDLE>(*frame->arg0()),
+			reinterpret_cast<PVOID>(frame->arg1()),
+			static_cast<MEMORY_INFORMATION_CLASS>(frame->arg2()),
+			reinterpret_cast<PVOID>(frame->arg3()),
+			memory_info_length,
+			reinterpret_cast<PSIZE_T>(return_length));
+	}};
+	arr[SYS_QUERY_INFORMATION_PROCESS] = {"NtQueryInformationProcess", [](SyscallFrame* frame) {
+		u64 return_length;
+		if (!frame->arg4(return_length)) {
+			*frame->ret() = STATUS_ACCESS_VIOLATION;
+			return;
+		}
+
+		*frame->ret() = NtQueryInformationProcess(
+			reinterpret_cast<HANDLE>(*frame->arg0()),
+			static_cast<PROCESSINFOCLASS>(frame->arg1()),
+			reinterpret_cast<PVOID>(frame->arg2()),
+			frame->arg3(),
+			reinterpret_cast<PULONG>(return_length));
+	}};
+	arr[SYS_CREATE_TIMER] = {"NtCreateTimer", [](SyscallFrame* frame) {
+		*frame->ret() = NtCreateTimer(
+			reinterpret_cast<PHANDLE>(*frame->arg0()),
+			frame->arg1(),
+			reinterpret_cast<OBJECT_ATTRIBUTES*>(frame->arg2()),
+			static_cast<TIMER_TYPE>(frame->arg3()));
+	}};
+	arr[SYS_SET_TIMER] = {"NtSetTimer", [](SyscallFrame* frame) {
+		u64 resume_timer;
+		u64 period;
+		u64 previous_state;
+		if (!frame->arg4(resume_timer) || !frame->arg5(period) || !frame->arg6(previous_state)) {
+			*frame->ret() = STATUS_ACCESS_VIOLATION;
+			return;
+		}
+
+		*frame->ret() = NtSetTimer(
+			reinterpret_cast<HANDLE>(*frame->arg0()),
+			reinterpret_cast<PLARGE_INTEGER>(frame->arg1()),
+			reinterpret_cast<PTIMER_APC_ROUTINE>(frame->arg2()),
+			reinterpret_cast<PVOID>(frame->arg3()),
+			resume_timer,
+			static_cast<LONG>(period),
+			reinterpret_cast<BOOLEAN*>(previous_state));
+	}};
+	arr[SYS_CANCEL_TIMER] = {"NtCancelTimer", [](SyscallFrame* frame) {
+		*frame->ret() = NtCancelTimer(
+			reinterpret_cast<HANDLE>(*frame->arg0()),
+			reinterpret_cast<BOOLEAN*>(frame->arg1()));
+	}};
+	arr[SYS_WAIT_FOR_SINGLE_OBJECT] = {"NtWaitForSingleObject", [](SyscallFrame* frame) {
+		*frame->ret() = NtWaitForSingleObject(
+			reinterpret_cast<HANDLE>(*frame->arg0()),
+			frame->arg1(),
+			reinterpret_cast<PLARGE_INTEGER>(frame->arg2()));
+	}};
 	return arr;
 }();
 